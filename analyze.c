@@ -0,0 +1,278 @@
+/***
+  SerenityAudio
+
+  Asset analysis. When a sample is first decoded we measure its peak, its
+  loudness and where the sound actually is - field recordings tend to have a
+  few seconds of nothing at either end. The cache keeps only the part worth
+  keeping and scales it so everything sits at about the same level.
+
+  The results go in a sidecar next to the file ( thunder.wav -> thunder.wav.sa )
+  so later boots can seek straight to the interesting part and skip the pass.
+  A sidecar is only trusted if the file's size and mtime, the format it was
+  decoded to and the silence threshold match what it was made from.
+
+  Loudness is BS.1770 style gated RMS over 400ms blocks, but without the
+  K-weighting filter, so it's in dBFS rather than LUFS. Close enough to line
+  up a cricket bed against an owl call.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+
+#include <jansson.h>
+
+#include "saplay.h"
+
+#define SA_SIDECAR_SUFFIX ".sa"
+#define SA_SIDECAR_VERSION 2
+
+// keep a little either side of the threshold crossings, tails more than heads
+// since reverb decays are what get cut
+#define SA_TRIM_HEAD_MS 10
+#define SA_TRIM_TAIL_MS 100
+
+#define SA_LOUDNESS_BLOCK_MS 400
+#define SA_LOUDNESS_HOP_MS 100
+#define SA_LOUDNESS_ABS_GATE_DB -70.0
+#define SA_LOUDNESS_REL_GATE_DB -10.0
+
+// normalization never pushes the peak past this, and never boosts by more
+// than SA_NORM_MAX_BOOST_DB so a distant, quiet recording keeps its hiss down
+#define SA_NORM_PEAK_DB -1.0
+#define SA_NORM_MAX_BOOST_DB 12.0
+
+// config, set before the cache starts
+float g_silence_db = SA_SILENCE_DB_DEFAULT;
+float g_loudness_target_db = SA_LOUDNESS_TARGET_DB_DEFAULT;
+bool g_normalize = true;
+
+static inline float lin_to_db(double v) {
+    return(v > 0.0 ? (float) (20.0 * log10(v)) : -INFINITY);
+}
+
+static inline float sample_value(const pa_sample_spec *spec, const void *data, size_t i) {
+    if (spec->format == PA_SAMPLE_S16NE) return(((const int16_t *) data)[i] / 32768.0f);
+    return(((const float *) data)[i]);
+}
+
+// frames is everything that was decoded; fills in all of a but a->frames
+void sa_analyze(const pa_sample_spec *spec, const void *data, sf_count_t frames, sa_analysis_t *a) {
+
+    int ch = spec->channels;
+    float thresh = powf(10.0f, g_silence_db / 20.0f);
+    float peak = 0.0f;
+    sf_count_t first = -1, last = -1;
+
+    // sum of squares per hop, across channels ( BS.1770 weights L/R/C at 1.0 )
+    size_t hop = (size_t) spec->rate * SA_LOUDNESS_HOP_MS / 1000;
+    size_t n_hops = hop ? (size_t) frames / hop : 0;
+    double *hop_sq = calloc(n_hops ? n_hops : 1, sizeof(double));
+
+    for (sf_count_t f = 0; f < frames; f++) {
+        double sq = 0.0;
+        bool loud = false;
+        for (int c = 0; c < ch; c++) {
+            float v = sample_value(spec, data, (size_t) f * ch + c);
+            float av = fabsf(v);
+            if (av > peak) peak = av;
+            if (av > thresh) loud = true;
+            sq += (double) v * v;
+        }
+        if (loud) {
+            if (first < 0) first = f;
+            last = f;
+        }
+        size_t h = (size_t) f / hop;
+        if (h < n_hops) hop_sq[h] += sq;
+    }
+
+    a->peak_db = lin_to_db(peak);
+
+    if (first < 0) {
+        // nothing above the threshold; keep it all and leave the level alone
+        a->start = 0;
+        a->end = frames;
+    }
+    else {
+        sf_count_t head = (sf_count_t) spec->rate * SA_TRIM_HEAD_MS / 1000;
+        sf_count_t tail = (sf_count_t) spec->rate * SA_TRIM_TAIL_MS / 1000;
+        a->start = first > head ? first - head : 0;
+        a->end = last + 1 + tail < frames ? last + 1 + tail : frames;
+    }
+
+    // 400ms blocks stepping 100ms; gate out the silence, then everything 10dB
+    // under what's left
+    size_t per_block = SA_LOUDNESS_BLOCK_MS / SA_LOUDNESS_HOP_MS;
+    size_t n_blocks = n_hops >= per_block ? n_hops - per_block + 1 : 0;
+    double *block_ms = malloc((n_blocks ? n_blocks : 1) * sizeof(double));
+    double abs_gate = pow(10.0, SA_LOUDNESS_ABS_GATE_DB / 10.0);
+    double sum = 0.0;
+    size_t n = 0;
+
+    for (size_t b = 0; b < n_blocks; b++) {
+        double sq = 0.0;
+        for (size_t h = 0; h < per_block; h++) sq += hop_sq[b + h];
+        block_ms[b] = sq / (hop * per_block);
+        if (block_ms[b] > abs_gate) {
+            sum += block_ms[b];
+            n++;
+        }
+    }
+
+    a->loudness_db = -INFINITY;
+    if (n) {
+        double rel_gate = (sum / n) * pow(10.0, SA_LOUDNESS_REL_GATE_DB / 10.0);
+        double gsum = 0.0;
+        size_t gn = 0;
+        for (size_t b = 0; b < n_blocks; b++) {
+            if (block_ms[b] > abs_gate && block_ms[b] > rel_gate) {
+                gsum += block_ms[b];
+                gn++;
+            }
+        }
+        if (gn) a->loudness_db = (float) (10.0 * log10(gsum / gn));
+    }
+    else if (frames > 0 && n_blocks == 0) {
+        // shorter than one block, a plain RMS will do
+        double sq = 0.0;
+        for (size_t i = 0; i < (size_t) frames * ch; i++) {
+            double v = sample_value(spec, data, i);
+            sq += v * v;
+        }
+        if (sq > 0.0) a->loudness_db = (float) (10.0 * log10(sq / frames));
+    }
+
+    free(block_ms);
+    free(hop_sq);
+}
+
+// the linear gain to bring a to the target, 1.0 if normalization is off or
+// there's nothing to go on
+float sa_analysis_gain(const sa_analysis_t *a) {
+
+    if (!g_normalize || !isfinite(a->loudness_db) || !isfinite(a->peak_db)) return(1.0f);
+
+    float db = g_loudness_target_db - a->loudness_db;
+    if (db > SA_NORM_MAX_BOOST_DB) db = SA_NORM_MAX_BOOST_DB;
+    if (db > SA_NORM_PEAK_DB - a->peak_db) db = SA_NORM_PEAK_DB - a->peak_db;
+    return(powf(10.0f, db / 20.0f));
+}
+
+/*
+** sidecar
+*/
+
+static char *sidecar_path(const char *path) {
+    size_t len = strlen(path) + sizeof(SA_SIDECAR_SUFFIX);
+    char *p = malloc(len);
+    snprintf(p, len, "%s" SA_SIDECAR_SUFFIX, path);
+    return(p);
+}
+
+// json has no infinity; a silent file's levels go in as null
+static json_t *db_to_json(float db) {
+    return(isfinite(db) ? json_real(db) : json_null());
+}
+
+// the measurements are of the decoded samples, which a fixed point build gets differently
+static const char *format_name(pa_sample_format_t format) {
+    return(format == PA_SAMPLE_S16NE ? "s16" : "float32");
+}
+
+static float json_to_db(json_t *js) {
+    return(json_is_number(js) ? (float) json_number_value(js) : -INFINITY);
+}
+
+// true if there's a sidecar that still describes this file
+bool sa_analysis_load(const char *path, const SF_INFO *sfinfo, pa_sample_format_t format, sa_analysis_t *a) {
+
+    struct stat st;
+    if (stat(path, &st) != 0) return(false);
+
+    char *sc = sidecar_path(path);
+    json_t *js = json_load_file(sc, 0, NULL);
+    free(sc);
+    if (!js) return(false);
+
+    const char *fmt = json_string_value(json_object_get(js, "format"));
+    bool ok = json_integer_value(json_object_get(js, "version")) == SA_SIDECAR_VERSION
+        && fmt && strcmp(fmt, format_name(format)) == 0
+        && json_integer_value(json_object_get(js, "size")) == (json_int_t) st.st_size
+        && json_integer_value(json_object_get(js, "mtime")) == (json_int_t) st.st_mtime
+        && json_integer_value(json_object_get(js, "frames")) == (json_int_t) sfinfo->frames
+        && json_integer_value(json_object_get(js, "rate")) == sfinfo->samplerate
+        && json_integer_value(json_object_get(js, "channels")) == sfinfo->channels
+        && fabs(json_number_value(json_object_get(js, "silence_db")) - g_silence_db) < 0.01;
+
+    if (ok) {
+        a->frames = sfinfo->frames;
+        a->start = json_integer_value(json_object_get(js, "start"));
+        a->end = json_integer_value(json_object_get(js, "end"));
+        a->peak_db = json_to_db(json_object_get(js, "peak_db"));
+        a->loudness_db = json_to_db(json_object_get(js, "loudness_db"));
+        ok = a->start >= 0 && a->start < a->end && a->end <= a->frames;
+    }
+
+    json_decref(js);
+    return(ok);
+}
+
+// best effort; the sounds directory might well be read only
+void sa_analysis_save(const char *path, const SF_INFO *sfinfo, pa_sample_format_t format, const sa_analysis_t *a) {
+
+    struct stat st;
+    if (stat(path, &st) != 0) return;
+
+    json_t *js = json_object();
+    json_object_set_new(js, "version", json_integer(SA_SIDECAR_VERSION));
+    json_object_set_new(js, "size", json_integer(st.st_size));
+    json_object_set_new(js, "mtime", json_integer(st.st_mtime));
+    json_object_set_new(js, "frames", json_integer(a->frames));
+    json_object_set_new(js, "rate", json_integer(sfinfo->samplerate));
+    json_object_set_new(js, "channels", json_integer(sfinfo->channels));
+    json_object_set_new(js, "format", json_string(format_name(format)));
+    json_object_set_new(js, "silence_db", json_real(g_silence_db));
+    json_object_set_new(js, "start", json_integer(a->start));
+    json_object_set_new(js, "end", json_integer(a->end));
+    json_object_set_new(js, "peak_db", db_to_json(a->peak_db));
+    json_object_set_new(js, "loudness_db", db_to_json(a->loudness_db));
+
+    // write aside and rename, so a reader never sees half a file
+    char *sc = sidecar_path(path);
+    size_t tlen = strlen(sc) + 5;
+    char *tmp = malloc(tlen);
+    snprintf(tmp, tlen, "%s.tmp", sc);
+
+    if (json_dump_file(js, tmp, JSON_INDENT(2)) != 0 || rename(tmp, sc) != 0) {
+        if (g_verbose) fprintf(stderr, "analyze: could not write %s\n", sc);
+        remove(tmp);
+    }
+
+    free(tmp);
+    free(sc);
+    json_decref(js);
+}
@@ -0,0 +1,495 @@
+/***
+  SerenityAudio
+
+  The sample cache. Every file the scene can play is decoded once into memory
+  and shared by every voice that plays it; bullfrog_trigger.wav three times over
+  is one copy.
+
+  Each file is analyzed as it loads ( analyze.c ): silent heads and tails are
+  cut and the level normalized, so what's cached is only what gets heard. It's
+  then put in a shape the mix can play directly: the mix rate, at most stereo,
+  and 16 bit only if the mix is fixed point.
+
+  Decoding happens on a pool of worker threads, one per core, so boot takes about
+  as long as the biggest file rather than the sum of all of them. Work is taken
+  in priority order, so the ambients and the first soundscape are ready, and
+  playing, while the long tail is still loading. When a sample is done the
+  worker passes it to the mainloop through a pipe, and that's the only way the
+  mainloop learns about it - no locks on the audio side.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "saplay.h"
+
+#define SA_CACHE_MAX_WORKERS 8
+#define SA_CACHE_READ_CHUNK 65536 // frames, when the file doesn't say how long it is
+
+// load time sample rate conversion
+#define SA_RESAMPLE_TAPS 16
+#define SA_RESAMPLE_PHASES 256
+
+static sa_sample_t *g_samples = NULL;   // every sample ever requested, mainloop owns the list
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sa_sample_t *queue;     // sorted by priority, FIFO within one
+    bool stop;
+} g_work = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static pthread_t g_workers[SA_CACHE_MAX_WORKERS];
+static int g_n_workers = 0;
+
+static int g_cache_pipe[2] = { -1, -1 };
+static pa_io_event *g_cache_io = NULL;
+static pa_mainloop_api *g_cache_api = NULL;
+
+static sa_cache_ready_fn_t g_ready_fn = NULL;
+
+// stats, read from http threads
+static pa_usec_t g_boot_usec = 0;
+static _Atomic int g_requested = 0;
+static _Atomic int g_ready = 0;
+static _Atomic int g_failed = 0;
+static _Atomic uint64_t g_bytes = 0;
+static _Atomic uint64_t g_trimmed_bytes = 0;
+static _Atomic int g_analyzed = 0;
+static _Atomic int64_t g_fully_loaded_ms = -1;
+
+/*
+** workers
+*/
+
+// more channels than the bus: keep the first two, in place
+static uint8_t *sample_narrow(sa_sample_t *s, uint8_t *data, sf_count_t frames) {
+
+    size_t ss = pa_sample_size(&s->spec);
+    int ch = s->spec.channels;
+
+    for (sf_count_t f = 0; f < frames; f++)
+        memmove(data + f * SA_MIX_CHANNELS * ss, data + f * ch * ss, SA_MIX_CHANNELS * ss);
+
+    if (g_verbose) fprintf(stderr, "cache: %s has %d channels, keeping the first %d\n", s->path, ch, SA_MIX_CHANNELS);
+    s->spec.channels = SA_MIX_CHANNELS;
+    return(realloc(data, frames * SA_MIX_CHANNELS * ss));
+}
+
+// To the mix rate, once, at load: a windowed sinc from a table of
+// SA_RESAMPLE_PHASES fractional positions, low passed when going down. Float
+// math even in the fixed point build, but it's never on the audio path.
+static uint8_t *sample_resample(sa_sample_t *s, uint8_t *data, sf_count_t *frames) {
+
+    double ratio = (double) s->spec.rate / g_mix_rate;   // input frames per output frame
+    double cutoff = ratio > 1.0 ? 1.0 / ratio : 1.0;
+    int ch = s->spec.channels;
+    bool s16 = s->spec.format == PA_SAMPLE_S16NE;
+
+    static const int half = SA_RESAMPLE_TAPS / 2;
+    float *table = malloc(SA_RESAMPLE_PHASES * SA_RESAMPLE_TAPS * sizeof(float));
+    for (int p = 0; p < SA_RESAMPLE_PHASES; p++) {
+        double frac = (double) p / SA_RESAMPLE_PHASES;
+        double sum = 0.0;
+        for (int k = 0; k < SA_RESAMPLE_TAPS; k++) {
+            double x = k - (half - 1) - frac;   // distance from the output point, in input frames
+            double sinc = x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+            double w = 0.42 + 0.5 * cos(M_PI * x / half) + 0.08 * cos(2.0 * M_PI * x / half); // Blackman
+            table[p * SA_RESAMPLE_TAPS + k] = (float) (sinc * w);
+            sum += sinc * w;
+        }
+        // unity at DC
+        for (int k = 0; k < SA_RESAMPLE_TAPS; k++) table[p * SA_RESAMPLE_TAPS + k] /= (float) sum;
+    }
+
+    sf_count_t in_frames = *frames;
+    sf_count_t out_frames = (sf_count_t) (in_frames / ratio);
+    size_t ss = s16 ? sizeof(int16_t) : sizeof(float);
+    uint8_t *out = out_frames > 0 ? malloc(out_frames * ch * ss) : NULL;
+
+    // a sliver shorter than one output frame has nothing to play
+    if (!out) {
+        fprintf(stderr, "cache: %s is too short to resample to %d\n", s->path, g_mix_rate);
+        free(table);
+        free(data);
+        *frames = 0;
+        return(NULL);
+    }
+
+    for (sf_count_t o = 0; o < out_frames; o++) {
+        double pos = o * ratio;
+        sf_count_t base = (sf_count_t) pos;
+        const float *t = &table[(int) ((pos - base) * SA_RESAMPLE_PHASES) * SA_RESAMPLE_TAPS];
+        for (int c = 0; c < ch; c++) {
+            float acc = 0.0f;
+            for (int k = 0; k < SA_RESAMPLE_TAPS; k++) {
+                sf_count_t i = base + k - (half - 1);
+                if (i < 0 || i >= in_frames) continue;
+                float v = s16 ? ((int16_t *) data)[i * ch + c] : ((float *) data)[i * ch + c];
+                acc += v * t[k];
+            }
+            if (s16) {
+                acc = acc > 32767.0f ? 32767.0f : acc < -32768.0f ? -32768.0f : acc;
+                ((int16_t *) out)[o * ch + c] = (int16_t) lrintf(acc);
+            }
+            else {
+                ((float *) out)[o * ch + c] = acc;
+            }
+        }
+    }
+
+    if (g_verbose) fprintf(stderr, "cache: %s resampled %u -> %d\n", s->path, s->spec.rate, g_mix_rate);
+
+    free(table);
+    free(data);
+    s->spec.rate = (uint32_t) g_mix_rate;
+    *frames = out_frames;
+    return(out);
+}
+
+// Decode the file into a buffer, keeping only the part the analysis says is
+// worth keeping, at the normalized level. Runs on a worker, touches only s.
+static bool sample_decode(sa_sample_t *s) {
+
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+
+    SNDFILE *sf = sf_open(s->path, SFM_READ, &sfinfo);
+    if (!sf) {
+        fprintf(stderr, "cache: failed to open '%s': %s\n", s->path, sf_strerror(NULL));
+        return(false);
+    }
+
+    s->spec.rate = (uint32_t) sfinfo.samplerate;
+    s->spec.channels = (uint8_t) sfinfo.channels;
+
+    // 16 bit and smaller ( and the telephone codecs ) stay 16 bit, the rest go to
+    // float - unless the mix is integer, then everything is 16 bit
+#ifdef SA_FIXED_POINT
+    s->spec.format = PA_SAMPLE_S16NE;
+    // without this a float file read as shorts comes back unscaled, ie near silence.
+    // sndfile scales to the file's own peak, which the normalization evens out again
+    int sub = sfinfo.format & SF_FORMAT_SUBMASK;
+    if (sub == SF_FORMAT_FLOAT || sub == SF_FORMAT_DOUBLE) sf_command(sf, SFC_SET_SCALE_FLOAT_INT_READ, NULL, SF_TRUE);
+#else
+    switch (sfinfo.format & SF_FORMAT_SUBMASK) {
+        case SF_FORMAT_PCM_16:
+        case SF_FORMAT_PCM_U8:
+        case SF_FORMAT_PCM_S8:
+        case SF_FORMAT_ULAW:
+        case SF_FORMAT_ALAW:
+            s->spec.format = PA_SAMPLE_S16NE;
+            break;
+        default:
+            s->spec.format = PA_SAMPLE_FLOAT32NE;
+            break;
+    }
+#endif
+
+    // with a good sidecar, read just the kept region
+    sa_analysis_t *a = &s->analysis;
+    bool known = sa_analysis_load(s->path, &sfinfo, s->spec.format, a);
+    if (known && a->start > 0 && sf_seek(sf, a->start, SEEK_SET) != a->start) known = false;
+
+    // the exact size when the length's known, only a stream of unknown length grows
+    size_t fsz = pa_frame_size(&s->spec);
+    sf_count_t limit = known ? a->end - a->start : sfinfo.frames > 0 ? sfinfo.frames : SF_COUNT_MAX;
+    sf_count_t alloc = limit != SF_COUNT_MAX ? limit : SA_CACHE_READ_CHUNK;
+    uint8_t *data = alloc > 0 ? malloc(alloc * fsz) : NULL;
+    sf_count_t have = 0;
+
+    while (data && have < limit) {
+        sf_count_t want = alloc - have;
+        sf_count_t got = s->spec.format == PA_SAMPLE_S16NE
+            ? sf_readf_short(sf, (short *) (data + have * fsz), want)
+            : sf_readf_float(sf, (float *) (data + have * fsz), want);
+        if (got <= 0) break;
+        have += got;
+        if (have == alloc && have < limit) {
+            uint8_t *more = realloc(data, alloc * 2 * fsz);
+            if (!more) break;
+            data = more;
+            alloc *= 2;
+        }
+    }
+
+    // belongs to the sndfile, copy it before closing
+    const char *title = sf_get_string(sf, SF_STR_TITLE);
+    if (title && title[0]) s->title = strdup(title);
+    sf_close(sf);
+
+    if (!data || have == 0) {
+        fprintf(stderr, "cache: no audio in '%s'\n", s->path);
+        free(data);
+        return(false);
+    }
+
+    if (known) {
+        s->from_sidecar = true;
+    }
+    else {
+        a->frames = have;
+        sa_analyze(&s->spec, data, have, a);
+        sa_analysis_save(s->path, &sfinfo, s->spec.format, a);
+
+        if (a->start > 0) memmove(data, data + a->start * fsz, (a->end - a->start) * fsz);
+        have = a->end - a->start;
+    }
+    if (have < alloc) data = realloc(data, have * fsz);
+
+    // counted here, in the file's own frames and format, before narrowing and resampling change both
+    s->trimmed_bytes = (size_t) (a->frames - (a->end - a->start)) * fsz;
+
+    // bake the normalization in, once, rather than on every write
+    s->norm_gain = sa_analysis_gain(a);
+    if (s->norm_gain != 1.0f) {
+        size_t n = (size_t) have * s->spec.channels;
+        if (s->spec.format == PA_SAMPLE_S16NE) {
+            int16_t *p = (int16_t *) data;
+            for (size_t i = 0; i < n; i++) {
+                float v = p[i] * s->norm_gain;
+                p[i] = v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t) v;
+            }
+        }
+        else {
+            float *p = (float *) data;
+            for (size_t i = 0; i < n; i++) p[i] *= s->norm_gain;
+        }
+    }
+
+    // into a shape the mix has a kernel for
+    if (s->spec.channels > SA_MIX_CHANNELS) data = sample_narrow(s, data, have);
+    if (s->spec.rate != (uint32_t) g_mix_rate) data = sample_resample(s, data, &have);
+    if (!data || have == 0) {
+        free(data);
+        return(false);
+    }
+    fsz = pa_frame_size(&s->spec);
+
+    // the guard frame, so a varispeed voice can always read one past where it is
+    data = realloc(data, (have + 1) * fsz);
+    memcpy(data + have * fsz, data, fsz);
+
+    s->data = data;
+    s->frames = have;
+    s->bytes = (have + 1) * fsz;
+    return(true);
+}
+
+static void *cache_worker(void *arg) {
+
+    sa_trace_thread_name("cache");
+
+    while (1) {
+
+        pthread_mutex_lock(&g_work.lock);
+        while (!g_work.stop && g_work.queue == NULL)
+            pthread_cond_wait(&g_work.cond, &g_work.lock);
+        if (g_work.stop) {
+            pthread_mutex_unlock(&g_work.lock);
+            break;
+        }
+        sa_sample_t *s = g_work.queue;
+        g_work.queue = s->queue_next;
+        s->queue_next = NULL;
+        s->state = SA_SAMPLE_LOADING;
+        pthread_mutex_unlock(&g_work.lock);
+
+        SA_TRACE_BEGIN("decode", s->priority);
+        pa_usec_t t0 = sa_timer_now();
+        s->state = sample_decode(s) ? SA_SAMPLE_READY : SA_SAMPLE_FAILED;
+        s->load_usec = sa_timer_now() - t0;
+        SA_TRACE_END("decode", s->frames);
+
+        // hand it to the mainloop; a pointer is well under PIPE_BUF so this is atomic
+        if (write(g_cache_pipe[1], &s, sizeof(s)) != sizeof(s)) {
+            fprintf(stderr, "cache: lost completion for %s\n", s->path);
+        }
+    }
+    return(NULL);
+}
+
+/*
+** mainloop side
+*/
+
+/* pa_io_event_cb_t */
+static void cache_io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+
+    sa_sample_t *s;
+
+    while (read(fd, &s, sizeof(s)) == sizeof(s)) {
+
+        if (s->state == SA_SAMPLE_READY) {
+            atomic_fetch_add(&g_ready, 1);
+            atomic_fetch_add(&g_bytes, s->bytes);
+            atomic_fetch_add(&g_trimmed_bytes, s->trimmed_bytes);
+            if (!s->from_sidecar) atomic_fetch_add(&g_analyzed, 1);
+            if (g_verbose) fprintf(stderr, "cache: loaded %s, %lld of %lld frames, peak %.1f dB loudness %.1f dB gain %.1f dB%s, %llu ms\n",
+                s->path, (long long) s->frames, (long long) s->analysis.frames,
+                s->analysis.peak_db, s->analysis.loudness_db, 20.0f * log10f(s->norm_gain),
+                s->from_sidecar ? " ( sidecar )" : "", (unsigned long long) (s->load_usec / 1000));
+        }
+        else {
+            atomic_fetch_add(&g_failed, 1);
+        }
+
+        if (atomic_load(&g_ready) + atomic_load(&g_failed) == atomic_load(&g_requested)) {
+            int64_t ms = (int64_t) ((sa_timer_now() - g_boot_usec) / 1000);
+            atomic_store(&g_fully_loaded_ms, ms);
+            fprintf(stderr, "all %d samples loaded, %lld ms after boot\n",
+                atomic_load(&g_requested), (long long) ms);
+        }
+
+        if (g_ready_fn) g_ready_fn(s);
+    }
+}
+
+// boot_usec is when main() started, from sa_timer_now()
+bool sa_cache_init(pa_mainloop_api *api, pa_usec_t boot_usec, sa_cache_ready_fn_t ready_fn) {
+
+    g_boot_usec = boot_usec;
+    g_ready_fn = ready_fn;
+
+    if (pipe(g_cache_pipe) != 0) {
+        fprintf(stderr, "cache: pipe failed: %s\n", strerror(errno));
+        return(false);
+    }
+    fcntl(g_cache_pipe[0], F_SETFL, O_NONBLOCK);
+
+    g_cache_api = api;
+    g_cache_io = api->io_new(api, g_cache_pipe[0], PA_IO_EVENT_INPUT, cache_io_cb, NULL);
+    if (!g_cache_io) {
+        fprintf(stderr, "cache: io_new failed\n");
+        return(false);
+    }
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > SA_CACHE_MAX_WORKERS) n = SA_CACHE_MAX_WORKERS;
+
+    g_work.stop = false;
+    for (g_n_workers = 0; g_n_workers < n; g_n_workers++) {
+        if (pthread_create(&g_workers[g_n_workers], NULL, cache_worker, NULL) != 0) {
+            fprintf(stderr, "cache: could only start %d workers\n", g_n_workers);
+            break;
+        }
+    }
+    if (g_verbose) fprintf(stderr, "cache: %d loader threads\n", g_n_workers);
+
+    return(g_n_workers > 0);
+}
+
+// Returns the sample for path, queueing it to load if it's new. A sample already
+// queued at a lower priority gets moved up. Lower numbers load first.
+sa_sample_t *sa_cache_request(const char *path, int priority) {
+
+    sa_sample_t *s;
+
+    for (s = g_samples; s; s = s->next) {
+        if (strcmp(s->path, path) == 0) break;
+    }
+
+    pthread_mutex_lock(&g_work.lock);
+
+    if (s) {
+        if (s->state != SA_SAMPLE_QUEUED || priority >= s->priority) {
+            pthread_mutex_unlock(&g_work.lock);
+            return(s);
+        }
+        // still waiting for a worker; pull it out and requeue further up
+        for (sa_sample_t **pp = &g_work.queue; *pp; pp = &(*pp)->queue_next) {
+            if (*pp == s) {
+                *pp = s->queue_next;
+                break;
+            }
+        }
+    }
+    else {
+        s = calloc(1, sizeof(sa_sample_t));
+        s->path = strdup(path);
+        s->state = SA_SAMPLE_QUEUED;
+        s->next = g_samples;
+        g_samples = s;
+        atomic_fetch_add(&g_requested, 1);
+    }
+
+    s->priority = priority;
+    sa_sample_t **pp = &g_work.queue;
+    while (*pp && (*pp)->priority <= priority) pp = &(*pp)->queue_next;
+    s->queue_next = *pp;
+    *pp = s;
+
+    pthread_cond_signal(&g_work.cond);
+    pthread_mutex_unlock(&g_work.lock);
+
+    return(s);
+}
+
+void sa_cache_done(void) {
+
+    pthread_mutex_lock(&g_work.lock);
+    g_work.stop = true;
+    g_work.queue = NULL;
+    pthread_cond_broadcast(&g_work.cond);
+    pthread_mutex_unlock(&g_work.lock);
+
+    for (int i = 0; i < g_n_workers; i++) pthread_join(g_workers[i], NULL);
+    g_n_workers = 0;
+
+    if (g_cache_io) {
+        g_cache_api->io_free(g_cache_io);
+        g_cache_io = NULL;
+    }
+    if (g_cache_pipe[0] >= 0) close(g_cache_pipe[0]);
+    if (g_cache_pipe[1] >= 0) close(g_cache_pipe[1]);
+    g_cache_pipe[0] = g_cache_pipe[1] = -1;
+
+    while (g_samples) {
+        sa_sample_t *s = g_samples;
+        g_samples = s->next;
+        free(s->data);
+        free(s->title);
+        free(s->path);
+        free(s);
+    }
+}
+
+// any thread
+void sa_cache_stats(sa_cache_stats_t *stats) {
+    stats->requested = atomic_load(&g_requested);
+    stats->ready = atomic_load(&g_ready);
+    stats->failed = atomic_load(&g_failed);
+    stats->bytes = atomic_load(&g_bytes);
+    stats->trimmed_bytes = atomic_load(&g_trimmed_bytes);
+    stats->analyzed = atomic_load(&g_analyzed);
+    stats->fully_loaded_ms = atomic_load(&g_fully_loaded_ms);
+}
@@ -0,0 +1,383 @@
+/***
+  SerenityAudio
+
+  Speaker protection, per sink, on the mixed bus before it's stored to the
+  stream: a cascade of biquads ( a high-pass to keep small drivers off their
+  excursion limit, plus whatever EQ ) and then a lookahead peak limiter. The
+  limiter's gain closes in on its target exponentially, so it's most of the way
+  down when a peak comes out of the delay and all but a sliver of the overshoot
+  is caught. Doing it here instead of module-ladspa-sink means no extra sink,
+  no extra buffering and no extra copy.
+
+  Works on the accumulator block, in whichever arithmetic the mix was built
+  with. Both channels go through each stage together, with the channel as the
+  inner loop of constant 2, which the compiler turns into one vector op; the
+  limiter's gain is linked across them so the image doesn't move.
+
+  Coefficients come from the RBJ Audio EQ Cookbook.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "saplay.h"
+
+#define CH SA_MIX_CHANNELS
+
+const char *g_biquad_names[] = { "highpass", "lowpass", "peaking", "lowshelf", "highshelf", NULL };
+
+/*
+** the two arithmetics, as in mix.c
+*/
+
+#ifdef SA_FIXED_POINT
+
+// Q28 coefficients hold -8 .. 8, which a high shelf boosting much past +12 dB
+// outgrows; designs that don't fit are refused at setup. Gains are Q30 like the mix's
+typedef int32_t dsp_coef_t;
+typedef int64_t dsp_wide_t;
+typedef int32_t dsp_gain_t;
+
+#define DSP_COEF(x)         ((int32_t) lrint((x) * (1 << DSP_SHIFT)))
+#define DSP_SHIFT           28
+#define DSP_UNITY           (1 << 30)
+#define DSP_GAIN(x)         ((int32_t) lrint((x) * (1 << 30)))
+#define DSP_APPLY(x, g)     ((int32_t) (((int64_t) (x) * (g)) >> 30))
+#define DSP_TOWARD(g, t, c) ((g) + (int32_t) (((int64_t) ((t) - (g)) * (c)) >> 30))
+#define DSP_RATIO(a, b)     ((int32_t) (((int64_t) (a) << 30) / (b)))  // a < b
+#define DSP_ABS(x)          ((x) < 0 ? -(x) : (x))
+#define DSP_FULL_SCALE      32768.0
+#define DSP_COEF_MAX        ((double) INT32_MAX / (1 << DSP_SHIFT))
+
+#else
+
+typedef float dsp_coef_t;
+typedef float dsp_wide_t;
+typedef float dsp_gain_t;
+
+#define DSP_COEF(x)         ((float) (x))
+#define DSP_UNITY           1.0f
+#define DSP_GAIN(x)         ((float) (x))
+#define DSP_APPLY(x, g)     ((x) * (g))
+#define DSP_TOWARD(g, t, c) ((g) + ((t) - (g)) * (c))
+#define DSP_RATIO(a, b)     ((a) / (b))
+#define DSP_ABS(x)          fabsf(x)
+#define DSP_FULL_SCALE      1.0
+#define DSP_COEF_MAX        HUGE_VAL
+
+#endif
+
+typedef struct dsp_biquad {
+    dsp_coef_t b0, b1, b2, a1, a2;      // normalized, a0 is 1
+    sa_mix_acc_t x1[CH], x2[CH], y1[CH], y2[CH];
+    dsp_wide_t err[CH];     // fixed: what the last output's shift dropped
+} dsp_biquad_t;
+
+typedef struct dsp_limiter {
+    sa_mix_acc_t threshold;
+    dsp_gain_t gain;
+    dsp_gain_t attack;      // per frame coefficients toward the target gain
+    dsp_gain_t release;
+    int lookahead;          // frames of delay, at least 1
+    sa_mix_acc_t *delay;    // lookahead frames
+    int delay_pos;
+    // sliding max of the frame peaks over the lookahead window: a deque of
+    // decreasing peaks and the frame each came from
+    sa_mix_acc_t *dq_peak;
+    uint32_t *dq_frame;
+    int dq_head, dq_n;
+    uint32_t frame;
+} dsp_limiter_t;
+
+typedef struct sa_dsp {
+    bool active;
+    int n_biquads;
+    dsp_biquad_t biquads[SA_DSP_MAX_BIQUADS];
+    bool limiter;
+    dsp_limiter_t lim;
+} sa_dsp_t;
+
+// mainloop only, like the mix
+static sa_dsp_t g_dsp[MAX_SA_SINKS];
+
+/*
+** setup, from the config
+*/
+
+static bool dsp_biquad_design(dsp_biquad_t *bq, const sa_biquad_config_t *c) {
+
+    if (c->freq <= 0.0f || c->freq >= g_mix_rate / 2) return(false);
+    if (c->q <= 0.0f || c->q > SA_DSP_MAX_Q) return(false);
+    if (fabsf(c->gain_db) > SA_DSP_MAX_GAIN_DB) return(false);
+
+    double w0 = 2.0 * M_PI * c->freq / g_mix_rate;
+    double cw = cos(w0), sw = sin(w0);
+    double alpha = sw / (2.0 * c->q);
+    double A = pow(10.0, c->gain_db / 40.0);
+    double b0, b1, b2, a0, a1, a2;
+
+    switch (c->type) {
+        case SA_BIQUAD_HIGHPASS:
+            b0 = (1.0 + cw) / 2.0; b1 = -(1.0 + cw); b2 = b0;
+            a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+            break;
+        case SA_BIQUAD_LOWPASS:
+            b0 = (1.0 - cw) / 2.0; b1 = 1.0 - cw; b2 = b0;
+            a0 = 1.0 + alpha; a1 = -2.0 * cw; a2 = 1.0 - alpha;
+            break;
+        case SA_BIQUAD_PEAKING:
+            b0 = 1.0 + alpha * A; b1 = -2.0 * cw; b2 = 1.0 - alpha * A;
+            a0 = 1.0 + alpha / A; a1 = -2.0 * cw; a2 = 1.0 - alpha / A;
+            break;
+        case SA_BIQUAD_LOWSHELF: {
+            double sq = 2.0 * sqrt(A) * alpha;
+            b0 = A * ((A + 1) - (A - 1) * cw + sq);
+            b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+            b2 = A * ((A + 1) - (A - 1) * cw - sq);
+            a0 = (A + 1) + (A - 1) * cw + sq;
+            a1 = -2 * ((A - 1) + (A + 1) * cw);
+            a2 = (A + 1) + (A - 1) * cw - sq;
+            break;
+        }
+        case SA_BIQUAD_HIGHSHELF: {
+            double sq = 2.0 * sqrt(A) * alpha;
+            b0 = A * ((A + 1) + (A - 1) * cw + sq);
+            b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+            b2 = A * ((A + 1) + (A - 1) * cw - sq);
+            a0 = (A + 1) - (A - 1) * cw + sq;
+            a1 = 2 * ((A - 1) - (A + 1) * cw);
+            a2 = (A + 1) - (A - 1) * cw - sq;
+            break;
+        }
+        default:
+            return(false);
+    }
+
+    // a big high shelf boost can still want more than the fixed point coefficients hold
+    double k[5] = { b0 / a0, b1 / a0, b2 / a0, a1 / a0, a2 / a0 };
+    for (int i = 0; i < 5; i++) {
+        if (fabs(k[i]) >= DSP_COEF_MAX) return(false);
+    }
+
+    memset(bq, 0, sizeof(dsp_biquad_t));
+    bq->b0 = DSP_COEF(b0 / a0);
+    bq->b1 = DSP_COEF(b1 / a0);
+    bq->b2 = DSP_COEF(b2 / a0);
+    bq->a1 = DSP_COEF(a1 / a0);
+    bq->a2 = DSP_COEF(a2 / a0);
+    return(true);
+}
+
+// whether sa_dsp_setup would take it, without touching the sink; a reload checks them all first
+bool sa_dsp_check(int sink, const sa_dsp_config_t *cfg) {
+
+    if (sink < 0 || sink >= MAX_SA_SINKS) return(false);
+    if (cfg->n_biquads > SA_DSP_MAX_BIQUADS) return(false);
+
+    for (int i = 0; i < cfg->n_biquads; i++) {
+        dsp_biquad_t bq;
+        if (!dsp_biquad_design(&bq, &cfg->biquads[i])) {
+            fprintf(stderr, "dsp: sink %d biquad %d: freq must be under half the mix rate, q 0..%d and gain_db -%d..%d, "
+                "and the response has to fit the fixed point coefficients\n", sink, i, SA_DSP_MAX_Q, SA_DSP_MAX_GAIN_DB, SA_DSP_MAX_GAIN_DB);
+            return(false);
+        }
+    }
+
+    if (cfg->limiter && (cfg->lookahead_ms < 0 || cfg->lookahead_ms > SA_DSP_MAX_LOOKAHEAD_MS ||
+                         cfg->release_ms <= 0 || cfg->threshold_db > 0)) {
+        fprintf(stderr, "dsp: sink %d limiter: threshold_db <= 0, lookahead_ms 0..%d and release_ms > 0\n",
+            sink, SA_DSP_MAX_LOOKAHEAD_MS);
+        return(false);
+    }
+    return(true);
+}
+
+// called at config load and reload, on the mainloop like the mix. False if it makes no sense.
+bool sa_dsp_setup(int sink, const sa_dsp_config_t *cfg) {
+
+    if (!sa_dsp_check(sink, cfg)) return(false);
+    sa_dsp_t *d = &g_dsp[sink];
+
+    for (int i = 0; i < cfg->n_biquads; i++) dsp_biquad_design(&d->biquads[i], &cfg->biquads[i]);
+    d->n_biquads = cfg->n_biquads;
+
+    if (cfg->limiter) {
+        dsp_limiter_t *l = &d->lim;
+        l->lookahead = (int) (cfg->lookahead_ms * g_mix_rate / 1000);
+        if (l->lookahead < 1) l->lookahead = 1;
+        l->threshold = (sa_mix_acc_t) (pow(10.0, cfg->threshold_db / 20.0) * DSP_FULL_SCALE);
+        // close to all the way down by the time the peak comes out of the delay
+        l->attack = DSP_GAIN(1.0 - exp(-5.0 / l->lookahead));
+        l->release = DSP_GAIN(1.0 - exp(-1000.0 / (cfg->release_ms * g_mix_rate)));
+
+        free(l->delay);
+        free(l->dq_peak);
+        free(l->dq_frame);
+        l->delay = malloc((size_t) l->lookahead * CH * sizeof(sa_mix_acc_t));
+        l->dq_peak = malloc((size_t) (l->lookahead + 1) * sizeof(sa_mix_acc_t));
+        l->dq_frame = malloc((size_t) (l->lookahead + 1) * sizeof(uint32_t));
+    }
+    d->limiter = cfg->limiter;
+
+    d->active = d->n_biquads > 0 || d->limiter;
+    sa_dsp_reset(sink);
+    return(true);
+}
+
+// clear the filter and limiter history, when the sink's stream starts
+void sa_dsp_reset(int sink) {
+
+    sa_dsp_t *d = &g_dsp[sink];
+    for (int i = 0; i < d->n_biquads; i++) {
+        dsp_biquad_t *bq = &d->biquads[i];
+        memset(bq->x1, 0, sizeof(bq->x1));
+        memset(bq->x2, 0, sizeof(bq->x2));
+        memset(bq->y1, 0, sizeof(bq->y1));
+        memset(bq->y2, 0, sizeof(bq->y2));
+        memset(bq->err, 0, sizeof(bq->err));
+    }
+    if (d->limiter) {
+        dsp_limiter_t *l = &d->lim;
+        memset(l->delay, 0, (size_t) l->lookahead * CH * sizeof(sa_mix_acc_t));
+        l->delay_pos = 0;
+        l->dq_head = l->dq_n = 0;
+        l->frame = 0;
+        l->gain = DSP_UNITY;
+    }
+}
+
+bool sa_dsp_active(int sink) {
+    return(g_dsp[sink].active);
+}
+
+/*
+** processing, mainloop only
+*/
+
+// Direct form I. In the fixed build the bits the shift drops are carried into
+// the next output; otherwise a low high-pass, with its pole right next to 1,
+// turns the truncation into a slow DC walk.
+static void dsp_biquad(dsp_biquad_t *restrict bq, sa_mix_acc_t *restrict acc, size_t frames) {
+
+    const dsp_coef_t b0 = bq->b0, b1 = bq->b1, b2 = bq->b2, a1 = bq->a1, a2 = bq->a2;
+    sa_mix_acc_t x1[CH], x2[CH], y1[CH], y2[CH];
+    memcpy(x1, bq->x1, sizeof(x1));
+    memcpy(x2, bq->x2, sizeof(x2));
+    memcpy(y1, bq->y1, sizeof(y1));
+    memcpy(y2, bq->y2, sizeof(y2));
+#ifdef SA_FIXED_POINT
+    dsp_wide_t err[CH];
+    memcpy(err, bq->err, sizeof(err));
+#endif
+
+    for (size_t f = 0; f < frames; f++) {
+        sa_mix_acc_t *x = acc + f * CH;
+        for (int c = 0; c < CH; c++) {
+            dsp_wide_t sum = (dsp_wide_t) b0 * x[c] + (dsp_wide_t) b1 * x1[c] + (dsp_wide_t) b2 * x2[c]
+                           - (dsp_wide_t) a1 * y1[c] - (dsp_wide_t) a2 * y2[c];
+#ifdef SA_FIXED_POINT
+            sum += err[c];
+            sa_mix_acc_t y = (sa_mix_acc_t) (sum >> DSP_SHIFT);
+            err[c] = sum - ((dsp_wide_t) y << DSP_SHIFT);
+#else
+            sa_mix_acc_t y = sum;
+#endif
+            x2[c] = x1[c];
+            x1[c] = x[c];
+            y2[c] = y1[c];
+            y1[c] = y;
+            x[c] = y;
+        }
+    }
+
+#ifdef SA_FIXED_POINT
+    memcpy(bq->err, err, sizeof(err));
+#else
+    // after silence the feedback decays into denormals, which are very slow
+    for (int c = 0; c < CH; c++) {
+        if (fabsf(y1[c]) < 1e-15f && fabsf(y2[c]) < 1e-15f) y1[c] = y2[c] = 0.0f;
+    }
+#endif
+    memcpy(bq->x1, x1, sizeof(x1));
+    memcpy(bq->x2, x2, sizeof(x2));
+    memcpy(bq->y1, y1, sizeof(y1));
+    memcpy(bq->y2, y2, sizeof(y2));
+}
+
+// Delays the signal by the lookahead, and turns the gain down as soon as a peak
+// over the threshold enters the delay, so it's already down when the peak comes
+// out. The target is threshold over the biggest peak anywhere in the delay.
+static void dsp_limiter(dsp_limiter_t *restrict l, sa_mix_acc_t *restrict acc, size_t frames) {
+
+    const int la = l->lookahead;
+    const int dq_size = la + 1;
+    dsp_gain_t g = l->gain;
+
+    for (size_t f = 0; f < frames; f++) {
+        sa_mix_acc_t *x = acc + f * CH;
+        sa_mix_acc_t pk = 0;
+        for (int c = 0; c < CH; c++) {
+            sa_mix_acc_t a = DSP_ABS(x[c]);
+            pk = a > pk ? a : pk;
+        }
+
+        // what's older than the delay out of the front, then this frame in at
+        // the back, after dropping anything it's bigger than
+        if (l->dq_n && l->frame - l->dq_frame[l->dq_head] > (uint32_t) la) {
+            l->dq_head = (l->dq_head + 1) % dq_size;
+            l->dq_n--;
+        }
+        while (l->dq_n && l->dq_peak[(l->dq_head + l->dq_n - 1) % dq_size] <= pk) l->dq_n--;
+        int back = (l->dq_head + l->dq_n) % dq_size;
+        l->dq_peak[back] = pk;
+        l->dq_frame[back] = l->frame;
+        l->dq_n++;
+        l->frame++;
+
+        sa_mix_acc_t max = l->dq_peak[l->dq_head];
+        dsp_gain_t target = max > l->threshold ? DSP_RATIO(l->threshold, max) : DSP_UNITY;
+        g = DSP_TOWARD(g, target, target < g ? l->attack : l->release);
+
+        sa_mix_acc_t *d = l->delay + (size_t) l->delay_pos * CH;
+        for (int c = 0; c < CH; c++) {
+            sa_mix_acc_t out = DSP_APPLY(d[c], g);
+            d[c] = x[c];
+            x[c] = out;
+        }
+        if (++l->delay_pos == la) l->delay_pos = 0;
+    }
+    l->gain = g;
+}
+
+// a block of the bus, in place
+void sa_dsp_process(int sink, sa_mix_acc_t *acc, size_t frames) {
+
+    sa_dsp_t *d = &g_dsp[sink];
+    if (!d->active) return;
+
+    for (int i = 0; i < d->n_biquads; i++) dsp_biquad(&d->biquads[i], acc, frames);
+    if (d->limiter) dsp_limiter(&d->lim, acc, frames);
+}
@@ -0,0 +1,225 @@
+/***
+  SerenityAudio
+
+  Granular voices. Instead of looping a long recording end to end, a granular
+  ambient keeps a short one and plays overlapping grains of it - a few tens to
+  a few hundred milliseconds each, from random places, at random intervals -
+  which makes a texture that doesn't repeat and doesn't have a loop point.
+
+  Each voice has a fixed pool of grains, allocated when the voice is made; if
+  the pool is full when a grain is due, that grain is skipped, so the cost of
+  a voice has a ceiling whatever the density. The grain window is the squared
+  parabola 16 x^2 ( 1 - x )^2, close to a Hann but only multiplies, so the
+  per grain loop has no table lookups or branches and the compiler vectorizes
+  it. The grains are summed into a block here at unity; mix.c puts that on the
+  bus with the voice's gain and meters it like any other voice.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "saplay.h"
+
+#ifdef SA_FIXED_POINT
+typedef int32_t grain_amp_t;    // Q15
+#else
+typedef float grain_amp_t;
+#endif
+
+typedef struct sa_grain {
+    uint32_t pos;           // next source frame
+    uint32_t left;          // frames to go, 0 when the slot is free
+    uint32_t phase;         // through the window, 0 to 2^32
+    uint32_t dphase;        // per frame
+} sa_grain_t;
+
+struct sa_grains {
+    sa_grain_config_t cfg;
+    uint32_t rand;
+    uint32_t until_next;    // frames until the next grain is due
+    grain_amp_t amp;
+    int n_live;
+    sa_grain_t pool[SA_GRAINS_MAX];
+};
+
+static inline float grains_rand(sa_grains_t *g) {
+    g->rand ^= g->rand << 13;
+    g->rand ^= g->rand >> 17;
+    g->rand ^= g->rand << 5;
+    return((g->rand >> 8) * (1.0f / 16777216.0f));
+}
+
+// made by the scene for each voice of a granular entry; seed so the voices
+// on different speakers don't all do the same thing
+sa_grains_t *sa_grains_new(const sa_grain_config_t *cfg, uint32_t seed) {
+
+    sa_grains_t *g = calloc(1, sizeof(sa_grains_t));
+    if (!g) return(NULL);
+    g->cfg = *cfg;
+    g->rand = seed ? seed : 1;
+
+    // uncorrelated grains add in power; with this many overlapping on average
+    // ( the window's mean square is 0.41 ) this keeps the texture about as
+    // loud as the source, and never louder than a grain on its own
+    float overlap = cfg->density * (cfg->grain_ms_lo + cfg->grain_ms_hi) / 2000.0f;
+    float amp = overlap * 0.41f > 1.0f ? 1.0f / sqrtf(overlap * 0.41f) : 1.0f;
+#ifdef SA_FIXED_POINT
+    g->amp = (int32_t) (amp * 32767.0f);
+#else
+    g->amp = amp;
+#endif
+    return(g);
+}
+
+void sa_grains_free(sa_grains_t *g) {
+    free(g);
+}
+
+// a new grain somewhere in the source, if there's a free slot
+static void grains_spawn(sa_grains_t *g, const sa_sample_t *s) {
+
+    if (g->n_live == SA_GRAINS_MAX) return;
+    sa_grain_t *gr = g->pool;
+    while (gr->left) gr++;
+
+    float ms = g->cfg.grain_ms_lo + (g->cfg.grain_ms_hi - g->cfg.grain_ms_lo) * grains_rand(g);
+    uint32_t len = (uint32_t) (ms * g_mix_rate / 1000.0f);
+    if (len > s->frames) len = (uint32_t) s->frames;
+    if (len < 2) return;
+
+    // the start, anywhere in the allowed part of the source the grain fits
+    uint32_t lo = (uint32_t) (g->cfg.pos_lo * (s->frames - len));
+    uint32_t hi = (uint32_t) (g->cfg.pos_hi * (s->frames - len));
+    gr->pos = lo + (uint32_t) ((hi - lo) * grains_rand(g));
+    gr->left = len;
+    gr->phase = 0;
+    gr->dphase = (uint32_t) (4294967295.0 / len);
+    g->n_live++;
+}
+
+/*
+** the grain kernels: one grain's frames into the block, windowed
+*/
+
+#ifdef SA_FIXED_POINT
+
+// Q16, from the top 16 bits of the phase: 4 x ( 1 - x ), then squared
+static inline int32_t grain_window(uint32_t phase) {
+    int32_t x = (int32_t) (phase >> 16);
+    int32_t u = (int32_t) (((int64_t) x * (65536 - x)) >> 14);
+    u = u > 65535 ? 65535 : u;
+    return((int32_t) (((uint32_t) u * (uint32_t) u) >> 16));
+}
+#define GRAIN_APPLY(x, w, amp) ((((int32_t) (x) * (w)) >> 16) * (amp) >> 15)
+#define GRAIN_LOAD_S16(x) (x)
+
+#else
+
+static inline float grain_window(uint32_t phase) {
+    float x = phase * (1.0f / 4294967296.0f);
+    float u = x * (1.0f - x);
+    return(16.0f * u * u);
+}
+#define GRAIN_APPLY(x, w, amp) ((x) * (w) * (amp))
+#define GRAIN_LOAD_S16(x) ((x) * (1.0f / 32768.0f))
+#define GRAIN_LOAD_F32(x) (x)
+
+#endif
+
+#define GRAIN_KERNEL(NAME, SRC_T, CH, LOAD) \
+static void NAME(sa_mix_acc_t *restrict out, const void *restrict vsrc, uint32_t frames, \
+        uint32_t phase, uint32_t dphase, grain_amp_t amp) { \
+    const SRC_T *restrict src = (const SRC_T *) vsrc; \
+    for (size_t f = 0; f < frames; f++) { \
+        const grain_amp_t w = grain_window(phase + (uint32_t) f * dphase); \
+        sa_mix_acc_t l = GRAIN_APPLY(LOAD(src[f * CH]), w, amp); \
+        sa_mix_acc_t r = CH == 2 ? GRAIN_APPLY(LOAD(src[f * CH + 1]), w, amp) : l; \
+        out[2 * f] += l; \
+        out[2 * f + 1] += r; \
+    } \
+}
+
+GRAIN_KERNEL(grain_s16_1, int16_t, 1, GRAIN_LOAD_S16)
+GRAIN_KERNEL(grain_s16_2, int16_t, 2, GRAIN_LOAD_S16)
+#ifndef SA_FIXED_POINT
+GRAIN_KERNEL(grain_f32_1, float, 1, GRAIN_LOAD_F32)
+GRAIN_KERNEL(grain_f32_2, float, 2, GRAIN_LOAD_F32)
+#endif
+
+// The texture's next frames, at unity, into out ( stereo, zeroed here ).
+// Mainloop only.
+void sa_grains_render(sa_grains_t *g, const sa_sample_t *s, sa_mix_acc_t *out, size_t frames) {
+
+    memset(out, 0, frames * SA_MIX_CHANNELS * sizeof(sa_mix_acc_t));
+
+    bool s16 = s->spec.format == PA_SAMPLE_S16NE;
+    int ch = s->spec.channels;
+    size_t fsz = (size_t) ch * (s16 ? sizeof(int16_t) : sizeof(float));
+
+    size_t done = 0;
+    while (done < frames) {
+
+        // up to the next grain start, so a new grain begins on its frame
+        if (g->until_next == 0) {
+            grains_spawn(g, s);
+            // intervals from half to one and a half of the average, so the
+            // density wanders and the grains don't fall into a rhythm
+            float interval = g_mix_rate / g->cfg.density * (0.5f + grains_rand(g));
+            g->until_next = interval < 1.0f ? 1 : (uint32_t) interval;
+        }
+        uint32_t n = (uint32_t) (frames - done);
+        if (n > g->until_next) n = g->until_next;
+
+        sa_mix_acc_t *o = out + done * SA_MIX_CHANNELS;
+        for (int i = 0; i < SA_GRAINS_MAX && g->n_live; i++) {
+            sa_grain_t *gr = &g->pool[i];
+            if (!gr->left) continue;
+            uint32_t m = n < gr->left ? n : gr->left;
+            const uint8_t *src = (const uint8_t *) s->data + (size_t) gr->pos * fsz;
+#ifdef SA_FIXED_POINT
+            (void) s16;
+            if (ch == 1) grain_s16_1(o, src, m, gr->phase, gr->dphase, g->amp);
+            else grain_s16_2(o, src, m, gr->phase, gr->dphase, g->amp);
+#else
+            if (s16) {
+                if (ch == 1) grain_s16_1(o, src, m, gr->phase, gr->dphase, g->amp);
+                else grain_s16_2(o, src, m, gr->phase, gr->dphase, g->amp);
+            }
+            else {
+                if (ch == 1) grain_f32_1(o, src, m, gr->phase, gr->dphase, g->amp);
+                else grain_f32_2(o, src, m, gr->phase, gr->dphase, g->amp);
+            }
+#endif
+            gr->pos += m;
+            gr->phase += m * gr->dphase;
+            gr->left -= m;
+            if (!gr->left) g->n_live--;
+        }
+
+        g->until_next -= n;
+        done += n;
+    }
+}
@@ -36,7 +36,11 @@ SOFTWARE.
 #include <sys/socket.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <microhttpd.h>
 
@@ -44,6 +48,502 @@ SOFTWARE.
 
 #define HTTP_PORT 8000
 
+#define SSE_EVENT_MAX 8192 // one levels event, MAX_SA_METER_VOICES worth of json
+
+int g_http_threads = SA_HTTP_THREADS_DEFAULT;
+int g_http_keepalive_sec = SA_HTTP_KEEPALIVE_DEFAULT;
+
+/*
+** Server-sent events for the level meters.
+**
+** One pump thread reads the seqlock snapshot at g_meter_hz, formats the event
+** once, and resumes every suspended client; with no clients it sleeps on a
+** condition instead, and the mainloop stops publishing ( sa_levels_listen ). Each client's reader copies the
+** current event and suspends itself again, so an idle dashboard costs nothing
+** and a busy one costs a memcpy per client per tick. None of this ever touches
+** the audio thread except through sa_levels_read().
+*/
+
+typedef struct sse_client {
+  struct MHD_Connection *connection;
+  uint64_t version;   // event version this client has been given
+  bool suspended;
+  size_t len, off;
+  char buf[SSE_EVENT_MAX];
+  struct sse_client *next;
+} sse_client_t;
+
+static struct {
+  pthread_mutex_t lock;   // protects everything here, http threads only
+  pthread_t pump;
+  bool running;
+  uint64_t version;
+  size_t len;
+  char event[SSE_EVENT_MAX];
+  sse_client_t *clients;
+  pthread_cond_t wake;    // the pump sleeps on this while there are no clients
+} g_sse = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+
+static ssize_t sse_reader(void *cls, uint64_t pos, char *buf, size_t max) {
+
+  sse_client_t *client = (sse_client_t *) cls;
+  size_t n;
+
+  pthread_mutex_lock(&g_sse.lock);
+
+  if (!g_sse.running) {
+    pthread_mutex_unlock(&g_sse.lock);
+    return(MHD_CONTENT_READER_END_OF_STREAM);
+  }
+
+  if (client->off == client->len) {
+    if (client->version == g_sse.version) {
+      // nothing new; park until the pump resumes us
+      client->suspended = true;
+      MHD_suspend_connection(client->connection);
+      pthread_mutex_unlock(&g_sse.lock);
+      return(0);
+    }
+    memcpy(client->buf, g_sse.event, g_sse.len);
+    client->len = g_sse.len;
+    client->off = 0;
+    client->version = g_sse.version;
+  }
+
+  n = client->len - client->off;
+  if (n > max) n = max;
+  memcpy(buf, client->buf + client->off, n);
+  client->off += n;
+
+  pthread_mutex_unlock(&g_sse.lock);
+  return(n);
+}
+
+static void sse_free(void *cls) {
+
+  sse_client_t *client = (sse_client_t *) cls;
+
+  pthread_mutex_lock(&g_sse.lock);
+  for (sse_client_t **pp = &g_sse.clients; *pp; pp = &(*pp)->next) {
+    if (*pp == client) {
+      *pp = client->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_sse.lock);
+  sa_levels_listen(false);
+
+  if (g_verbose) fprintf(stderr, "levels client gone\n");
+  free(client);
+}
+
+static void *sse_pump(void *arg) {
+
+  sa_trace_thread_name("sse");
+  sa_levels_snapshot_t *snap = malloc(sizeof(sa_levels_snapshot_t));
+  char *event = malloc(SSE_EVENT_MAX);
+  uint64_t last_publish = 0;
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (1) {
+
+    // nobody to send to, so no tick either; start the period over when someone comes
+    pthread_mutex_lock(&g_sse.lock);
+    bool waited = false;
+    while (g_sse.running && g_sse.clients == NULL) {
+      pthread_cond_wait(&g_sse.wake, &g_sse.lock);
+      waited = true;
+    }
+    bool running = g_sse.running;
+    pthread_mutex_unlock(&g_sse.lock);
+    if (!running) break;
+    if (waited) clock_gettime(CLOCK_MONOTONIC, &next);
+
+    long period_ns = 1000000000L / g_meter_hz;
+    next.tv_nsec += period_ns;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+    sa_levels_read(snap);
+
+    // format outside the lock; the clients only need the lock for the copy
+    size_t len = 0;
+    if (snap->publish_count != last_publish) {
+      last_publish = snap->publish_count;
+      len = sa_levels_format(snap, event, SSE_EVENT_MAX);
+    }
+
+    pthread_mutex_lock(&g_sse.lock);
+    if (!g_sse.running) {
+      pthread_mutex_unlock(&g_sse.lock);
+      break;
+    }
+    if (len) {
+      memcpy(g_sse.event, event, len);
+      g_sse.len = len;
+      g_sse.version++;
+      for (sse_client_t *c = g_sse.clients; c; c = c->next) {
+        if (c->suspended) {
+          c->suspended = false;
+          MHD_resume_connection(c->connection);
+        }
+      }
+    }
+    pthread_mutex_unlock(&g_sse.lock);
+  }
+
+  free(event);
+  free(snap);
+  return(NULL);
+}
+
+static int sse_start_client(struct MHD_Connection *connection) {
+
+  struct MHD_Response *response;
+  int ret;
+
+  sse_client_t *client = malloc(sizeof(sse_client_t));
+  memset(client, 0, sizeof(sse_client_t));
+  client->connection = connection;
+
+  response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, SSE_EVENT_MAX,
+                                          &sse_reader, client, &sse_free);
+  if (response == NULL) {
+    free(client);
+    return(MHD_NO);
+  }
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "text/event-stream");
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+
+  pthread_mutex_lock(&g_sse.lock);
+  client->version = g_sse.version; // start with the next event, not a stale one
+  client->next = g_sse.clients;
+  g_sse.clients = client;
+  pthread_cond_signal(&g_sse.wake);
+  pthread_mutex_unlock(&g_sse.lock);
+  sa_levels_listen(true);
+
+  if (g_verbose) fprintf(stderr, "levels client connected\n");
+
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return(ret);
+}
+
+static int metrics_response(struct MHD_Connection *connection) {
+
+  struct MHD_Response *response;
+  sa_timer_stats_t ts;
+  sa_cache_stats_t cs;
+  sa_voice_stats_t vs;
+  char buf[2048];
+  int ret;
+
+  sa_timer_stats(&ts);
+  sa_cache_stats(&cs);
+  sa_scene_voice_stats(&vs);
+  int len = snprintf(buf, sizeof(buf),
+    "{\"timer\":{\"wakeups\":%llu,\"fired\":%llu,\"wakeups_per_sec\":%.3f,\"pending\":%d},"
+    "\"startup\":{\"first_sound_ms\":%lld,\"fully_loaded_ms\":%lld},"
+    "\"cache\":{\"requested\":%d,\"ready\":%d,\"failed\":%d,\"analyzed\":%d,\"bytes\":%llu,\"trimmed_bytes\":%llu},"
+    "\"voices\":{\"active\":%d,\"max\":%d,\"stolen\":%llu,\"refused\":%llu},"
+    "\"sinks\":[",
+    (unsigned long long) ts.wakeups, (unsigned long long) ts.fired, ts.wakeups_per_sec, ts.pending,
+    (long long) sa_first_sound_ms(), (long long) cs.fully_loaded_ms,
+    cs.requested, cs.ready, cs.failed, cs.analyzed,
+    (unsigned long long) cs.bytes, (unsigned long long) cs.trimmed_bytes,
+    vs.active, vs.max, (unsigned long long) vs.stolen, (unsigned long long) vs.refused);
+
+  // time each bus has spent running and corked
+  bool first = true;
+  for (int i = 0; i < MAX_SA_SINKS && len < (int) sizeof(buf); i++) {
+    sa_sink_activity_t a;
+    sa_sink_activity(i, &a);
+    if (!a.present) continue;
+    len += snprintf(buf + len, sizeof(buf) - len, "%s{\"sink\":%d,\"corked\":%s,\"active_ms\":%llu,\"idle_ms\":%llu}",
+      first ? "" : ",", i, a.corked ? "true" : "false",
+      (unsigned long long) a.active_ms, (unsigned long long) a.idle_ms);
+    first = false;
+  }
+  if (len < (int) sizeof(buf)) len += snprintf(buf + len, sizeof(buf) - len, "],\"reverbs\":[");
+
+  // how hard each reverb's worker is working, and whether it's keeping up
+  sa_reverb_stats_t rs[SA_REVERB_MAX];
+  int n_rs = sa_reverb_stats(rs, SA_REVERB_MAX);
+  for (int i = 0; i < n_rs && len < (int) sizeof(buf); i++) {
+    // names come from the config; keep quotes and backslashes out of the JSON, as /levels does
+    char name[SA_LEVEL_NAME_MAX];
+    int j;
+    for (j = 0; rs[i].name[j] && j < SA_LEVEL_NAME_MAX - 1; j++) {
+      char c = rs[i].name[j];
+      name[j] = (c == '"' || c == '\\' || (unsigned char) c < 0x20) ? '_' : c;
+    }
+    name[j] = 0;
+    len += snprintf(buf + len, sizeof(buf) - len,
+      "%s{\"name\":\"%s\",\"ready\":%s,\"ir_ms\":%d,\"blocks\":%llu,\"late_frames\":%llu,\"dropped_frames\":%llu,\"load\":%.4f}",
+      i ? "," : "", name, rs[i].ready ? "true" : "false", rs[i].ir_ms,
+      (unsigned long long) rs[i].blocks, (unsigned long long) rs[i].late_frames,
+      (unsigned long long) rs[i].dropped_frames, rs[i].load);
+  }
+  if (len < (int) sizeof(buf)) len += snprintf(buf + len, sizeof(buf) - len, "]}\n");
+  if (len >= (int) sizeof(buf)) len = (int) sizeof(buf) - 1;
+
+  response = MHD_create_response_from_buffer (len, buf, MHD_RESPMEM_MUST_COPY);
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return(ret);
+}
+
+// the whole of every trace ring, as Chrome trace_event JSON
+static int trace_response(struct MHD_Connection *connection) {
+
+  struct MHD_Response *response;
+  size_t len;
+  int ret;
+
+  char *json = sa_trace_dump(&len);
+  response = MHD_create_response_from_buffer (len, json, MHD_RESPMEM_MUST_FREE);
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+  MHD_add_response_header(response, "Content-Disposition", "attachment; filename=\"saplay-trace.json\"");
+  ret = MHD_queue_response (connection, MHD_HTTP_OK, response);
+  MHD_destroy_response (response);
+  return(ret);
+}
+
+/*
+** Scene / status JSON.
+**
+** The mainloop builds the json whenever the state version moves and hands it
+** over here. The first GET that sees a new version turns it into an MHD response,
+** which is cached and queued as-is for every later GET of that version; MHD
+** refcounts responses so the cached one can be swapped while others still send
+** it. Clients that send back the ETag get a 304.
+*/
+
+typedef struct status_blob {
+  _Atomic int refs;
+  uint64_t version;
+  size_t len;
+  char json[];
+} status_blob_t;
+
+static struct {
+  pthread_mutex_t lock;     // only guards the pointer swap and the ref bump
+  status_blob_t *blob;
+} g_status_pub = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+  pthread_mutex_t lock;     // http threads only
+  uint64_t version;
+  char etag[32];
+  struct MHD_Response *ok;
+  struct MHD_Response *not_modified;
+} g_status_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void status_blob_release(status_blob_t *b) {
+  if (b && atomic_fetch_sub(&b->refs, 1) == 1) free(b);
+}
+
+// mainloop. Takes ownership of json ( from json_dumps, so free() )
+void sa_http_status_publish(char *json, uint64_t version) {
+
+  size_t len = strlen(json);
+  status_blob_t *b = malloc(sizeof(status_blob_t) + len + 1);
+  atomic_init(&b->refs, 1);
+  b->version = version;
+  b->len = len;
+  memcpy(b->json, json, len + 1);
+  free(json);
+
+  pthread_mutex_lock(&g_status_pub.lock);
+  status_blob_t *old = g_status_pub.blob;
+  g_status_pub.blob = b;
+  pthread_mutex_unlock(&g_status_pub.lock);
+
+  status_blob_release(old);
+}
+
+static status_blob_t *status_blob_get(void) {
+
+  pthread_mutex_lock(&g_status_pub.lock);
+  status_blob_t *b = g_status_pub.blob;
+  if (b) atomic_fetch_add(&b->refs, 1);
+  pthread_mutex_unlock(&g_status_pub.lock);
+  return(b);
+}
+
+// If-None-Match is a list, and a tag in it may be weak ( W/"n" ); any match will do
+static bool etag_matches(const char *inm, const char *etag) {
+
+  size_t etag_len = strlen(etag);
+  while (*inm) {
+    while (*inm == ' ' || *inm == '\t' || *inm == ',') inm++;
+    const char *end = strchr(inm, ',');
+    size_t len = end ? (size_t) (end - inm) : strlen(inm);
+    while (len && (inm[len - 1] == ' ' || inm[len - 1] == '\t')) len--;
+    if (len == 1 && inm[0] == '*') return(true);
+    const char *tag = inm;
+    if (len > 2 && tag[0] == 'W' && tag[1] == '/') {
+      tag += 2;
+      len -= 2;
+    }
+    if (len == etag_len && memcmp(tag, etag, len) == 0) return(true);
+    if (!end) break;
+    inm = end + 1;
+  }
+  return(false);
+}
+
+static int status_response(struct MHD_Connection *connection) {
+
+  struct MHD_Response *response;
+  unsigned int code = MHD_HTTP_OK;
+  int ret;
+
+  status_blob_t *b = status_blob_get();
+  if (b == NULL) {
+    // before the first publish
+    const char *msg = "{\"error\":\"starting\"}\n";
+    response = MHD_create_response_from_buffer (strlen(msg), (void *) msg, MHD_RESPMEM_PERSISTENT);
+    ret = MHD_queue_response (connection, MHD_HTTP_SERVICE_UNAVAILABLE, response);
+    MHD_destroy_response (response);
+    return(ret);
+  }
+
+  const char *inm = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+
+  pthread_mutex_lock(&g_status_cache.lock);
+
+  if (g_status_cache.ok == NULL || g_status_cache.version != b->version) {
+
+    struct MHD_Response *ok, *nm;
+    char etag[32];
+    snprintf(etag, sizeof(etag), "\"%llu\"", (unsigned long long) b->version);
+
+    ok = MHD_create_response_from_buffer (b->len, b->json, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(ok, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+    MHD_add_response_header(ok, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    MHD_add_response_header(ok, MHD_HTTP_HEADER_ETAG, etag);
+
+    nm = MHD_create_response_from_buffer (0, "", MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(nm, MHD_HTTP_HEADER_ETAG, etag);
+
+    // in-flight sends hold their own reference
+    if (g_status_cache.ok) MHD_destroy_response(g_status_cache.ok);
+    if (g_status_cache.not_modified) MHD_destroy_response(g_status_cache.not_modified);
+    g_status_cache.ok = ok;
+    g_status_cache.not_modified = nm;
+    g_status_cache.version = b->version;
+    strcpy(g_status_cache.etag, etag);
+
+    if (g_verbose) fprintf(stderr, "status cache regenerated, version %s\n", etag);
+  }
+
+  if (inm && etag_matches(inm, g_status_cache.etag)) {
+    response = g_status_cache.not_modified;
+    code = MHD_HTTP_NOT_MODIFIED;
+  }
+  else {
+    response = g_status_cache.ok;
+  }
+  ret = MHD_queue_response (connection, code, response);
+
+  pthread_mutex_unlock(&g_status_cache.lock);
+
+  status_blob_release(b);
+  return(ret);
+}
+
+/*
+** POST /scene. MHD hands the body over in pieces; collect it in the
+** per-request context and submit once it's all here.
+*/
+
+#define SCENE_BODY_MAX 65536
+
+typedef struct post_body {
+  size_t len, alloc;
+  bool too_big;
+  char *data;
+} post_body_t;
+
+static void request_completed(void *cls, struct MHD_Connection *connection,
+                              void **con_cls, enum MHD_RequestTerminationCode toe) {
+  post_body_t *pb = (post_body_t *) *con_cls;
+  if (pb) {
+    free(pb->data);
+    free(pb);
+    *con_cls = NULL;
+  }
+}
+
+static int simple_response(struct MHD_Connection *connection, unsigned int code, const char *json) {
+
+  struct MHD_Response *response;
+  int ret;
+
+  response = MHD_create_response_from_buffer (strlen(json), (void *) json, MHD_RESPMEM_PERSISTENT);
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+  ret = MHD_queue_response (connection, code, response);
+  MHD_destroy_response (response);
+  return(ret);
+}
+
+static int scene_post(struct MHD_Connection *connection, const char *upload_data,
+                      size_t *upload_data_size, void **con_cls) {
+
+  post_body_t *pb = (post_body_t *) *con_cls;
+
+  if (pb == NULL) {
+    pb = calloc(1, sizeof(post_body_t));
+    *con_cls = pb;
+    return(MHD_YES);
+  }
+
+  if (*upload_data_size) {
+    if (!pb->too_big) {
+      if (pb->len + *upload_data_size > SCENE_BODY_MAX) {
+        pb->too_big = true;
+      }
+      else {
+        if (pb->len + *upload_data_size + 1 > pb->alloc) {
+          pb->alloc = pb->len + *upload_data_size + 1;
+          pb->data = realloc(pb->data, pb->alloc);
+        }
+        memcpy(pb->data + pb->len, upload_data, *upload_data_size);
+        pb->len += *upload_data_size;
+      }
+    }
+    *upload_data_size = 0;
+    return(MHD_YES);
+  }
+
+  if (pb->too_big) {
+    return(simple_response(connection, MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+      "{\"ok\":false,\"error\":\"body too large\"}\n"));
+  }
+
+  int code;
+  SA_TRACE_BEGIN("POST /scene", (int64_t) pb->len);
+  char *result = sa_scene_submit(pb->data ? pb->data : "", pb->len, &code);
+  SA_TRACE_END("POST /scene", code);
+  if (result == NULL) {
+    return(simple_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, "{\"ok\":false}\n"));
+  }
+
+  struct MHD_Response *response = MHD_create_response_from_buffer (strlen(result), result, MHD_RESPMEM_MUST_FREE);
+  MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, "application/json");
+  int ret = MHD_queue_response (connection, code, response);
+  MHD_destroy_response (response);
+  return(ret);
+}
+
 int http_request_handler (void *cls, struct MHD_Connection *connection,
                           const char *url,
                           const char *method, const char *version,
@@ -54,7 +554,28 @@ int http_request_handler (void *cls, struct MHD_Connection *connection,
 	struct MHD_Response *response;
 	int ret;
 
-  if (g_verbose) fprintf(stderr, "http request handler called\n");
+  sa_trace_thread_name("http");
+
+  // only log the first call of a request, POSTs come through several times
+  if (g_verbose && *con_cls == NULL) fprintf(stderr, "http request handler called: %s %s\n", method, url);
+
+  if (strcmp(url, "/levels") == 0 && strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
+    return(sse_start_client(connection));
+  }
+  if (strcmp(url, "/metrics") == 0 && strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
+    return(metrics_response(connection));
+  }
+  if (strcmp(url, "/status") == 0 && strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
+    return(status_response(connection));
+  }
+  if (strcmp(url, "/trace") == 0 && strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
+    return(trace_response(connection));
+  }
+  if (strcmp(url, "/scene") == 0) {
+    if (strcmp(method, MHD_HTTP_METHOD_POST) != 0)
+      return(simple_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, "{\"ok\":false,\"error\":\"POST only\"}\n"));
+    return(scene_post(connection, upload_data, upload_data_size, con_cls));
+  }
 
 	response = MHD_create_response_from_buffer (strlen (page),
 	                                        (void*) page, MHD_RESPMEM_PERSISTENT);
@@ -71,25 +592,59 @@ bool sa_http_start(void) {
 
   if (g_verbose) fprintf(stderr,"starting HTTP server\n");
 
-  // this kind of start returns immediately and then there is a thread
-  // spawned to do epoll
- 	g_mhd_daemon = MHD_start_daemon (MHD_USE_EPOLL_INTERNALLY, 
+  // this kind of start returns immediately and then there is a pool of
+  // threads each doing epoll. Suspend/resume is for the levels stream.
+  // Keep-alive is on by default for HTTP/1.1, the timeout is how long an idle
+  // phone gets to hang on to its connection.
+ 	g_mhd_daemon = MHD_start_daemon (MHD_USE_EPOLL_INTERNALLY | MHD_ALLOW_SUSPEND_RESUME, 
   				HTTP_PORT, NULL, NULL,
-                &http_request_handler, NULL, MHD_OPTION_END);
+                &http_request_handler, NULL,
+                MHD_OPTION_THREAD_POOL_SIZE, (unsigned int) g_http_threads,
+                MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) g_http_keepalive_sec,
+                MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+                MHD_OPTION_END);
 
  	if (NULL == g_mhd_daemon) {
     fprintf(stderr, "could not start HTTP server\n");
     return false;
   }
 
+  g_sse.running = true;
+  if (pthread_create(&g_sse.pump, NULL, sse_pump, NULL) != 0) {
+    fprintf(stderr, "could not start levels pump thread\n");
+    g_sse.running = false;
+    sa_http_terminate();
+    return false;
+  }
+
 	return(true);
 }
 
 void sa_http_terminate(void) {
+
+  pthread_mutex_lock(&g_sse.lock);
+  bool was_running = g_sse.running;
+  g_sse.running = false;
+  pthread_cond_broadcast(&g_sse.wake);
+  // suspended connections can't be closed by MHD, wake them so they see the end
+  for (sse_client_t *c = g_sse.clients; c; c = c->next) {
+    if (c->suspended) {
+      c->suspended = false;
+      MHD_resume_connection(c->connection);
+    }
+  }
+  pthread_mutex_unlock(&g_sse.lock);
+  if (was_running) pthread_join(g_sse.pump, NULL);
+
 	if (g_mhd_daemon) {
 	  MHD_stop_daemon (g_mhd_daemon);
 	  g_mhd_daemon = 0;
 	}
+
+  if (g_status_cache.ok) { MHD_destroy_response(g_status_cache.ok); g_status_cache.ok = NULL; }
+  if (g_status_cache.not_modified) { MHD_destroy_response(g_status_cache.not_modified); g_status_cache.not_modified = NULL; }
+  status_blob_release(g_status_pub.blob);
+  g_status_pub.blob = NULL;
 }
 
 
@@ -0,0 +1,295 @@
+/***
+  SerenityAudio
+
+  Level metering. The audio (mainloop) thread folds block peak and sum-of-squares
+  into small accumulators as a side effect of writing samples, and a few times a
+  second those get turned into peak / RMS and published through a seqlock so
+  the HTTP threads can read a consistent copy without ever making the audio
+  thread wait. Publishing only runs while a /levels client is connected, so an
+  installation nobody's watching has no meter tick waking it up.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "saplay.h"
+
+int g_meter_hz = SA_METER_HZ_DEFAULT;
+
+// everything below the snapshot is only touched by the audio thread
+
+static sa_meter_t g_sink_meters[MAX_SA_SINKS];
+
+static struct {
+    sa_meter_t *meter; // NULL if slot free
+    const char *name;  // owned by whoever registered, lives as long as the meter
+    int sink;
+} g_voice_meters[MAX_SA_METER_VOICES];
+
+// the published copy. Writer bumps the sequence to odd, writes, bumps to even.
+// Readers retry if they see odd or if the sequence moved under them.
+static _Atomic uint32_t g_levels_seq = 0;
+static sa_levels_snapshot_t g_levels;
+
+void sa_meter_s16(sa_meter_t *m, const int16_t *samples, size_t n) {
+
+    int32_t peak = 0;
+    int64_t sumsq = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        int32_t s = samples[i];
+        int32_t a = s < 0 ? -s : s;
+        if (a > peak) peak = a;
+        sumsq += s * s;
+    }
+
+    float p = (float) peak / 32768.0f;
+    if (p > m->peak) m->peak = p;
+    m->sumsq += (double) sumsq / (32768.0 * 32768.0);
+    m->n += n;
+}
+
+void sa_meter_float(sa_meter_t *m, const float *samples, size_t n) {
+
+    float peak = 0.0f;
+    float sumsq = 0.0f;
+
+    for (size_t i = 0; i < n; i++) {
+        float s = samples[i];
+        float a = fabsf(s);
+        if (a > peak) peak = a;
+        sumsq += s * s;
+    }
+
+    if (peak > m->peak) m->peak = peak;
+    m->sumsq += sumsq;
+    m->n += n;
+}
+
+void sa_meter_fold(sa_meter_t *dst, const sa_meter_t *src) {
+
+    if (src->peak > dst->peak) dst->peak = src->peak;
+    dst->sumsq += src->sumsq;
+    dst->n += src->n;
+}
+
+// Fold a block of a sink's mixed output into its meter.
+void sa_meter_sink_fold(int sink, const sa_meter_t *block) {
+
+    if (sink < 0 || sink >= MAX_SA_SINKS) return;
+
+    sa_meter_fold(&g_sink_meters[sink], block);
+}
+
+int sa_levels_voice_add(sa_meter_t *meter, const char *name, int sink) {
+
+    for (int i = 0; i < MAX_SA_METER_VOICES; i++) {
+        if (g_voice_meters[i].meter == NULL) {
+            g_voice_meters[i].meter = meter;
+            g_voice_meters[i].name = name;
+            g_voice_meters[i].sink = sink;
+            return(i);
+        }
+    }
+    // not fatal, the voice just doesn't show up on the dashboard
+    if (g_verbose) fprintf(stderr, "levels: out of voice meter slots, %s not metered\n", name);
+    return(-1);
+}
+
+void sa_levels_voice_remove(int slot) {
+
+    if (slot < 0 || slot >= MAX_SA_METER_VOICES) return;
+    g_voice_meters[slot].meter = NULL;
+    g_voice_meters[slot].name = NULL;
+}
+
+static void meter_take(sa_meter_t *m, sa_level_t *l) {
+
+    l->peak = m->peak;
+    l->rms = m->n ? (float) sqrt(m->sumsq / (double) m->n) : 0.0f;
+    memset(m, 0, sizeof(sa_meter_t));
+}
+
+// called from the audio thread at g_meter_hz
+void sa_levels_publish(void) {
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    uint32_t seq = atomic_load_explicit(&g_levels_seq, memory_order_relaxed);
+    atomic_store_explicit(&g_levels_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    g_levels.publish_count++;
+    g_levels.timestamp_usec = (uint64_t) now.tv_sec * 1000000 + now.tv_usec;
+
+    for (int i = 0; i < MAX_SA_SINKS; i++) {
+        meter_take(&g_sink_meters[i], &g_levels.sinks[i]);
+    }
+
+    int n = 0;
+    for (int i = 0; i < MAX_SA_METER_VOICES; i++) {
+        if (g_voice_meters[i].meter == NULL) continue;
+        strncpy(g_levels.voices[n].name, g_voice_meters[i].name, SA_LEVEL_NAME_MAX - 1);
+        g_levels.voices[n].name[SA_LEVEL_NAME_MAX - 1] = 0;
+        g_levels.voices[n].sink = g_voice_meters[i].sink;
+        meter_take(g_voice_meters[i].meter, &g_levels.voices[n].level);
+        n++;
+    }
+    g_levels.n_voices = n;
+
+    atomic_store_explicit(&g_levels_seq, seq + 2, memory_order_release);
+}
+
+// any thread. Spins only while the audio thread is in the middle of a publish,
+// which is a few hundred nanoseconds
+void sa_levels_read(sa_levels_snapshot_t *out) {
+
+    uint32_t s1, s2;
+
+    do {
+        s1 = atomic_load_explicit(&g_levels_seq, memory_order_acquire);
+        if (s1 & 1) continue;
+        memcpy(out, &g_levels, sizeof(sa_levels_snapshot_t));
+        atomic_thread_fence(memory_order_acquire);
+        s2 = atomic_load_explicit(&g_levels_seq, memory_order_relaxed);
+        if (s1 == s2) return;
+    } while (1);
+}
+
+// SSE event body. Returns bytes written, 0 if it didn't fit.
+size_t sa_levels_format(const sa_levels_snapshot_t *l, char *buf, size_t sz) {
+
+    size_t off = 0;
+    int r;
+
+#define LV_APPEND(...) do { \
+        r = snprintf(buf + off, sz - off, __VA_ARGS__); \
+        if (r < 0 || (size_t) r >= sz - off) return(0); \
+        off += r; \
+    } while (0)
+
+    LV_APPEND("data: {\"t\":%llu,\"sinks\":[", (unsigned long long) l->timestamp_usec);
+    for (int i = 0; i < MAX_SA_SINKS; i++) {
+        LV_APPEND("%s{\"peak\":%.4f,\"rms\":%.4f}", i ? "," : "",
+            l->sinks[i].peak, l->sinks[i].rms);
+    }
+    LV_APPEND("],\"voices\":[");
+    for (int i = 0; i < l->n_voices; i++) {
+        // names come from file titles; keep quotes and backslashes out of the JSON
+        char name[SA_LEVEL_NAME_MAX];
+        int j;
+        for (j = 0; l->voices[i].name[j] && j < SA_LEVEL_NAME_MAX - 1; j++) {
+            char c = l->voices[i].name[j];
+            name[j] = (c == '"' || c == '\\' || (unsigned char) c < 0x20) ? '_' : c;
+        }
+        name[j] = 0;
+        LV_APPEND("%s{\"name\":\"%s\",\"sink\":%d,\"peak\":%.4f,\"rms\":%.4f}", i ? "," : "",
+            name, l->voices[i].sink, l->voices[i].level.peak, l->voices[i].level.rms);
+    }
+    LV_APPEND("]}\n\n");
+
+#undef LV_APPEND
+
+    return(off);
+}
+
+/*
+** the publish timer, mainloop, armed only while someone's listening
+*/
+
+static pa_mainloop_api *g_levels_api = NULL;
+static pa_io_event *g_levels_io = NULL;
+static int g_levels_pipe[2] = { -1, -1 };  // the HTTP side pokes this when the first client arrives
+static _Atomic int g_listeners = 0;
+static sa_timer_t g_levels_timer = { .heap_idx = -1 };
+
+static void levels_timer_fn(sa_timer_t *t, void *userdata) {
+
+    sa_levels_publish();
+    // the last client's gone; the meters just accumulate until the next one
+    if (atomic_load(&g_listeners) > 0) sa_timer_schedule(t, PA_USEC_PER_SEC / g_meter_hz);
+}
+
+/* pa_io_event_cb_t */
+static void levels_io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+
+    char c;
+    while (read(fd, &c, 1) == 1) ;
+
+    if (atomic_load(&g_listeners) > 0 && g_levels_timer.heap_idx < 0) {
+        // throw away what built up while nobody was listening
+        sa_levels_publish();
+        sa_timer_schedule(&g_levels_timer, PA_USEC_PER_SEC / g_meter_hz);
+    }
+}
+
+bool sa_levels_init(pa_mainloop_api *api) {
+
+    if (pipe(g_levels_pipe) != 0) {
+        fprintf(stderr, "levels: pipe failed\n");
+        return(false);
+    }
+    fcntl(g_levels_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(g_levels_pipe[1], F_SETFL, O_NONBLOCK);
+
+    g_levels_api = api;
+    sa_timer_setup(&g_levels_timer, levels_timer_fn, NULL);
+    g_levels_io = api->io_new(api, g_levels_pipe[0], PA_IO_EVENT_INPUT, levels_io_cb, NULL);
+    if (!g_levels_io) {
+        fprintf(stderr, "levels: io_new failed\n");
+        return(false);
+    }
+    return(true);
+}
+
+void sa_levels_done(void) {
+
+    sa_timer_cancel(&g_levels_timer);
+    if (g_levels_io) {
+        g_levels_api->io_free(g_levels_io);
+        g_levels_io = NULL;
+    }
+    if (g_levels_pipe[0] >= 0) close(g_levels_pipe[0]);
+    if (g_levels_pipe[1] >= 0) close(g_levels_pipe[1]);
+    g_levels_pipe[0] = g_levels_pipe[1] = -1;
+}
+
+// any thread: a /levels client connected ( on ) or went away
+void sa_levels_listen(bool on) {
+
+    if (!on) {
+        atomic_fetch_sub(&g_listeners, 1);
+        return;
+    }
+    if (atomic_fetch_add(&g_listeners, 1) == 0 && g_levels_pipe[1] >= 0) {
+        // the timer is the mainloop's; it arms itself once it sees this
+        if (write(g_levels_pipe[1], "l", 1) != 1 && g_verbose) fprintf(stderr, "levels: lost a wakeup\n");
+    }
+}
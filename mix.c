@@ -0,0 +1,421 @@
+/***
+  SerenityAudio
+
+  The mix. Every sink has one stream, and its write callback sums the voices
+  playing on that sink into a block here, straight from the cached samples.
+
+  There are two builds of the pipeline from the same source. The default is
+  float. With SA_FIXED_POINT ( make FIXED=1 ), for boards with a weak or no FPU,
+  it's all integer from sample to speaker: Q15 samples, Q30 gains, 32 bit
+  accumulators and a saturating store. Either way the per voice inner loop is
+  stamped out by MIX_KERNEL once for every cached format and channel count, so
+  the loop itself has nothing to decide - a voice picks its kernel when it's
+  made, and a gain ramp is just a step that's 0 when it isn't ramping.
+
+  A voice with a playback rate other than 1 ( random per voice, so one file
+  can be a chorus ) gets the varispeed kernel instead, which steps through the
+  shared cached sample in 32.32 fixed point and interpolates linearly between
+  neighbouring frames. It's a few more operations per frame than the straight
+  kernel, and doesn't depend on the rate, so the cost per voice stays bounded.
+
+  A granular voice ( grain.c ) renders its grains into a block first, and that
+  block goes on the bus through one more kernel instance, so gains, ramps and
+  meters work the same for every kind of voice.
+
+  A voice that sends to its sink's reverb ( reverb.c ) is mixed into a block of
+  its own first, which goes on the bus and, scaled by the send, into the
+  sink's send block; voices that don't send cost nothing extra.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "saplay.h"
+
+int g_mix_rate = SA_MIX_RATE_DEFAULT;
+
+// mainloop only; every sink's callback runs there, one at a time
+static sa_mix_acc_t g_acc[SA_MIX_BLOCK_FRAMES * SA_MIX_CHANNELS];
+static sa_mix_acc_t g_grain_acc[SA_MIX_BLOCK_FRAMES * SA_MIX_CHANNELS];
+static sa_mix_acc_t g_voice_acc[SA_MIX_BLOCK_FRAMES * SA_MIX_CHANNELS];
+static sa_mix_acc_t g_send_acc[SA_MIX_BLOCK_FRAMES * SA_MIX_CHANNELS];
+
+/*
+** the two arithmetics
+*/
+
+#ifdef SA_FIXED_POINT
+
+#define MIX_UNITY (1 << 30)
+
+// Q15 sample times the top 15 bits of a Q30 gain; gains never go past unity
+// so this stays inside 31 bits
+#define MIX_LOAD_S16(x)     ((int32_t) (x))
+#define MIX_LOAD_ACC(x)     (x)
+#define MIX_SCALE(x, g)     (((x) * ((g) >> 15)) >> 15)
+// a rendered grain block is a sum of grains, so past Q15; take the whole product
+#define MIX_SCALE_WIDE(x, g) ((int32_t) (((int64_t) (x) * (g)) >> 30))
+#define MIX_ABS(x)          ((x) < 0 ? -(x) : (x))
+#define MIX_SQ(x)           ((int64_t) (x) * (x))
+// t is the 32 bit fraction, 15 bits of it is plenty for 16 bit samples
+#define MIX_LERP(a, b, t)   ((a) + ((((b) - (a)) * (int32_t) ((t) >> 17)) >> 15))
+
+#else
+
+#define MIX_UNITY 1.0f
+
+#define MIX_LOAD_S16(x)     ((x) * (1.0f / 32768.0f))
+#define MIX_LOAD_F32(x)     (x)
+#define MIX_LOAD_ACC(x)     (x)
+#define MIX_SCALE(x, g)     ((x) * (g))
+#define MIX_SCALE_WIDE(x, g) ((x) * (g))
+#define MIX_ABS(x)          fabsf(x)
+#define MIX_SQ(x)           ((x) * (x))
+#define MIX_LERP(a, b, t)   ((a) + ((b) - (a)) * ((t) * (1.0f / 4294967296.0f)))
+
+#endif
+
+#define MIX_MAX(a, b)       ((a) > (b) ? (a) : (b))
+
+// One voice's frames into the accumulator: load, convert, gain, sum, and meter
+// what was added. CH is a constant in every expansion, so the mono / stereo
+// choices fold away; mono goes to both sides of the bus.
+#define MIX_KERNEL(NAME, SRC_T, CH, LOAD, SCALE) \
+static void NAME(sa_mix_acc_t *restrict acc, const void *restrict vsrc, size_t frames, sa_mix_run_t *run) { \
+    const SRC_T *restrict src = (const SRC_T *) vsrc; \
+    sa_mix_gain_t g = run->gain; \
+    const sa_mix_gain_t step = run->step; \
+    sa_mix_acc_t peak = run->peak; \
+    sa_mix_sumsq_t sumsq = run->sumsq; \
+    for (size_t f = 0; f < frames; f++) { \
+        g += step; \
+        sa_mix_acc_t l = SCALE(LOAD(src[f * CH]), g); \
+        sa_mix_acc_t r = CH == 2 ? SCALE(LOAD(src[f * CH + 1]), g) : l; \
+        acc[2 * f] += l; \
+        acc[2 * f + 1] += r; \
+        peak = MIX_MAX(peak, MIX_ABS(l)); \
+        sumsq += MIX_SQ(l); \
+        if (CH == 2) { \
+            peak = MIX_MAX(peak, MIX_ABS(r)); \
+            sumsq += MIX_SQ(r); \
+        } \
+    } \
+    run->gain = g; \
+    run->peak = peak; \
+    run->sumsq = sumsq; \
+}
+
+// The same at a rate: src is where the voice's pos is, run->phase how far past
+// that it is. Reads one frame ahead, which the guard frame makes safe.
+#define MIX_KERNEL_RATE(NAME, SRC_T, CH, LOAD) \
+static void NAME(sa_mix_acc_t *restrict acc, const void *restrict vsrc, size_t frames, sa_mix_run_t *run) { \
+    const SRC_T *restrict src = (const SRC_T *) vsrc; \
+    sa_mix_gain_t g = run->gain; \
+    const sa_mix_gain_t step = run->step; \
+    uint64_t phase = run->phase; \
+    const uint64_t rate = run->rate; \
+    sa_mix_acc_t peak = run->peak; \
+    sa_mix_sumsq_t sumsq = run->sumsq; \
+    for (size_t f = 0; f < frames; f++) { \
+        const SRC_T *p = src + (size_t) (phase >> 32) * CH; \
+        const uint32_t t = (uint32_t) phase; \
+        g += step; \
+        sa_mix_acc_t l = MIX_SCALE(MIX_LERP(LOAD(p[0]), LOAD(p[CH]), t), g); \
+        sa_mix_acc_t r = CH == 2 ? MIX_SCALE(MIX_LERP(LOAD(p[1]), LOAD(p[CH + 1]), t), g) : l; \
+        phase += rate; \
+        acc[2 * f] += l; \
+        acc[2 * f + 1] += r; \
+        peak = MIX_MAX(peak, MIX_ABS(l)); \
+        sumsq += MIX_SQ(l); \
+        if (CH == 2) { \
+            peak = MIX_MAX(peak, MIX_ABS(r)); \
+            sumsq += MIX_SQ(r); \
+        } \
+    } \
+    run->gain = g; \
+    run->phase = phase; \
+    run->peak = peak; \
+    run->sumsq = sumsq; \
+}
+
+MIX_KERNEL(mix_s16_1, int16_t, 1, MIX_LOAD_S16, MIX_SCALE)
+MIX_KERNEL(mix_s16_2, int16_t, 2, MIX_LOAD_S16, MIX_SCALE)
+MIX_KERNEL_RATE(mix_rate_s16_1, int16_t, 1, MIX_LOAD_S16)
+MIX_KERNEL_RATE(mix_rate_s16_2, int16_t, 2, MIX_LOAD_S16)
+MIX_KERNEL(mix_acc_2, sa_mix_acc_t, 2, MIX_LOAD_ACC, MIX_SCALE_WIDE)     // a rendered block, granular voices
+#ifndef SA_FIXED_POINT
+MIX_KERNEL(mix_f32_1, float, 1, MIX_LOAD_F32, MIX_SCALE)
+MIX_KERNEL(mix_f32_2, float, 2, MIX_LOAD_F32, MIX_SCALE)
+MIX_KERNEL_RATE(mix_rate_f32_1, float, 1, MIX_LOAD_F32)
+MIX_KERNEL_RATE(mix_rate_f32_2, float, 2, MIX_LOAD_F32)
+#endif
+
+// the cache only ever hands out what there's a kernel for
+sa_mix_kernel_t sa_mix_kernel(const pa_sample_spec *spec, bool varispeed) {
+
+    if (spec->channels < 1 || spec->channels > 2) return(NULL);
+
+    if (spec->format == PA_SAMPLE_S16NE) {
+        if (varispeed) return(spec->channels == 1 ? mix_rate_s16_1 : mix_rate_s16_2);
+        return(spec->channels == 1 ? mix_s16_1 : mix_s16_2);
+    }
+#ifndef SA_FIXED_POINT
+    if (spec->format == PA_SAMPLE_FLOAT32NE) {
+        if (varispeed) return(spec->channels == 1 ? mix_rate_f32_1 : mix_rate_f32_2);
+        return(spec->channels == 1 ? mix_f32_1 : mix_f32_2);
+    }
+#endif
+    return(NULL);
+}
+
+/*
+** gains, mainloop side
+*/
+
+sa_mix_gain_t sa_mix_gain(float g) {
+    if (g <= 0.0f) return(0);
+    if (g >= 1.0f) return(MIX_UNITY);
+#ifdef SA_FIXED_POINT
+    return((sa_mix_gain_t) (g * MIX_UNITY + 0.5f));
+#else
+    return(g);
+#endif
+}
+
+// ramp_ms of 0 is a jump, applied from the next block
+void sa_soundplay_set_gain(sa_soundplay_t *splay, float target, uint32_t ramp_ms) {
+
+    uint32_t frames = (uint32_t) ((uint64_t) g_mix_rate * ramp_ms / 1000);
+
+    splay->gain_target = sa_mix_gain(target);
+    if (frames == 0 || splay->gain == splay->gain_target) {
+        splay->gain = splay->gain_target;
+        splay->gain_step = 0;
+        splay->ramp_frames = 0;
+        return;
+    }
+    splay->gain_step = (splay->gain_target - splay->gain) / (sa_mix_gain_t) frames;
+    splay->ramp_frames = frames;
+}
+
+// 1 is as recorded, 2 an octave up and twice as fast. Before it's started,
+// or any time after; a voice at 1 goes back to the straight kernel.
+void sa_soundplay_set_rate(sa_soundplay_t *splay, float rate) {
+
+    if (rate < SA_MIX_RATE_MIN) rate = SA_MIX_RATE_MIN;
+    if (rate > SA_MIX_RATE_MAX) rate = SA_MIX_RATE_MAX;
+
+    splay->rate = (uint64_t) ((double) rate * SA_MIX_RATE_UNITY + 0.5);
+    if (splay->rate == SA_MIX_RATE_UNITY) splay->frac = 0;
+    splay->kernel = sa_mix_kernel(&splay->sample->spec, splay->rate != SA_MIX_RATE_UNITY);
+}
+
+/*
+** the bus
+*/
+
+// what a voice added, into its meter
+static void mix_voice_meter(sa_soundplay_t *v, const sa_mix_run_t *run, size_t samples) {
+
+#ifdef SA_FIXED_POINT
+    float peak = run->peak / 32768.0f;
+    double sumsq = run->sumsq / (32768.0 * 32768.0);
+#else
+    float peak = run->peak;
+    double sumsq = run->sumsq;
+#endif
+    if (peak > v->meter.peak) v->meter.peak = peak;
+    v->meter.sumsq += sumsq;
+    v->meter.n += samples;
+
+    // a quarter of the way to this run's, so a gap between two notes doesn't make it look silent
+    if (samples) v->level += ((float) (sumsq / samples) - v->level) * 0.25f;
+}
+
+// One voice into the accumulator, looping at the end of the sample. Splits at
+// the sample end and at the end of a ramp, so the kernel never has to check.
+static void mix_voice(sa_soundplay_t *v, sa_mix_acc_t *acc, size_t frames) {
+
+    const sa_sample_t *s = v->sample;
+    size_t fsz = (size_t) s->spec.channels * (s->spec.format == PA_SAMPLE_S16NE ? sizeof(int16_t) : sizeof(float));
+    sa_mix_run_t run = { .gain = v->gain, .step = 0, .peak = 0, .sumsq = 0, .rate = v->rate };
+    const bool varispeed = v->rate != SA_MIX_RATE_UNITY;
+    size_t done = 0;
+
+    while (done < frames) {
+
+        size_t n = frames - done;
+        if (varispeed) {
+            // output frames until the phase passes the end of the sample
+            uint64_t left = ((uint64_t) (s->frames - v->pos) << 32) - v->frac;
+            uint64_t until_end = (left + v->rate - 1) / v->rate;
+            if (n > until_end) n = (size_t) until_end;
+        }
+        else if (n > (size_t) (s->frames - v->pos)) {
+            n = (size_t) (s->frames - v->pos);
+        }
+
+        if (v->ramp_frames) {
+            if (n > v->ramp_frames) n = v->ramp_frames;
+            run.step = v->gain_step;
+            v->ramp_frames -= n;
+        }
+        else {
+            run.step = 0;
+        }
+
+        // silent and staying that way, just keep its place
+        run.phase = v->frac;
+        if (run.gain != 0 || run.step != 0)
+            v->kernel(acc + done * SA_MIX_CHANNELS, (const uint8_t *) s->data + (size_t) v->pos * fsz, n, &run);
+
+        if (v->ramp_frames == 0 && run.step != 0) run.gain = v->gain_target; // no drift at the end of a ramp
+
+        // everything loops for now
+        if (varispeed) {
+            uint64_t phase = v->frac + (uint64_t) n * v->rate;
+            v->pos += (sf_count_t) (phase >> 32);
+            v->frac = (uint32_t) phase;
+            while (v->pos >= s->frames) v->pos -= s->frames;
+        }
+        else {
+            v->pos += n;
+            if (v->pos >= s->frames) v->pos = 0;
+        }
+        done += n;
+    }
+
+    v->gain = run.gain;
+    mix_voice_meter(v, &run, frames * s->spec.channels);
+}
+
+// A granular voice: its grains into a block, then onto the bus with the voice's
+// gain. Split at the end of a ramp like any other.
+static void mix_voice_grains(sa_soundplay_t *v, sa_mix_acc_t *acc, size_t frames) {
+
+    sa_mix_run_t run = { .gain = v->gain, .step = 0, .peak = 0, .sumsq = 0 };
+
+    // silent and staying that way, nothing to render
+    if (v->gain == 0 && v->ramp_frames == 0) return;
+
+    sa_grains_render(v->grains, v->sample, g_grain_acc, frames);
+
+    for (size_t done = 0; done < frames; ) {
+        size_t n = frames - done;
+        if (v->ramp_frames) {
+            if (n > v->ramp_frames) n = v->ramp_frames;
+            run.step = v->gain_step;
+            v->ramp_frames -= n;
+        }
+        else {
+            run.step = 0;
+        }
+        mix_acc_2(acc + done * SA_MIX_CHANNELS, g_grain_acc + done * SA_MIX_CHANNELS, n, &run);
+        if (v->ramp_frames == 0 && run.step != 0) run.gain = v->gain_target;
+        done += n;
+    }
+
+    v->gain = run.gain;
+    mix_voice_meter(v, &run, frames * SA_MIX_CHANNELS);
+}
+
+// a voice's own block onto the bus, and its send
+static void mix_voice_send(sa_mix_acc_t *restrict acc, sa_mix_acc_t *restrict send,
+        const sa_mix_acc_t *restrict v, sa_mix_gain_t g, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += v[i];
+#ifdef SA_FIXED_POINT
+        send[i] += (int32_t) (((int64_t) v[i] * g) >> 30);
+#else
+        send[i] += v[i] * g;
+#endif
+    }
+}
+
+// the accumulator out to the stream's format
+static void mix_store(const sa_mix_acc_t *restrict acc, sa_mix_out_t *restrict out, size_t n) {
+#ifdef SA_FIXED_POINT
+    for (size_t i = 0; i < n; i++) {
+        int32_t x = acc[i];
+        x = x > 32767 ? 32767 : x;
+        x = x < -32768 ? -32768 : x;
+        out[i] = (int16_t) x;
+    }
+#else
+    for (size_t i = 0; i < n; i++) {
+        float x = acc[i];
+        x = x > 1.0f ? 1.0f : x;
+        x = x < -1.0f ? -1.0f : x;
+        out[i] = x;
+    }
+#endif
+}
+
+// Mix every voice on a sink into out, frames of SA_MIX_CHANNELS at SA_MIX_FORMAT,
+// with what comes back from its reverb, through the sink's protection DSP. The sink's meter gets what goes out. Returns the number of voices mixed.
+int sa_mix_bus(sa_soundplay_t *voices, sa_mix_out_t *out, size_t frames, int sink) {
+
+    int n_voices = 0;
+    for (sa_soundplay_t *v = voices; v; v = v->next) n_voices++;
+    const bool reverb = sa_reverb_active(sink);
+
+    for (size_t done = 0; done < frames; ) {
+
+        size_t n = frames - done;
+        if (n > SA_MIX_BLOCK_FRAMES) n = SA_MIX_BLOCK_FRAMES;
+        size_t samples = n * SA_MIX_CHANNELS;
+
+        memset(g_acc, 0, samples * sizeof(sa_mix_acc_t));
+        if (reverb) memset(g_send_acc, 0, samples * sizeof(sa_mix_acc_t));
+        for (sa_soundplay_t *v = voices; v; v = v->next) {
+            sa_mix_acc_t *to = g_acc;
+            if (reverb && v->send) {
+                to = g_voice_acc;
+                memset(g_voice_acc, 0, samples * sizeof(sa_mix_acc_t));
+            }
+            if (v->grains) mix_voice_grains(v, to, n);
+            else mix_voice(v, to, n);
+            if (to == g_voice_acc) mix_voice_send(g_acc, g_send_acc, g_voice_acc, v->send, samples);
+        }
+        // the send goes even when it's silent, the tail is still coming back
+        if (reverb) sa_reverb_send(sink, g_send_acc, g_acc, n);
+        sa_dsp_process(sink, g_acc, n);
+
+        sa_mix_out_t *o = out + done * SA_MIX_CHANNELS;
+        mix_store(g_acc, o, samples);
+
+        sa_meter_t block = {0};
+#ifdef SA_FIXED_POINT
+        sa_meter_s16(&block, o, samples);
+#else
+        sa_meter_float(&block, o, samples);
+#endif
+        sa_meter_sink_fold(sink, &block);
+
+        done += n;
+    }
+    return(n_voices);
+}
@@ -0,0 +1,651 @@
+/***
+  SerenityAudio
+
+  Send reverbs. Rather than baking a room into every file, a voice can send
+  some of itself to a convolution reverb shared by a group of speakers, and
+  what comes back is mixed into those speakers' buses. The impulse response is
+  any file in the directory; the cache loads it like a sample, it's mixed to
+  mono here and scaled to unit energy, so return_db is the reverb's level
+  relative to what was sent.
+
+  The convolution is uniformly partitioned and done in the frequency domain:
+  the IR is cut into partitions of B frames, each transformed once at setup;
+  every B frames of input are transformed ( overlapped with the B before, so
+  the product is a linear convolution - overlap-save ) and pushed on to a
+  frequency domain delay line, and the output block is the sum over the line
+  of each old input spectrum times its partition, transformed back. The cost
+  per frame is two FFTs of 2B over B plus one complex multiply-add per
+  partition, so it goes up linearly with the IR's length and not with B.
+
+  Stereo in, stereo out, one transform: left is the real part of the input
+  and right the imaginary. The IR is real, so the two never mix and come back
+  out as the real and imaginary parts of the result.
+
+  The FFT is radix 2 Stockham, on separate real and imaginary arrays, so each
+  butterfly's inner loop is unit stride with no bit reversal pass, and the
+  compiler vectorizes it and the multiply-add over the delay line.
+
+  The convolution runs on a worker thread per group, never on the mainloop.
+  The mix hands each sink's send to it through a ring and takes the wet
+  signal from another; the wet ring starts with latency_ms of silence ( at
+  least a bus buffer and a partition, since one write callback can send that
+  much before the worker runs ), which is the budget the worker has to turn
+  each block around, and is heard as predelay. If the worker misses it, the
+  mix carries on with no reverb for those frames and throws away the late
+  ones when they turn up, so the delay stays where it was. The mainloop never
+  waits on the worker for anything.
+
+  This is float in both builds; with SA_FIXED_POINT the send and return are
+  converted at the rings.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "saplay.h"
+
+#define CH SA_MIX_CHANNELS
+
+/*
+** the FFT
+*/
+
+typedef struct rv_fft {
+    size_t n;
+    float *wr, *wi;     // n / 2 twiddles, e^( -2 pi i k / n )
+    float *tr, *ti;     // the other half of the ping pong
+} rv_fft_t;
+
+static bool fft_init(rv_fft_t *f, size_t n) {
+
+    f->n = n;
+    f->wr = malloc(n / 2 * sizeof(float));
+    f->wi = malloc(n / 2 * sizeof(float));
+    f->tr = malloc(n * sizeof(float));
+    f->ti = malloc(n * sizeof(float));
+    if (!f->wr || !f->wi || !f->tr || !f->ti) return(false);
+    for (size_t k = 0; k < n / 2; k++) {
+        f->wr[k] = (float) cos(2.0 * M_PI * k / n);
+        f->wi[k] = (float) -sin(2.0 * M_PI * k / n);
+    }
+    return(true);
+}
+
+static void fft_free(rv_fft_t *f) {
+    free(f->wr);
+    free(f->wi);
+    free(f->tr);
+    free(f->ti);
+}
+
+// one stage: len point transforms, s of them interleaved
+static void fft_stage(const float *restrict ar, const float *restrict ai, float *restrict br, float *restrict bi,
+        const float *restrict wr, const float *restrict wi, size_t len, size_t s, float sign) {
+
+    size_t m = len / 2;
+    for (size_t p = 0; p < m; p++) {
+        const float cr = wr[p * s], ci = sign * wi[p * s];
+        const float *a0r = ar + s * p, *a0i = ai + s * p;
+        const float *a1r = ar + s * (p + m), *a1i = ai + s * (p + m);
+        float *b0r = br + s * 2 * p, *b0i = bi + s * 2 * p;
+        float *b1r = b0r + s, *b1i = b0i + s;
+        for (size_t q = 0; q < s; q++) {
+            const float dr = a0r[q] - a1r[q], di = a0i[q] - a1i[q];
+            b0r[q] = a0r[q] + a1r[q];
+            b0i[q] = a0i[q] + a1i[q];
+            b1r[q] = dr * cr - di * ci;
+            b1i[q] = dr * ci + di * cr;
+        }
+    }
+}
+
+// in place, unscaled; sign -1 forward, 1 inverse
+static void fft_run(rv_fft_t *f, float *xr, float *xi, float sign) {
+
+    float *ar = xr, *ai = xi, *br = f->tr, *bi = f->ti;
+    for (size_t len = f->n, s = 1; len > 1; len /= 2, s *= 2) {
+        fft_stage(ar, ai, br, bi, f->wr, f->wi, len, s, -sign);
+        float *t = ar; ar = br; br = t;
+        t = ai; ai = bi; bi = t;
+    }
+    if (ar != xr) {
+        memcpy(xr, ar, f->n * sizeof(float));
+        memcpy(xi, ai, f->n * sizeof(float));
+    }
+}
+
+/*
+** the convolution
+*/
+
+struct sa_conv_ir {
+    size_t block;       // B, frames per partition
+    size_t n_parts;
+    size_t frames;      // of the IR
+    float *hr, *hi;     // n_parts spectra of 2B, with the inverse's 1 / 2B folded in
+};
+
+struct sa_conv {
+    const sa_conv_ir_t *ir;
+    rv_fft_t fft;
+    float *xr, *xi;     // the delay line, n_parts spectra of 2B
+    size_t head;        // where the newest is
+    float *inr, *ini;   // the last 2B frames in
+    float *yr, *yi;     // the output spectrum, then the output
+    size_t silent;      // blocks of nothing in a row
+};
+
+// any length of IR, any format the cache makes; NULL if it's empty or silent
+sa_conv_ir_t *sa_conv_ir_new(const sa_sample_t *s, int block) {
+
+    size_t frames = (size_t) s->frames;
+    if (frames > (size_t) SA_REVERB_MAX_IR_SEC * g_mix_rate) {
+        fprintf(stderr, "reverb: %s is longer than %d seconds, the rest is ignored\n", s->path, SA_REVERB_MAX_IR_SEC);
+        frames = (size_t) SA_REVERB_MAX_IR_SEC * g_mix_rate;
+    }
+    if (frames == 0) return(NULL);
+
+    // mono, at unit energy
+    int ch = s->spec.channels;
+    float *h = malloc(frames * sizeof(float));
+    if (!h) return(NULL);
+    double energy = 0;
+    for (size_t f = 0; f < frames; f++) {
+        float v = 0;
+        for (int c = 0; c < ch; c++) {
+            if (s->spec.format == PA_SAMPLE_S16NE) v += ((const int16_t *) s->data)[f * ch + c] / 32768.0f;
+            else v += ((const float *) s->data)[f * ch + c];
+        }
+        h[f] = v / ch;
+        energy += (double) h[f] * h[f];
+    }
+    if (energy <= 0) {
+        free(h);
+        return(NULL);
+    }
+    float scale = (float) (1.0 / sqrt(energy));
+
+    sa_conv_ir_t *ir = calloc(1, sizeof(sa_conv_ir_t));
+    rv_fft_t fft = {0};
+    size_t n = 2 * (size_t) block;
+    ir->block = block;
+    ir->frames = frames;
+    ir->n_parts = (frames + block - 1) / block;
+    ir->hr = malloc(ir->n_parts * n * sizeof(float));
+    ir->hi = malloc(ir->n_parts * n * sizeof(float));
+    if (!ir->hr || !ir->hi || !fft_init(&fft, n)) {
+        fft_free(&fft);
+        sa_conv_ir_free(ir);
+        free(h);
+        return(NULL);
+    }
+
+    // each partition zero padded to 2B, so overlap-save keeps the last B
+    for (size_t p = 0; p < ir->n_parts; p++) {
+        float *hr = ir->hr + p * n, *hi = ir->hi + p * n;
+        memset(hr, 0, n * sizeof(float));
+        memset(hi, 0, n * sizeof(float));
+        for (size_t i = 0; i < (size_t) block && p * block + i < frames; i++)
+            hr[i] = h[p * block + i] * scale / n;
+        fft_run(&fft, hr, hi, -1.0f);
+    }
+
+    fft_free(&fft);
+    free(h);
+    return(ir);
+}
+
+void sa_conv_ir_free(sa_conv_ir_t *ir) {
+    if (!ir) return;
+    free(ir->hr);
+    free(ir->hi);
+    free(ir);
+}
+
+sa_conv_t *sa_conv_new(const sa_conv_ir_t *ir) {
+
+    size_t n = 2 * ir->block;
+    sa_conv_t *c = calloc(1, sizeof(sa_conv_t));
+    c->ir = ir;
+    c->xr = calloc(ir->n_parts * n, sizeof(float));
+    c->xi = calloc(ir->n_parts * n, sizeof(float));
+    c->inr = calloc(n, sizeof(float));
+    c->ini = calloc(n, sizeof(float));
+    c->yr = malloc(n * sizeof(float));
+    c->yi = malloc(n * sizeof(float));
+    if (!fft_init(&c->fft, n) || !c->xr || !c->xi || !c->inr || !c->ini || !c->yr || !c->yi) {
+        sa_conv_free(c);
+        return(NULL);
+    }
+    return(c);
+}
+
+void sa_conv_free(sa_conv_t *c) {
+    if (!c) return;
+    fft_free(&c->fft);
+    free(c->xr);
+    free(c->xi);
+    free(c->inr);
+    free(c->ini);
+    free(c->yr);
+    free(c->yi);
+    free(c);
+}
+
+// y += x h, for complex spectra
+static void conv_cmac(float *restrict yr, float *restrict yi, const float *restrict xr, const float *restrict xi,
+        const float *restrict hr, const float *restrict hi, size_t n) {
+    for (size_t k = 0; k < n; k++) {
+        yr[k] += xr[k] * hr[k] - xi[k] * hi[k];
+        yi[k] += xr[k] * hi[k] + xi[k] * hr[k];
+    }
+}
+
+// One partition's worth: B stereo frames in, the next B out, interleaved.
+void sa_conv_process(sa_conv_t *c, const float *in, float *out) {
+
+    const sa_conv_ir_t *ir = c->ir;
+    size_t b = ir->block, n = 2 * b;
+
+    // slide the input along, and notice when nothing is coming in
+    memmove(c->inr, c->inr + b, b * sizeof(float));
+    memmove(c->ini, c->ini + b, b * sizeof(float));
+    bool silent = true;
+    for (size_t i = 0; i < b; i++) {
+        c->inr[b + i] = in[CH * i];
+        c->ini[b + i] = in[CH * i + 1];
+        silent &= in[CH * i] == 0.0f && in[CH * i + 1] == 0.0f;
+    }
+    c->silent = silent ? c->silent + 1 : 0;
+
+    c->head = c->head + 1 == ir->n_parts ? 0 : c->head + 1;
+    float *xr = c->xr + c->head * n, *xi = c->xi + c->head * n;
+
+    // the tail has died away and the line is all zeros; an idle reverb costs nothing
+    if (c->silent > ir->n_parts) {
+        memset(xr, 0, n * sizeof(float));
+        memset(xi, 0, n * sizeof(float));
+        memset(out, 0, b * CH * sizeof(float));
+        return;
+    }
+
+    memcpy(xr, c->inr, n * sizeof(float));
+    memcpy(xi, c->ini, n * sizeof(float));
+    fft_run(&c->fft, xr, xi, -1.0f);
+
+    // newest input with the first partition, back along the line
+    memset(c->yr, 0, n * sizeof(float));
+    memset(c->yi, 0, n * sizeof(float));
+    size_t slot = c->head;
+    for (size_t p = 0; p < ir->n_parts; p++) {
+        conv_cmac(c->yr, c->yi, c->xr + slot * n, c->xi + slot * n, ir->hr + p * n, ir->hi + p * n, n);
+        slot = slot == 0 ? ir->n_parts - 1 : slot - 1;
+    }
+    fft_run(&c->fft, c->yr, c->yi, 1.0f);
+
+    for (size_t i = 0; i < b; i++) {
+        out[CH * i] = c->yr[b + i];
+        out[CH * i + 1] = c->yi[b + i];
+    }
+}
+
+/*
+** rings between the mainloop and a worker, one writer and one reader each
+*/
+
+typedef struct rv_ring {
+    float *buf;
+    uint32_t size;              // frames, a power of 2
+    _Atomic uint32_t head;      // written up to, by the writer
+    _Atomic uint32_t tail;      // read up to, by the reader
+} rv_ring_t;
+
+static bool ring_init(rv_ring_t *r, uint32_t frames) {
+    r->size = 1;
+    while (r->size < frames) r->size <<= 1;
+    r->buf = calloc((size_t) r->size * CH, sizeof(float));
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return(r->buf != NULL);
+}
+
+static uint32_t ring_level(rv_ring_t *r) {
+    return(atomic_load_explicit(&r->head, memory_order_acquire) - atomic_load_explicit(&r->tail, memory_order_acquire));
+}
+
+// NULL src writes silence; returns what fit
+static uint32_t ring_write(rv_ring_t *r, const float *src, uint32_t frames) {
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t space = r->size - (head - atomic_load_explicit(&r->tail, memory_order_acquire));
+    if (frames > space) frames = space;
+    for (uint32_t i = 0; i < frames; i++) {
+        uint32_t at = ((head + i) & (r->size - 1)) * CH;
+        r->buf[at] = src ? src[CH * i] : 0.0f;
+        r->buf[at + 1] = src ? src[CH * i + 1] : 0.0f;
+    }
+    atomic_store_explicit(&r->head, head + frames, memory_order_release);
+    return(frames);
+}
+
+// NULL dst just skips; returns what there was
+static uint32_t ring_read(rv_ring_t *r, float *dst, uint32_t frames) {
+
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t level = atomic_load_explicit(&r->head, memory_order_acquire) - tail;
+    if (frames > level) frames = level;
+    for (uint32_t i = 0; dst && i < frames; i++) {
+        uint32_t at = ((tail + i) & (r->size - 1)) * CH;
+        dst[CH * i] = r->buf[at];
+        dst[CH * i + 1] = r->buf[at + 1];
+    }
+    atomic_store_explicit(&r->tail, tail + frames, memory_order_release);
+    return(frames);
+}
+
+/*
+** the groups
+*/
+
+typedef struct rv_sink {
+    sa_conv_t *conv;
+    rv_ring_t in;           // sends, mainloop to worker
+    rv_ring_t out;          // wet, worker to mainloop
+    uint32_t owed;          // wet frames the mix went without, mainloop only
+    uint32_t hold;          // sends that were dropped, so wet frames the mix has to go without, mainloop only
+} rv_sink_t;
+
+typedef struct rv_group {
+    sa_reverb_config_t cfg;
+    float ret;              // return gain
+    uint32_t latency;       // frames
+    sa_sample_t *sample;    // the IR, handed over by the mainloop
+    sa_conv_ir_t *ir;       // worker only
+    rv_sink_t sinks[MAX_SA_SINKS];
+
+    pthread_t thread;
+    bool started;
+    sem_t wake;
+    _Atomic bool running;
+    _Atomic bool ready;     // the worker has the IR, the mainloop can send
+
+    _Atomic uint64_t blocks;
+    _Atomic uint64_t busy_ns;
+    _Atomic uint64_t late_frames;
+    _Atomic uint64_t dropped_frames;
+} rv_group_t;
+
+static rv_group_t g_reverbs[SA_REVERB_MAX];
+static int g_n_reverbs = 0;
+static rv_group_t *g_sink_reverb[MAX_SA_SINKS];    // NULL if the sink has none
+
+static uint64_t reverb_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// from the config, before sa_reverb_start. Returns its index, -1 if it won't work.
+int sa_reverb_add(const sa_reverb_config_t *cfg) {
+
+    if (g_n_reverbs == SA_REVERB_MAX) {
+        fprintf(stderr, "reverb: at most %d reverbs\n", SA_REVERB_MAX);
+        return(-1);
+    }
+    int b = cfg->partition;
+    if (b < 64 || b > 8192 || (b & (b - 1))) {
+        fprintf(stderr, "reverb: %s partition must be a power of 2 from 64 to 8192\n", cfg->name);
+        return(-1);
+    }
+    uint32_t latency = (uint32_t) ceilf(cfg->latency_ms * g_mix_rate / 1000.0f);
+    if (latency < (uint32_t) b) {
+        fprintf(stderr, "reverb: %s latency_ms must be at least a partition, %.1f ms\n",
+            cfg->name, 1000.0f * b / g_mix_rate);
+        return(-1);
+    }
+    // one write callback can take a whole bus buffer before the worker sees any
+    // of it, so the wet has to start at least that far, and a partition, behind
+    uint32_t least = (uint32_t) (SA_BUS_TLENGTH_MS * g_mix_rate / 1000) + (uint32_t) b;
+    if (latency < least) {
+        if (g_verbose) fprintf(stderr, "reverb: %s latency raised to %u frames, a bus buffer and a partition\n", cfg->name, least);
+        latency = least;
+    }
+    for (int s = 0; s < MAX_SA_SINKS; s++) {
+        if ((cfg->sinks & (1u << s)) && g_sink_reverb[s]) {
+            fprintf(stderr, "reverb: %s: speaker %d already has a reverb\n", cfg->name, s);
+            return(-1);
+        }
+    }
+
+    rv_group_t *g = &g_reverbs[g_n_reverbs];
+    memset(g, 0, sizeof(rv_group_t));
+    g->cfg = *cfg;
+    g->cfg.name = strdup(cfg->name);
+    g->ret = powf(10.0f, cfg->return_db / 20.0f);
+    g->latency = latency;
+    for (int s = 0; s < MAX_SA_SINKS; s++) {
+        if (cfg->sinks & (1u << s)) g_sink_reverb[s] = g;
+    }
+    if (g_verbose) fprintf(stderr, "reverb: %s, %d frame partitions, %u frames latency\n", cfg->name, b, latency);
+    return(g_n_reverbs++);
+}
+
+// worker: what the IR turns into, and the silence that's the latency budget
+static void reverb_build(rv_group_t *g) {
+
+    g->ir = sa_conv_ir_new(g->sample, g->cfg.partition);
+    if (!g->ir) {
+        fprintf(stderr, "reverb: %s: impulse response %s is empty\n", g->cfg.name, g->sample->path);
+        return;
+    }
+    // room for the budget plus what a burst of write callbacks can push at once
+    uint32_t ring = 4 * (g->latency + (uint32_t) g->cfg.partition + SA_MIX_BLOCK_FRAMES);
+    for (int s = 0; s < MAX_SA_SINKS; s++) {
+        if (!(g->cfg.sinks & (1u << s))) continue;
+        rv_sink_t *rs = &g->sinks[s];
+        rs->conv = sa_conv_new(g->ir);
+        if (!rs->conv || !ring_init(&rs->in, ring) || !ring_init(&rs->out, ring)) {
+            fprintf(stderr, "reverb: %s: out of memory\n", g->cfg.name);
+            return;
+        }
+        ring_write(&rs->out, NULL, g->latency);
+    }
+    if (g_verbose) fprintf(stderr, "reverb: %s ready, %zu partitions, %.2f s\n",
+        g->cfg.name, g->ir->n_parts, (double) g->ir->frames / g_mix_rate);
+    atomic_store(&g->ready, true);
+}
+
+static void *reverb_worker(void *arg) {
+
+    rv_group_t *g = arg;
+    size_t b = (size_t) g->cfg.partition;
+    float *in = malloc(b * CH * sizeof(float));
+    float *out = malloc(b * CH * sizeof(float));
+
+    while (atomic_load(&g->running)) {
+        sem_wait(&g->wake);
+
+        if (!g->ir && g->sample) reverb_build(g);
+        if (!atomic_load(&g->ready)) continue;
+
+        // every full partition any sink has
+        bool more = true;
+        while (more) {
+            more = false;
+            for (int s = 0; s < MAX_SA_SINKS; s++) {
+                rv_sink_t *rs = &g->sinks[s];
+                if (!rs->conv || ring_level(&rs->in) < b) continue;
+                uint64_t t0 = reverb_nsec();
+                ring_read(&rs->in, in, (uint32_t) b);
+                sa_conv_process(rs->conv, in, out);
+                ring_write(&rs->out, out, (uint32_t) b);
+                atomic_fetch_add_explicit(&g->busy_ns, reverb_nsec() - t0, memory_order_relaxed);
+                atomic_fetch_add_explicit(&g->blocks, 1, memory_order_relaxed);
+                more = true;
+            }
+        }
+    }
+
+    free(in);
+    free(out);
+    return(NULL);
+}
+
+bool sa_reverb_start(void) {
+
+    for (int i = 0; i < g_n_reverbs; i++) {
+        rv_group_t *g = &g_reverbs[i];
+        sem_init(&g->wake, 0, 0);
+        atomic_store(&g->running, true);
+        int r = pthread_create(&g->thread, NULL, reverb_worker, g);
+        if (r != 0) {
+            fprintf(stderr, "reverb: could not start worker: %s\n", strerror(r));
+            return(false);
+        }
+        g->started = true;
+    }
+    return(true);
+}
+
+void sa_reverb_done(void) {
+
+    for (int i = 0; i < g_n_reverbs; i++) {
+        rv_group_t *g = &g_reverbs[i];
+        if (g->started) {
+            atomic_store(&g->running, false);
+            sem_post(&g->wake);
+            pthread_join(g->thread, NULL);
+            sem_destroy(&g->wake);
+        }
+        for (int s = 0; s < MAX_SA_SINKS; s++) {
+            sa_conv_free(g->sinks[s].conv);
+            free(g->sinks[s].in.buf);
+            free(g->sinks[s].out.buf);
+            if (g_sink_reverb[s] == g) g_sink_reverb[s] = NULL;
+        }
+        sa_conv_ir_free(g->ir);
+        free(g->cfg.name);
+    }
+    g_n_reverbs = 0;
+}
+
+// the cache has the IR ( or gave up on it ), mainloop
+void sa_reverb_set_ir(int r, sa_sample_t *sample) {
+
+    rv_group_t *g = &g_reverbs[r];
+    if (g->sample) return;
+    if (atomic_load(&sample->state) != SA_SAMPLE_READY) {
+        fprintf(stderr, "reverb: %s: could not load %s, no reverb\n", g->cfg.name, sample->path);
+        return;
+    }
+    g->sample = sample;
+    sem_post(&g->wake);
+}
+
+bool sa_reverb_active(int sink) {
+    rv_group_t *g = g_sink_reverb[sink];
+    return(g && atomic_load_explicit(&g->ready, memory_order_acquire));
+}
+
+// how long after the last send there's still something coming back
+pa_usec_t sa_reverb_tail(int sink) {
+    rv_group_t *g = g_sink_reverb[sink];
+    if (!sa_reverb_active(sink)) return(0);
+    return((pa_usec_t) (g->ir->frames + g->latency) * PA_USEC_PER_SEC / g_mix_rate);
+}
+
+// Mainloop, from the mix: a block of a sink's send to the worker, and as much
+// wet as is back into acc. Never waits.
+void sa_reverb_send(int sink, const sa_mix_acc_t *send, sa_mix_acc_t *acc, size_t frames) {
+
+    rv_group_t *g = g_sink_reverb[sink];
+    rv_sink_t *rs = &g->sinks[sink];
+    float buf[SA_MIX_BLOCK_FRAMES * CH];
+    size_t samples = frames * CH;
+
+#ifdef SA_FIXED_POINT
+    for (size_t i = 0; i < samples; i++) buf[i] = send[i] * (1.0f / 32768.0f);
+#else
+    memcpy(buf, send, samples * sizeof(float));
+#endif
+    // only short if the worker's hopelessly behind; the wet for what didn't fit
+    // will never come, so the mix goes without that much to keep the rest in time
+    uint32_t put = ring_write(&rs->in, buf, (uint32_t) frames);
+    if (put < frames) {
+        rs->hold += (uint32_t) frames - put;
+        atomic_fetch_add_explicit(&g->dropped_frames, frames - put, memory_order_relaxed);
+    }
+    if (ring_level(&rs->in) >= (uint32_t) g->cfg.partition) sem_post(&g->wake);
+
+    // late frames still to come and dropped ones that never will cancel out
+    uint32_t both = rs->owed < rs->hold ? rs->owed : rs->hold;
+    rs->owed -= both;
+    rs->hold -= both;
+
+    // frames the mix already went without, so they don't push the rest later
+    if (rs->owed) rs->owed -= ring_read(&rs->out, NULL, rs->owed);
+
+    uint32_t skip = rs->hold < frames ? rs->hold : (uint32_t) frames;
+    rs->hold -= skip;
+    uint32_t got = ring_read(&rs->out, buf, (uint32_t) frames - skip);
+    if (got < frames - skip) {
+        rs->owed += (uint32_t) frames - skip - got;
+        atomic_fetch_add_explicit(&g->late_frames, frames - skip - got, memory_order_relaxed);
+    }
+
+    const float ret = g->ret;
+    acc += (size_t) skip * CH;
+    for (size_t i = 0; i < (size_t) got * CH; i++) {
+#ifdef SA_FIXED_POINT
+        acc[i] += (int32_t) lrintf(buf[i] * ret * 32768.0f);
+#else
+        acc[i] += buf[i] * ret;
+#endif
+    }
+}
+
+// for /metrics, any thread
+int sa_reverb_stats(sa_reverb_stats_t *stats, int max) {
+
+    int n = 0;
+    for (int i = 0; i < g_n_reverbs && n < max; i++, n++) {
+        rv_group_t *g = &g_reverbs[i];
+        sa_reverb_stats_t *st = &stats[n];
+        st->name = g->cfg.name;
+        st->ready = atomic_load(&g->ready);
+        st->ir_ms = st->ready ? (int) ((uint64_t) g->ir->frames * 1000 / g_mix_rate) : 0;
+        st->blocks = atomic_load(&g->blocks);
+        st->late_frames = atomic_load(&g->late_frames);
+        st->dropped_frames = atomic_load(&g->dropped_frames);
+        // of the time a block lasts, how much the worker spends on one
+        double block_ns = 1e9 * g->cfg.partition / g_mix_rate;
+        st->load = st->blocks ? (float) (atomic_load(&g->busy_ns) / (double) st->blocks / block_ns) : 0.0f;
+    }
+    return(n);
+}
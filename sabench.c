@@ -0,0 +1,320 @@
+/***
+  SerenityAudio
+
+  sabench - times the mix on its own, no PulseAudio, no files. A handful of
+  synthetic samples in every format the build has a kernel for, N voices on one
+  bus, a few of them ramping, mixed in write callback sized pieces; with -r
+  every voice plays at its own rate through the varispeed kernel, with -g every
+  voice is a granular cloud of 100 ms grains at 40 a second. Then the
+  speaker protection DSP on its own, on loud noise so the limiter works: a
+  high-pass, two peaking EQs and the limiter, in cycles per frame for one sink.
+  Last the reverb's convolution, for IRs from a quarter of a second to eight
+  seconds, in partitions of -p frames; that's the cost of one sink on its
+  worker thread, and it goes up with the IR's length.
+
+    ./sabench [-n voices] [-s seconds] [-b frames per write] [-r] [-g] [-p partition] [-m cpu MHz]
+
+  Cycles are time times the clock, which comes from cpufreq's max unless -m
+  says otherwise, so pin the governor to performance for honest numbers.
+
+  `make bench` builds it twice, float and SA_FIXED_POINT, and runs both, which is
+  the comparison that matters on a board without much of an FPU.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <math.h>
+
+#include "saplay.h"
+
+#define BENCH_SAMPLE_SEC 3
+#define BENCH_MAX_VOICES 256
+
+int g_verbose = 0;
+
+static uint64_t cpu_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+// something noisy enough that nothing gets optimized into a constant
+static sa_sample_t *bench_sample(pa_sample_format_t format, int channels) {
+
+    sa_sample_t *s = calloc(1, sizeof(sa_sample_t));
+    s->path = "bench";
+    s->spec.format = format;
+    s->spec.channels = (uint8_t) channels;
+    s->spec.rate = (uint32_t) g_mix_rate;
+    s->frames = (sf_count_t) g_mix_rate * BENCH_SAMPLE_SEC;
+    size_t n = (size_t) s->frames * channels;
+
+    uint32_t r = 12345;
+    if (format == PA_SAMPLE_S16NE) {
+        int16_t *d = malloc((n + channels) * sizeof(int16_t));
+        for (size_t i = 0; i < n; i++) {
+            r = r * 1103515245 + 12345;
+            d[i] = (int16_t) (r >> 16) / 4;
+        }
+        memcpy(d + n, d, channels * sizeof(int16_t));  // the guard frame, as the cache does
+        s->data = d;
+    }
+    else {
+        float *d = malloc((n + channels) * sizeof(float));
+        for (size_t i = 0; i < n; i++) {
+            r = r * 1103515245 + 12345;
+            d[i] = (int16_t) (r >> 16) / (4 * 32768.0f);
+        }
+        memcpy(d + n, d, channels * sizeof(float));
+        s->data = d;
+    }
+    atomic_init(&s->state, SA_SAMPLE_READY);
+    return(s);
+}
+
+static void usage(const char *argv0) {
+    printf("%s [-n voices] [-s seconds] [-b frames per write] [-r] [-g] [-p partition] [-m cpu MHz]\n", argv0);
+}
+
+// 0 if we can't tell
+static double cpu_mhz(void) {
+
+    FILE *f = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
+    if (!f) return(0);
+    long khz = 0;
+    if (fscanf(f, "%ld", &khz) != 1) khz = 0;
+    fclose(f);
+    return(khz / 1000.0);
+}
+
+// the chain on sink 0 by itself, a second of noise at a time
+static void bench_dsp(int seconds, int block, double mhz) {
+
+    sa_dsp_config_t cfg = {
+        .n_biquads = 3,
+        .biquads = {
+            { .type = SA_BIQUAD_HIGHPASS, .freq = 120.0f, .q = 0.7071f },
+            { .type = SA_BIQUAD_PEAKING, .freq = 400.0f, .q = 1.0f, .gain_db = -3.0f },
+            { .type = SA_BIQUAD_PEAKING, .freq = 3000.0f, .q = 2.0f, .gain_db = 2.0f },
+        },
+        .limiter = true, .threshold_db = -1.0f, .lookahead_ms = 2.0f, .release_ms = 50.0f
+    };
+    if (!sa_dsp_setup(0, &cfg)) return;
+
+    size_t n = (size_t) g_mix_rate * SA_MIX_CHANNELS;
+    sa_mix_acc_t *noise = malloc(n * sizeof(sa_mix_acc_t));
+    sa_mix_acc_t *work = malloc(n * sizeof(sa_mix_acc_t));
+    uint32_t r = 54321;
+    for (size_t i = 0; i < n; i++) {
+        r = r * 1103515245 + 12345;
+        // about twice full scale at the peaks
+#ifdef SA_FIXED_POINT
+        noise[i] = (int16_t) (r >> 16) * 2;
+#else
+        noise[i] = (int16_t) (r >> 16) / 16384.0f;
+#endif
+    }
+
+    uint64_t ns = 0, frames = 0;
+    for (int s = 0; s < seconds; s++) {
+        memcpy(work, noise, n * sizeof(sa_mix_acc_t));
+        uint64_t t0 = cpu_nsec();
+        for (int f = 0; f < g_mix_rate; f += block) {
+            int len = g_mix_rate - f < block ? g_mix_rate - f : block;
+            sa_dsp_process(0, work + (size_t) f * SA_MIX_CHANNELS, len);
+        }
+        ns += cpu_nsec() - t0;
+        frames += g_mix_rate;
+    }
+
+    printf("dsp: 3 biquads and a %.0f ms lookahead limiter, stereo\n", cfg.lookahead_ms);
+    printf("%.1f ns per frame", (double) ns / frames);
+    if (mhz > 0) printf(", %.0f cycles per frame per sink at %.0f MHz", (double) ns / frames * mhz / 1000.0, mhz);
+    printf(", %.2f%% of a core per sink\n", 100.0 * (ns / 1e9) / seconds);
+
+    free(noise);
+    free(work);
+}
+
+// one sink's convolution for each length of IR: a decaying noise tail, and
+// noise in, so the silence skip never kicks in
+static void bench_reverb(int seconds, int partition, double mhz) {
+
+    static const float ir_sec[] = { 0.25f, 0.5f, 1.0f, 2.0f, 4.0f, 8.0f };
+
+    size_t b = (size_t) partition;
+    float *in = malloc(b * SA_MIX_CHANNELS * sizeof(float));
+    float *out = malloc(b * SA_MIX_CHANNELS * sizeof(float));
+    uint32_t r = 777;
+    for (size_t i = 0; i < b * SA_MIX_CHANNELS; i++) {
+        r = r * 1103515245 + 12345;
+        in[i] = (int16_t) (r >> 16) / 32768.0f;
+    }
+
+    printf("reverb: partitioned convolution, %d frame partitions, one sink\n", partition);
+    for (size_t k = 0; k < sizeof(ir_sec) / sizeof(ir_sec[0]); k++) {
+
+        sa_sample_t ir = { .path = "bench ir" };
+        ir.spec.format = PA_SAMPLE_FLOAT32NE;
+        ir.spec.channels = 1;
+        ir.spec.rate = (uint32_t) g_mix_rate;
+        ir.frames = (sf_count_t) (ir_sec[k] * g_mix_rate);
+        float *h = malloc((size_t) ir.frames * sizeof(float));
+        for (sf_count_t f = 0; f < ir.frames; f++) {
+            r = r * 1103515245 + 12345;
+            h[f] = (int16_t) (r >> 16) / 32768.0f * expf(-6.9f * f / ir.frames);   // -60 dB at the end
+        }
+        ir.data = h;
+
+        sa_conv_ir_t *cir = sa_conv_ir_new(&ir, partition);
+        sa_conv_t *conv = cir ? sa_conv_new(cir) : NULL;
+        if (!conv) {
+            printf("  %.2f s IR: out of memory\n", ir_sec[k]);
+            free(h);
+            sa_conv_ir_free(cir);
+            continue;
+        }
+
+        uint64_t blocks = (uint64_t) seconds * g_mix_rate / b;
+        uint64_t t0 = cpu_nsec();
+        for (uint64_t i = 0; i < blocks; i++) sa_conv_process(conv, in, out);
+        uint64_t ns = cpu_nsec() - t0;
+        double frames = (double) blocks * b;
+
+        printf("  %.2f s IR: %.1f ns per frame", ir_sec[k], ns / frames);
+        if (mhz > 0) printf(", %.0f cycles", ns / frames * mhz / 1000.0);
+        printf(", %.2f%% of a core per sink\n", 100.0 * ns / (frames / g_mix_rate * 1e9));
+
+        sa_conv_free(conv);
+        sa_conv_ir_free(cir);
+        free(h);
+    }
+    free(in);
+    free(out);
+}
+
+int main(int argc, char *argv[]) {
+
+    int n_voices = 8, seconds = 10, block = 1024, partition = SA_REVERB_PARTITION_DEFAULT;
+    bool varispeed = false, granular = false;
+    double mhz = cpu_mhz();
+    int c;
+
+    while ((c = getopt(argc, argv, "n:s:b:rgp:m:")) != -1) {
+        switch (c) {
+            case 'n': n_voices = atoi(optarg); break;
+            case 's': seconds = atoi(optarg); break;
+            case 'b': block = atoi(optarg); break;
+            case 'r': varispeed = true; break;
+            case 'g': granular = true; break;
+            case 'p': partition = atoi(optarg); break;
+            case 'm': mhz = atof(optarg); break;
+            default:
+                usage(argv[0]);
+                return(1);
+        }
+    }
+    if (n_voices < 1 || n_voices > BENCH_MAX_VOICES || seconds < 1 || block < 1
+     || partition < 64 || (partition & (partition - 1))) {
+        usage(argv[0]);
+        return(1);
+    }
+
+    // every format this build can play
+    sa_sample_t *samples[4];
+    int n_samples = 0;
+    samples[n_samples++] = bench_sample(PA_SAMPLE_S16NE, 1);
+    samples[n_samples++] = bench_sample(PA_SAMPLE_S16NE, 2);
+#ifndef SA_FIXED_POINT
+    samples[n_samples++] = bench_sample(PA_SAMPLE_FLOAT32NE, 1);
+    samples[n_samples++] = bench_sample(PA_SAMPLE_FLOAT32NE, 2);
+#endif
+
+    sa_soundplay_t *voices = calloc(n_voices, sizeof(sa_soundplay_t));
+    sa_soundplay_t *bus = NULL;
+    for (int i = 0; i < n_voices; i++) {
+        sa_soundplay_t *v = &voices[i];
+        v->sample = samples[i % n_samples];
+        v->kernel = sa_mix_kernel(&v->sample->spec, false);
+        v->rate = SA_MIX_RATE_UNITY;
+        v->pos = (i * 7919) % v->sample->frames;   // not all in step
+        v->meter_slot = -1;
+        v->gain = v->gain_target = sa_mix_gain(1.0f / n_voices);
+        v->playing = true;
+        // spread over a couple of semitones either way
+        if (varispeed) sa_soundplay_set_rate(v, 0.89f + 0.22f * i / n_voices);
+        if (granular) {
+            sa_grain_config_t gc = { .grain_ms_lo = 80, .grain_ms_hi = 120, .density = 40, .pos_lo = 0, .pos_hi = 1 };
+            v->grains = sa_grains_new(&gc, i + 1);
+        }
+        v->next = bus;
+        bus = v;
+    }
+
+    sa_mix_out_t *out = malloc((size_t) block * SA_MIX_CHANNELS * sizeof(sa_mix_out_t));
+    uint64_t frames = (uint64_t) g_mix_rate * seconds;
+    uint64_t done = 0;
+    int writes = 0;
+
+    uint64_t t0 = cpu_nsec();
+    while (done < frames) {
+        // a quarter of the voices are always somewhere in a one second fade
+        if (writes % (g_mix_rate / block + 1) == 0) {
+            for (int i = 0; i < n_voices; i += 4)
+                sa_soundplay_set_gain(&voices[i], (writes / (g_mix_rate / block + 1)) % 2 ? 0.0f : 1.0f / n_voices, 1000);
+        }
+        sa_mix_bus(bus, out, block, 0);
+        done += block;
+        writes++;
+    }
+    uint64_t ns = cpu_nsec() - t0;
+
+#ifdef SA_FIXED_POINT
+    const char *build = "fixed point ( Q15 / 32 bit )";
+#else
+    const char *build = "float";
+#endif
+    double audio_sec = (double) done / g_mix_rate;
+    printf("mix: %s, %d %svoices, %d Hz, %d frames per write\n", build, n_voices,
+        granular ? "granular " : varispeed ? "varispeed " : "",
+        g_mix_rate, block);
+    printf("%.1f ns per frame, %.2f ns per voice frame\n", (double) ns / done, (double) ns / done / n_voices);
+    printf("%.1f x realtime, %.2f%% of a core per sink\n", audio_sec / (ns / 1e9), 100.0 * (ns / 1e9) / audio_sec);
+
+    bench_dsp(seconds, block, mhz);
+    bench_reverb(seconds, partition, mhz);
+
+    free(out);
+    for (int i = 0; i < n_voices; i++) sa_grains_free(voices[i].grains);
+    free(voices);
+    for (int i = 0; i < n_samples; i++) {
+        free(samples[i]->data);
+        free(samples[i]);
+    }
+    return(0);
+}
@@ -0,0 +1,287 @@
+/***
+  SerenityAudio
+
+  saload - a small load generator for the HTTP side. Opens N keep-alive
+  connections, each on its own thread, and GETs a path as fast as the server
+  answers for a fixed time. Reports requests/sec and latency percentiles.
+
+    ./saload [-h host] [-p port] [-c connections] [-d seconds] [-e] [path]
+
+  -e sends back the ETag from the first answer as If-None-Match, which is what
+  a polling control UI should do, so most answers are 304s.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#define _GNU_SOURCE // memmem
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LOAD_BUF_SZ 65536
+#define LOAD_MAX_CONNECTIONS 256
+
+static const char *g_host = "127.0.0.1";
+static const char *g_port = "8000";
+static const char *g_path = "/status";
+static int g_connections = 8;
+static int g_seconds = 10;
+static bool g_etag = false;
+
+static volatile bool g_stop = false;
+
+typedef struct load_conn {
+    pthread_t thread;
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t not_modified;
+    uint64_t *lat_usec;      // one per request
+    size_t lat_n, lat_alloc;
+} load_conn_t;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int load_connect(void) {
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(g_host, g_port, &hints, &res) != 0) return(-1);
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return(fd);
+}
+
+// reads one response. Returns the status code, or -1 if the connection broke.
+// Leaves anything past the end of the response in buf ( *have bytes ).
+static int load_read_response(int fd, char *buf, size_t *have, char *etag, size_t etag_sz) {
+
+    char *hdr_end;
+
+    while ((hdr_end = memmem(buf, *have, "\r\n\r\n", 4)) == NULL) {
+        if (*have == LOAD_BUF_SZ) return(-1);
+        ssize_t r = read(fd, buf + *have, LOAD_BUF_SZ - *have);
+        if (r <= 0) return(-1);
+        *have += r;
+    }
+
+    size_t hdr_len = hdr_end - buf + 4;
+    int code = -1;
+    long content_length = 0;
+
+    if (sscanf(buf, "HTTP/1.%*d %d", &code) != 1) return(-1);
+
+    // walk header lines
+    for (char *line = strstr(buf, "\r\n") + 2; line < hdr_end; ) {
+        char *eol = strstr(line, "\r\n");
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtol(line + 15, NULL, 10);
+        }
+        else if (etag && strncasecmp(line, "ETag:", 5) == 0) {
+            char *v = line + 5;
+            while (*v == ' ') v++;
+            size_t n = eol - v;
+            if (n >= etag_sz) n = etag_sz - 1;
+            memcpy(etag, v, n);
+            etag[n] = 0;
+        }
+        line = eol + 2;
+    }
+
+    size_t total = hdr_len + content_length;
+    if (total > LOAD_BUF_SZ) return(-1);
+    while (*have < total) {
+        ssize_t r = read(fd, buf + *have, LOAD_BUF_SZ - *have);
+        if (r <= 0) return(-1);
+        *have += r;
+    }
+
+    memmove(buf, buf + total, *have - total);
+    *have -= total;
+    return(code);
+}
+
+static void *load_thread(void *arg) {
+
+    load_conn_t *lc = (load_conn_t *) arg;
+    char *buf = malloc(LOAD_BUF_SZ);
+    char req[1024];
+    char etag[128] = "";
+    size_t have = 0;
+    int fd = -1;
+
+    while (!g_stop) {
+
+        if (fd < 0) {
+            fd = load_connect();
+            if (fd < 0) {
+                lc->errors++;
+                usleep(100000);
+                continue;
+            }
+            have = 0;
+        }
+
+        int len;
+        if (g_etag && etag[0])
+            len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nIf-None-Match: %s\r\n\r\n", g_path, g_host, etag);
+        else
+            len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", g_path, g_host);
+
+        uint64_t t0 = now_usec();
+        if (write(fd, req, len) != len) {
+            lc->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        int code = load_read_response(fd, buf, &have, g_etag ? etag : NULL, sizeof(etag));
+        uint64_t t1 = now_usec();
+
+        if (code < 0) {
+            lc->errors++;
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if (code == 304) lc->not_modified++;
+        else if (code != 200) lc->errors++;
+
+        lc->requests++;
+        if (lc->lat_n == lc->lat_alloc) {
+            lc->lat_alloc = lc->lat_alloc ? lc->lat_alloc * 2 : 4096;
+            lc->lat_usec = realloc(lc->lat_usec, lc->lat_alloc * sizeof(uint64_t));
+        }
+        lc->lat_usec[lc->lat_n++] = t1 - t0;
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+    return(NULL);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return(x < y ? -1 : x > y);
+}
+
+static void usage(const char *argv0) {
+    printf("%s [-h host] [-p port] [-c connections] [-d seconds] [-e] [path]\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+
+    int c;
+
+    while ((c = getopt(argc, argv, "h:p:c:d:e")) != -1) {
+        switch (c) {
+            case 'h': g_host = optarg; break;
+            case 'p': g_port = optarg; break;
+            case 'c': g_connections = atoi(optarg); break;
+            case 'd': g_seconds = atoi(optarg); break;
+            case 'e': g_etag = true; break;
+            default:
+                usage(argv[0]);
+                return(1);
+        }
+    }
+    if (optind < argc) g_path = argv[optind];
+
+    if (g_connections < 1 || g_connections > LOAD_MAX_CONNECTIONS || g_seconds < 1) {
+        usage(argv[0]);
+        return(1);
+    }
+
+    load_conn_t *conns = calloc(g_connections, sizeof(load_conn_t));
+
+    uint64_t start = now_usec();
+    for (int i = 0; i < g_connections; i++) {
+        pthread_create(&conns[i].thread, NULL, load_thread, &conns[i]);
+    }
+    sleep(g_seconds);
+    g_stop = true;
+
+    uint64_t requests = 0, errors = 0, not_modified = 0;
+    size_t lat_n = 0;
+    for (int i = 0; i < g_connections; i++) {
+        pthread_join(conns[i].thread, NULL);
+        requests += conns[i].requests;
+        errors += conns[i].errors;
+        not_modified += conns[i].not_modified;
+        lat_n += conns[i].lat_n;
+    }
+    double elapsed = (now_usec() - start) / 1e6;
+
+    uint64_t *lat = malloc((lat_n ? lat_n : 1) * sizeof(uint64_t));
+    size_t off = 0;
+    for (int i = 0; i < g_connections; i++) {
+        memcpy(lat + off, conns[i].lat_usec, conns[i].lat_n * sizeof(uint64_t));
+        off += conns[i].lat_n;
+        free(conns[i].lat_usec);
+    }
+    qsort(lat, lat_n, sizeof(uint64_t), cmp_u64);
+
+    printf("%s:%s%s  %d connections  %.1f s\n", g_host, g_port, g_path, g_connections, elapsed);
+    printf("requests %llu ( %llu not modified )  errors %llu\n",
+        (unsigned long long) requests, (unsigned long long) not_modified, (unsigned long long) errors);
+    printf("requests/sec %.1f\n", requests / elapsed);
+    if (lat_n) {
+        printf("latency usec: p50 %llu  p90 %llu  p99 %llu  max %llu\n",
+            (unsigned long long) lat[lat_n / 2],
+            (unsigned long long) lat[lat_n * 90 / 100],
+            (unsigned long long) lat[lat_n * 99 / 100],
+            (unsigned long long) lat[lat_n - 1]);
+    }
+
+    free(lat);
+    free(conns);
+    return(errors ? 2 : 0);
+}
@@ -49,6 +49,7 @@ SOFTWARE.
 #include <getopt.h>
 #include <locale.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 // Jannson for parsing Json
 #include <jansson.h>
@@ -58,22 +59,14 @@ SOFTWARE.
 
 int g_verbose = 0;
 
-// for now, the single oneg
-//static char *g_filename1 = "sounds/crickets-dawn.wav";  // this is not duped, it's from the inputs
-//static char *g_filename2 = "sounds/bullfrog-2.wav";  // this is not duped, it's from the inputs
-
-static char *g_filename1 = "sounds/flg_sample_3.wav";  
-static char *g_filename2 = "sounds/owl_01.wav";  
-
-static char *g_directory = NULL; // loaded from the config file
+char *g_directory = NULL; // loaded from the config file
 
 static char *g_config_filename = "config.json";
 
-static sa_soundscape_t *g_scape1 = NULL;
-static sa_soundscape_t *g_scape2 = NULL;
-
 static sa_sink_t g_sa_sinks[MAX_SA_SINKS] = {0}; // null terminated array of pointers
 
+int g_idle_cork_ms = SA_IDLE_CORK_MS_DEFAULT;
+
 static pa_context *g_context = NULL;
 static bool g_context_connected = false;
 
@@ -86,11 +79,19 @@ static bool g_channel_map_set = false;
 
 static pa_volume_t g_volume = PA_VOLUME_NORM;
 
-static pa_time_event *g_timer = NULL;
+// --soak, and the config's "soak"
+static sa_soak_config_t g_soak = { .hours = 0, .triggers_per_sec = 20, .reload_sec = 60, .sample_sec = 10,
+    .warmup_sec = 120, .rss_growth_kb = 8192, .heap_growth_kb = 4096, .fd_growth = 4 };
+
+static sa_timer_t g_start_timer;  // kicked once the context is ready
+static sa_timer_t g_status_timer = { .heap_idx = -1 }; // coalesces state changes into one /status rebuild
+static bool g_started = false;
+
+static uint64_t g_state_version = 0;
 
-// My timer will fire every 50ms
-//#define TIME_EVENT_USEC 50000
-#define TIME_EVENT_USEC 100000
+// boot timing
+static pa_usec_t g_boot_usec = 0;
+static _Atomic int64_t g_first_sound_ms = -1;
 
 
 /* A shortcut for terminating the application */
@@ -104,72 +105,168 @@ static void context_drain_complete(pa_context *c, void *userdata) {
     pa_context_disconnect(c);
 }
 
-/* Stream draining complete */
-static void stream_drain_complete(pa_stream *s, int success, void *userdata) {
-    sa_soundplay_t *splay = (sa_soundplay_t *) userdata;
-    pa_operation *o;
+/*
+** the buses: one stream per sink, and every voice on that sink is mixed into it
+** here ( see mix.c ) rather than each getting its own stream for the server to mix.
+*/
+
+/* This is called whenever new data may be written to a sink's stream */
+static void bus_write_callback(pa_stream *s, size_t length, void *userdata) {
+
+    int sink = (int) (intptr_t) userdata;
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    void *data;
+
+    assert(s && length);
+
+    SA_TRACE_BEGIN("write", (int64_t) length);
 
-    if (!success) {
-        fprintf(stderr, "Failed to drain stream: %s\n", pa_strerror(pa_context_errno(g_context)));
-        quit(1);
+    // mix straight into the server's buffer, no copy; the server may hand back
+    // less than asked for, so keep going until all of length is written
+    size_t written = 0;
+    int n_voices = 0;
+    while (written < length) {
+        size_t bytes = length - written;
+        if (pa_stream_begin_write(s, &data, &bytes) < 0 || !data) {
+            fprintf(stderr, "begin write failed on %s: %s\n", snk->dev, pa_strerror(pa_context_errno(g_context)));
+            break;
+        }
+
+        size_t frames = bytes / (SA_MIX_CHANNELS * sizeof(sa_mix_out_t));
+        if (frames == 0) {
+            pa_stream_cancel_write(s);
+            break;
+        }
+        bytes = frames * SA_MIX_CHANNELS * sizeof(sa_mix_out_t);
+        n_voices += sa_mix_bus(snk->voices, (sa_mix_out_t *) data, frames, sink);
+        pa_stream_write(s, data, bytes, NULL, 0, PA_SEEK_RELATIVE);
+        written += bytes;
     }
 
-    if (splay->verbose)
-        fprintf(stderr, "Playback stream %s drained.\n",splay->stream_name );
+    if (n_voices && atomic_load_explicit(&g_first_sound_ms, memory_order_relaxed) < 0) {
+        int64_t ms = (int64_t) ((sa_timer_now() - g_boot_usec) / 1000);
+        atomic_store(&g_first_sound_ms, ms);
+        fprintf(stderr, "first sound %lld ms after boot\n", (long long) ms);
+    }
+
+    SA_TRACE_END("write", (int64_t) written);
+}
 
-    pa_stream_disconnect(splay->stream);
-    pa_stream_unref(splay->stream);
-    splay->stream = NULL;
+/* server ran out of our data, which is a dropout */
+static void bus_underflow_callback(pa_stream *s, void *userdata) {
+    int sink = (int) (intptr_t) userdata;
 
+    SA_TRACE_INSTANT("underflow", sink);
+    if (g_verbose) fprintf(stderr, "underflow on %s\n", g_sa_sinks[sink].dev);
 }
 
-/* This is called whenever new data may be written to the stream */
-static void stream_write_callback(pa_stream *s, size_t length, void *userdata) {
-    
-	sa_soundplay_t *splay = (sa_soundplay_t *)userdata;
+/*
+** idle buses. A sink with nothing on it for g_idle_cork_ms gets its stream
+** corked, so there are no write callbacks, no mixing of silence, and the server
+** can suspend the device. A voice starting uncorks it. Voices only move when
+** they're mixed, so one that starts on a corked sink begins from its first
+** frame once the stream is running again; nothing is cut off.
+*/
 
-    sf_count_t bytes;
-    void *data;
+// how far behind the mix the speaker is
+static pa_usec_t sa_bus_latency(int sink) {
 
-	//if (splay->verbose) fprintf(stderr,"stream write callback\n");
+    pa_stream *stream = g_sa_sinks[sink].stream;
+    if (!stream) return(0);
 
-    assert(s && length);
+    pa_usec_t l = 0;
+    int negative = 0;
+    if (pa_stream_get_latency(stream, &l, &negative) < 0 || negative) {
+        // no timing info yet; the whole target buffer is the upper bound
+        const pa_buffer_attr *attr = pa_stream_get_buffer_attr(stream);
+        l = attr ? pa_bytes_to_usec(attr->tlength, pa_stream_get_sample_spec(stream)) : 0;
+    }
+    return(l);
+}
 
-    if (!splay->sndfile) {
-		if (splay->verbose) fprintf(stderr, "write callback with no sndfile %s\n",splay->stream_name);
-        return;
-	}
+// moves the time since the last change into active or idle
+static void sa_bus_account(sa_sink_t *snk, bool corked) {
 
-    data = pa_xmalloc(length);
+    pa_usec_t now = sa_timer_now();
+    pa_usec_t since = atomic_load(&snk->since);
+    if (since && now > since) {
+        if (atomic_load(&snk->corked)) atomic_fetch_add(&snk->idle_usec, now - since);
+        else atomic_fetch_add(&snk->active_usec, now - since);
+    }
+    atomic_store(&snk->corked, corked);
+    atomic_store(&snk->since, now);
+}
 
-    if (splay->readf_function) {
-        size_t k = pa_frame_size(&splay->sample_spec);
+static void bus_idle_timer_fn(sa_timer_t *t, void *userdata) {
+
+    int sink = (int) (intptr_t) userdata;
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    if (!snk->stream || snk->voices || atomic_load(&snk->corked)) return;
+
+    if (g_verbose) fprintf(stderr, "bus %d idle, corking\n", sink);
+    SA_TRACE_INSTANT("cork", sink);
+    sa_bus_account(snk, true);
+    // what's still buffered is silence; dropped, so it isn't played ahead of
+    // the next sound when we uncork
+    pa_operation *o = pa_stream_cork(snk->stream, 1, NULL, NULL);
+    if (o) pa_operation_unref(o);
+    o = pa_stream_flush(snk->stream, NULL, NULL);
+    if (o) pa_operation_unref(o);
+}
 
-        if ((bytes = (splay->readf_function) (splay->sndfile, data, (sf_count_t) (length/k))) > 0)
-            bytes *= (sf_count_t) k;
+// the last voice left; cork once what it played has been heard, and its
+// reverb tail, and a while longer, so quick retriggers don't bounce the stream
+static void sa_bus_idle(int sink) {
 
-    } else {
-        bytes = sf_read_raw(splay->sndfile, data, (sf_count_t) length);
-	}
+    if (g_idle_cork_ms <= 0 || !g_sa_sinks[sink].stream) return;
+    sa_timer_schedule(&g_sa_sinks[sink].idle_timer,
+        (pa_usec_t) g_idle_cork_ms * PA_USEC_PER_MSEC + sa_bus_latency(sink) + sa_reverb_tail(sink));
+}
 
-    if (bytes > 0)
-        pa_stream_write(s, data, (size_t) bytes, pa_xfree, 0, PA_SEEK_RELATIVE);
-    else
-        pa_xfree(data);
+// A voice is starting. Nothing schedules starts ahead of time ( they come from
+// HTTP, the soak driver and the cache ), so there's no deadline to uncork early
+// for; instead the silence the stream was refilled with while corked is dropped,
+// and the voice is written into an empty buffer that starts playing as soon as
+// it's full. A first sound after idle is then no later than any other.
+static void sa_bus_wake(int sink) {
+
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    sa_timer_cancel(&snk->idle_timer);
+    if (!snk->stream || !atomic_load(&snk->corked)) return;
+
+    if (g_verbose) fprintf(stderr, "bus %d uncorking\n", sink);
+    SA_TRACE_INSTANT("uncork", sink);
+    sa_bus_account(snk, false);
+    pa_operation *o = pa_stream_flush(snk->stream, NULL, NULL);
+    if (o) pa_operation_unref(o);
+    o = pa_stream_cork(snk->stream, 0, NULL, NULL);
+    if (o) pa_operation_unref(o);
+}
 
-    if (bytes < (sf_count_t) length) {
-        sf_close(splay->sndfile);
-        splay->sndfile = NULL;
-        pa_operation_unref(pa_stream_drain(s, stream_drain_complete, userdata));
+// any thread
+void sa_sink_activity(int sink, sa_sink_activity_t *a) {
+
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    pa_usec_t since = atomic_load(&snk->since);
+    a->present = since != 0;
+    a->corked = atomic_load(&snk->corked);
+    uint64_t active = atomic_load(&snk->active_usec);
+    uint64_t idle = atomic_load(&snk->idle_usec);
+    pa_usec_t now = sa_timer_now();
+    if (since && now > since) {
+        if (a->corked) idle += now - since;
+        else active += now - since;
     }
+    a->active_ms = active / 1000;
+    a->idle_ms = idle / 1000;
 }
 
-/* This routine is called whenever the stream state changes */
-static void stream_state_callback(pa_stream *s, void *userdata) {
-	sa_soundplay_t *splay = (sa_soundplay_t *)userdata;
+/* This routine is called whenever a bus stream's state changes */
+static void bus_state_callback(pa_stream *s, void *userdata) {
+    int sink = (int) (intptr_t) userdata;
 
-	if (splay->verbose) {
-		fprintf(stderr, "stream state callback: %d\n",pa_stream_get_state(s) );
+	if (g_verbose) {
+		fprintf(stderr, "bus %d state callback: %d\n", sink, pa_stream_get_state(s) );
 	}
 
 	// just making sure
@@ -177,14 +274,13 @@ static void stream_state_callback(pa_stream *s, void *userdata) {
 
     switch (pa_stream_get_state(s)) {
         case PA_STREAM_CREATING:
-        	break;
         case PA_STREAM_TERMINATED:
-        	if (splay->verbose) fprintf(stderr, "stream %s terminated\n",splay->stream_name);
-            break;
+        	break;
 
         case PA_STREAM_READY:
-            if (splay->verbose)
-                fprintf(stderr, "Stream successfully created\n");
+            if (g_verbose)
+                fprintf(stderr, "bus stream for %s created\n", g_sa_sinks[sink].dev);
+            if (!g_sa_sinks[sink].voices) sa_bus_idle(sink);
             break;
 
         case PA_STREAM_FAILED:
@@ -194,6 +290,63 @@ static void stream_state_callback(pa_stream *s, void *userdata) {
     }
 }
 
+static void sa_bus_start(int sink) {
+
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    pa_sample_spec spec = { .format = SA_MIX_FORMAT, .rate = (uint32_t) g_mix_rate, .channels = SA_MIX_CHANNELS };
+
+    // a channel map from the command line only fits if it's stereo
+    const pa_channel_map *map = NULL;
+    if (g_channel_map_set) {
+        if (g_channel_map.channels == SA_MIX_CHANNELS) map = &g_channel_map;
+        else fprintf(stderr, "channel map is not %d channels, ignored\n", SA_MIX_CHANNELS);
+    }
+
+    // nothing of the last stream's filter or limiter history carries over
+    sa_dsp_reset(sink);
+    sa_timer_setup(&snk->idle_timer, bus_idle_timer_fn, (void *) (intptr_t) sink);
+    sa_bus_account(snk, false);
+
+    snk->stream = pa_stream_new(g_context, snk->dev, &spec, map);
+    assert(snk->stream);
+
+	pa_cvolume cv;
+
+    pa_stream_set_state_callback(snk->stream, bus_state_callback, (void *) (intptr_t) sink);
+    pa_stream_set_write_callback(snk->stream, bus_write_callback, (void *) (intptr_t) sink);
+    pa_stream_set_underflow_callback(snk->stream, bus_underflow_callback, (void *) (intptr_t) sink);
+    SA_TRACE_INSTANT("stream create", sink);
+    // a short buffer, so a callback ( even the first, which fills all of it ) is
+    // never more than the reverb's budget covers; see sa_reverb_add
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t) -1,
+        .tlength = (uint32_t) pa_usec_to_bytes(SA_BUS_TLENGTH_MS * PA_USEC_PER_MSEC, &spec),
+        .prebuf = (uint32_t) -1,
+        .minreq = (uint32_t) pa_usec_to_bytes(SA_BUS_MINREQ_MS * PA_USEC_PER_MSEC, &spec),
+        .fragsize = (uint32_t) -1,
+    };
+    pa_stream_connect_playback(snk->stream, snk->dev, &attr, PA_STREAM_ADJUST_LATENCY,
+				pa_cvolume_set(&cv, SA_MIX_CHANNELS, g_volume),
+			NULL/*sync stream*/);
+}
+
+static void sa_bus_stop(int sink) {
+
+    sa_sink_t *snk = &g_sa_sinks[sink];
+    if (!snk->stream) return;
+
+    SA_TRACE_INSTANT("stream stop", sink);
+    sa_timer_cancel(&snk->idle_timer);
+    sa_bus_account(snk, false);
+    atomic_store(&snk->since, 0);
+    pa_stream_set_state_callback(snk->stream, NULL, NULL);
+    pa_stream_set_write_callback(snk->stream, NULL, NULL);
+    pa_stream_set_underflow_callback(snk->stream, NULL, NULL);
+    pa_stream_disconnect(snk->stream);
+    pa_stream_unref(snk->stream);
+    snk->stream = NULL;
+}
+
 /* This is called whenever the context status changes */
 /* todo: creating the stream as soon as the context comes available is kinda fun, but 
 ** we really want something else
@@ -220,6 +373,8 @@ static void context_state_callback(pa_context *c, void *userdata) {
                 fprintf(stderr, "Connection established.\n");
             g_context_connected = true;
 
+            sa_timer_schedule(&g_start_timer, 0);
+
             break;
         }
 
@@ -234,6 +389,20 @@ static void context_state_callback(pa_context *c, void *userdata) {
     }
 }
 
+/* SIGUSR1: write out the trace rings, off the mainloop */
+static void trace_signal_callback(pa_mainloop_api*m, pa_signal_event *e, int sig, void *userdata) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/saplay-trace-%d.json", (int) getpid());
+    sa_trace_dump_file_async(path);
+}
+
+static bool config_reload(const char *filename);
+
+/* SIGHUP, the scene again from the config file */
+static void reload_signal_callback(pa_mainloop_api*m, pa_signal_event *e, int sig, void *userdata) {
+    config_reload(g_config_filename);
+}
+
 /* UNIX signal to quit recieved */
 static void exit_signal_callback(pa_mainloop_api*m, pa_signal_event *e, int sig, void *userdata) {	
     if (g_verbose)
@@ -242,151 +411,89 @@ static void exit_signal_callback(pa_mainloop_api*m, pa_signal_event *e, int sig,
 }
 
 
-// open it and set it for async playing
-// eventually can add delays and whatnot
-
-// Filename of null means use stdin... or is always passed in?
-// filename is a static and not to be freed
+// set up to play a cached sample on one sink. Nothing plays until start.
 
-static sa_soundplay_t * sa_soundplay_new( char *filename, char *dev ) {
+static sa_soundplay_t * sa_soundplay_new( sa_sample_t *sample, int sink ) {
 
 	sa_soundplay_t *splay = malloc(sizeof(sa_soundplay_t));
 	memset(splay, 0, sizeof(sa_soundplay_t) );  // typically don't do this, do every field, but doing it this time
-
-    SF_INFO sfinfo;
-
-  	// initialize many things from the globals at this point
-    splay->channel_map_set = g_channel_map_set;
-	if (splay->channel_map_set) {
-		splay->channel_map = g_channel_map;
-	}
-	splay->volume = g_volume;
+    splay->sink = sink;
+    splay->meter_slot = -1;
+    splay->gain = splay->gain_target = sa_mix_gain(1.0f);
 	splay->verbose = g_verbose;
 
-	// open file
-    memset(&sfinfo, 0, sizeof(sfinfo));
-
-	splay->sndfile = sf_open(filename, SFM_READ, &sfinfo);
-    splay->filename = strdup(filename);
-    splay->dev = strdup(dev);
-
-	// Todo: have an error code
-    if (!splay->sndfile) {
-        fprintf(stderr, "Failed to open file '%s'\n", filename);
-				sa_soundplay_free(splay);
-        return(NULL);
-    }
-
-    splay->sample_spec.rate = (uint32_t) sfinfo.samplerate;
-    splay->sample_spec.channels = (uint8_t) sfinfo.channels;
-
-    splay->readf_function = NULL;
-
-    switch (sfinfo.format & 0xFF) {
-        case SF_FORMAT_PCM_16:
-        case SF_FORMAT_PCM_U8:
-        case SF_FORMAT_PCM_S8:
-            splay->sample_spec.format = PA_SAMPLE_S16NE;
-            splay->readf_function = (sf_count_t (*)(SNDFILE *_sndfile, void *ptr, sf_count_t frames)) sf_readf_short;
-            break;
-
-        case SF_FORMAT_ULAW:
-            splay->sample_spec.format = PA_SAMPLE_ULAW;
-            break;
-
-        case SF_FORMAT_ALAW:
-            splay->sample_spec.format = PA_SAMPLE_ALAW;
-            break;
-
-        case SF_FORMAT_FLOAT:
-        case SF_FORMAT_DOUBLE:
-        default:
-            splay->sample_spec.format = PA_SAMPLE_FLOAT32NE;
-            splay->readf_function = (sf_count_t (*)(SNDFILE *_sndfile, void *ptr, sf_count_t frames)) sf_readf_float;
-            break;
+    assert(sample->state == SA_SAMPLE_READY);
+    splay->sample = sample;
+    splay->kernel = sa_mix_kernel(&sample->spec, false);
+    splay->rate = SA_MIX_RATE_UNITY;
+    assert(splay->kernel);
+
+    // the title if the file has one, otherwise the file's name
+    const char *n = sample->title;
+    if (!n) {
+        n = strrchr(sample->path, '/');
+        n = n ? n + 1 : sample->path;
     }
+    // both of these return strings that must be freed with pa_xfree()
+    splay->name = pa_locale_to_utf8(n);
+    if (!splay->name)
+        splay->name = pa_utf8_filter(n);
 
-    if (!splay->stream_name) {
-        const char *n, *sn;
-
-		// WARNING. No information about whether this function is returning
-		// newly allocated memory that must be freed, or a pointer inside
-		// the soundfile. Could thus be a memory leak
-        n = sf_get_string(splay->sndfile, SF_STR_TITLE);
-
-        if (!n)
-            n = filename;
-		// this returns a string that must be freed with pa_xfree()
-        splay->stream_name = pa_locale_to_utf8(n);
-        if (!sn)
-            splay->stream_name = pa_utf8_filter(n);
-
-    }
-
-    // better have had a context - don't know if it's connected though?
-    assert(g_context);
+    splay->meter_slot = sa_levels_voice_add(&splay->meter, splay->name, splay->sink);
 
     if (splay->verbose) {
         char t[PA_SAMPLE_SPEC_SNPRINT_MAX];
-        pa_sample_spec_snprint(t, sizeof(t), &splay->sample_spec);
-        fprintf(stderr, "created play file using sample spec '%s'\n", t);
-		}
+        pa_sample_spec_snprint(t, sizeof(t), &sample->spec);
+        fprintf(stderr, "created voice %s on sink %d, sample spec '%s'\n", splay->name, sink, t);
+    }
 
 	return(splay);
 
 }
 
+// onto its sink's bus, from the top of the sample. It's heard from the next write.
 void sa_soundplay_start( sa_soundplay_t *splay) {
 
-	if (splay->stream) {
-		fprintf(stderr, "Called start on already playing stream %s\n",splay->stream_name);
+	if (splay->playing) {
+		fprintf(stderr, "Called start on already playing voice %s\n",splay->name);
 		return;
 	}
-	if (splay->verbose) fprintf(stderr, "soundplay start: %s\n",splay->stream_name);
-
-	// have to open a new soundfile, but already have the key parameters
-	if (splay->sndfile==NULL) {
-
-    	SF_INFO sfinfo;
-	    memset(&sfinfo, 0, sizeof(sfinfo));
-
-        splay->sndfile = sf_open(splay->filename, SFM_READ, &sfinfo);
-        assert(splay->sndfile);
-    }
+	if (splay->verbose) fprintf(stderr, "soundplay start: %s\n",splay->name);
 
-    splay->stream = pa_stream_new(g_context, splay->stream_name, &splay->sample_spec, splay->channel_map_set ? &splay->channel_map : NULL);
-    assert(splay->stream);
-
-	pa_cvolume cv;
-
-    pa_stream_set_state_callback(splay->stream, stream_state_callback, splay);
-    pa_stream_set_write_callback(splay->stream, stream_write_callback, splay);
-    pa_stream_connect_playback(splay->stream, splay->dev, NULL/*buffer_attr*/ , 0/*flags*/ , 
-				pa_cvolume_set(&cv, splay->sample_spec.channels, splay->volume), 
-			NULL/*sync stream*/);
+    splay->pos = 0;
+    splay->playing = true;
+    splay->next = g_sa_sinks[splay->sink].voices;
+    g_sa_sinks[splay->sink].voices = splay;
+    sa_bus_wake(splay->sink);
 
+    SA_TRACE_INSTANT("voice start", splay->sink);
+    sa_state_changed();
 }
 
-// terminate a given sound
-void sa_soundplay_terminate( sa_soundplay_t *splay) {
-	if (splay->stream) {
-		pa_stream_disconnect(splay->stream);
-		if (splay->verbose) {
-			fprintf(stderr, "terminating stream %s will get a callback for draining",splay->stream_name);
-		}
-	}
-	else {
-		fprintf(stderr, "soundplay_terminate but no stream in progress");
-	}
+// off the bus right now. Writes happen on the mainloop too, so once this
+// returns the voice isn't referenced and is safe to free.
+void sa_soundplay_stop( sa_soundplay_t *splay ) {
+
+    if (!splay->playing) return;
 
+    for (sa_soundplay_t **pp = &g_sa_sinks[splay->sink].voices; *pp; pp = &(*pp)->next) {
+        if (*pp == splay) {
+            *pp = splay->next;
+            break;
+        }
+    }
+    splay->next = NULL;
+    splay->playing = false;
+    SA_TRACE_INSTANT("voice stop", splay->sink);
+    if (!g_sa_sinks[splay->sink].voices) sa_bus_idle(splay->sink);
 }
 
+// the sample belongs to the cache and stays
 void sa_soundplay_free( sa_soundplay_t *splay ) {
-	if (splay->stream) pa_stream_unref(splay->stream);
-	if (splay->stream_name) pa_xfree(splay->stream_name);
-	if (splay->sndfile) sf_close(splay->sndfile);
-    if (splay->dev) free(splay->dev);
-    if (splay->filename) free(splay->filename);
+    sa_soundplay_stop(splay);
+    sa_levels_voice_remove(splay->meter_slot);
+	if (splay->name) pa_xfree(splay->name);
+    sa_grains_free(splay->grains);
 
 	free(splay);
 }
@@ -396,44 +503,21 @@ void sa_soundplay_free( sa_soundplay_t *splay ) {
 ** a "soundscape" is made of all the speakers playing a particular loop.
 */
 
-// Init all the soundscapes, after the global context is created
-// loaded from the startup default config or something?
-void sa_soundscape_start(void) {
-
-    if (g_verbose) fprintf(stderr, "sa_soundscape_start: \n");
-
-    // Create a player for each file
-    sa_soundscape_t *scape;
-    scape = sa_soundscape_new( g_filename1 );
-    if (scape == NULL) {
-        fprintf(stderr, "scape file1 failed FATAL\n");
-    } else {
-        g_scape1 = scape; // for freeing only
-    }
-
-    scape = sa_soundscape_new( g_filename2 );
-    if (scape == NULL) {
-        fprintf(stderr, "scape file2 failed\n");
-    }
-    else {
-        g_scape2 = scape; // for freeing only
-    }
-
-}
-
-sa_soundscape_t *sa_soundscape_new(char *filename) {
+// with several samples, they're dealt out across the sinks so neighbouring
+// speakers don't play the same recording
+sa_soundscape_t *sa_soundscape_new(sa_sample_t **samples, int n_samples) {
 
     sa_soundscape_t *scape = malloc(sizeof(sa_soundscape_t));
     memset( scape, 0, sizeof(sa_soundscape_t) );
 
-    if (g_verbose) fprintf(stderr, "new soundscape: %s\n",filename);
+    if (g_verbose) fprintf(stderr, "new soundscape: %s ( %d samples )\n",samples[0]->path, n_samples);
 
 
     for(int i=0 ; i<MAX_SA_SINKS ; i++) {
         if (g_sa_sinks[i].active) {
-            if (g_verbose) fprintf(stderr, "new soundscape: new soundplay: sink %s\n",g_sa_sinks[i].dev);
-            scape->splays[i] = sa_soundplay_new(filename, g_sa_sinks[i].dev);
-            if (!scape->splays[i]) return(NULL);
+            sa_sample_t *sample = samples[i % n_samples];
+            if (g_verbose) fprintf(stderr, "new soundscape: new soundplay: %s sink %s\n",sample->path, g_sa_sinks[i].dev);
+            scape->splays[i] = sa_soundplay_new(sample, i);
             sa_soundplay_start(scape->splays[i]);
             scape->n_splays++;
         }
@@ -443,19 +527,30 @@ sa_soundscape_t *sa_soundscape_new(char *filename) {
 
 }
 
-void sa_soundscape_timer(sa_soundscape_t *scape) {
+void sa_soundscape_stop(sa_soundscape_t *scape) {
 
-    if (g_verbose) fprintf(stderr, "soundscape timer: scape %p\n",scape);
-
-    for (int i=0 ; i<scape->n_splays ; i++) {
-        if (scape->splays[i]->stream == 0) {
-            sa_soundplay_start(scape->splays[i]);
+    for (int i=0;i<scape->n_splays;i++) {
+        if (scape->splays[i]) {
+            sa_soundplay_stop(scape->splays[i]);
         }
     }
+}
+
+// how far behind the mix the speakers are, worst case across the scape's sinks
+pa_usec_t sa_soundscape_latency(sa_soundscape_t *scape) {
 
+    pa_usec_t worst = 0;
+
+    for (int i=0;i<scape->n_splays;i++) {
+        sa_soundplay_t *splay = scape->splays[i];
+        if (!splay) continue;
+        pa_usec_t l = sa_bus_latency(splay->sink);
+        if (l > worst) worst = l;
+    }
+    return(worst);
 }
 
-static void sa_soundscape_free( sa_soundscape_t *scape) {
+void sa_soundscape_free( sa_soundscape_t *scape) {
 
     for (int i=0;i<scape->n_splays;i++) {
         if (scape->splays[i]) {
@@ -468,60 +563,69 @@ static void sa_soundscape_free( sa_soundscape_t *scape) {
 
 
 /*
-** timer - this is called frequently, and where we decide to start and stop effects.
-** or loop them because they were completed or whatnot.
+** status - what GET /status reports. Rebuilt on the mainloop at most once per
+** iteration, however many things changed, and only when something did.
 */
 
-static struct timeval g_start_time;
-static bool g_started = false;
+uint64_t sa_state_version(void) {
+    return(g_state_version);
+}
 
-/* pa_time_event_cb_t */
-static void
-sa_timer(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
-{
-	if (g_verbose) fprintf(stderr, "time event called: sec %d usec %d\n",tv->tv_sec, tv->tv_usec);
+void sa_state_changed(void) {
+    g_state_version++;
+    if (g_status_timer.heap_idx < 0)
+        sa_timer_schedule(&g_status_timer, 0);
+}
 
-	// FIRST TIME AFTER CONTEXT IS CONNECTED
-	if ( (g_started == false) && (g_context_connected == true)) {
+static void sa_status_timer_fn(sa_timer_t *t, void *userdata) {
 
-		if (g_verbose) fprintf(stderr, "first time started\n");
+    json_t *js = json_object();
 
-        // this will call the sinks to populate, and when that's done, call the
-        // next function
-        sa_sinks_populate(g_context, sa_soundscape_start);
+    json_object_set_new(js, "version", json_integer(g_state_version));
+    json_object_set_new(js, "started", json_boolean(g_started));
+    json_object_set_new(js, "directory", json_string(g_directory ? g_directory : ""));
 
-		// Create a player for each file
-		sa_soundscape_t *scape;
-		scape = sa_soundscape_new( g_filename1 );
-		if (scape == NULL) {
-            fprintf(stderr, "scape file1 failed\n");
-            goto ABORT;
-		}
-		g_scape1 = scape; // for freeing only
+    json_t *js_sinks = json_array();
+    for (int i = 0; i < MAX_SA_SINKS; i++) {
+        if (!g_sa_sinks[i].active) continue;
+        json_t *js_sink = json_object();
+        json_object_set_new(js_sink, "slot", json_integer(i));
+        json_object_set_new(js_sink, "index", json_integer(g_sa_sinks[i].index));
+        json_object_set_new(js_sink, "dev", json_string(g_sa_sinks[i].dev));
+        json_array_append_new(js_sinks, js_sink);
+    }
+    json_object_set_new(js, "sinks", js_sinks);
 
-		scape = sa_soundscape_new( g_filename2 );
-		if (scape == NULL) {
-			fprintf(stderr, "scape file2 failed\n");
-	       goto ABORT;
-		}
-		g_scape2 = scape; // for freeing only
+    json_object_set_new(js, "scene", sa_scene_status());
 
+    char *json = json_dumps(js, JSON_COMPACT);
+    json_decref(js);
+    if (json) sa_http_status_publish(json, g_state_version);
+}
 
-		g_started = true;
-	}
-	else {
-        sa_soundscape_timer(g_scape1);
-        sa_soundscape_timer(g_scape2);
-	}
+/*
+** startup. Nothing polls: the start timer is kicked when the context comes up,
+** and voices loop inside the mix.
+*/
+
+static void
+sa_start_timer_fn(sa_timer_t *t, void *userdata)
+{
+    if (g_started) return;
 
-	// put the things you want to happen in here
-ABORT:	;
+    if (g_verbose) fprintf(stderr, "first time started\n");
 
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	pa_timeval_add(&now, TIME_EVENT_USEC);
-	a->time_restart(e,&now);
-} 
+    // find the sinks, and once they're all known start the startup part
+    // of the scene; anything not loaded yet starts as soon as it is
+    sa_sinks_populate(g_context, sa_scene_startup);
+
+    g_started = true;
+    sa_state_changed();
+}
+
+int64_t sa_first_sound_ms(void) {
+    return(atomic_load(&g_first_sound_ms));
+}
 
 //
 // This populates the static structures with teh indexes. It does not start with 0 and 1,
@@ -531,10 +635,17 @@ ABORT:	;
 
 static void sa_sink_list_cb(pa_context *c, const pa_sink_info *info, int eol, void *userdata) {
 
-    if (eol) return;
-
     callback_fn_t next_fn = (callback_fn_t) userdata;
 
+    // called once per sink, then once more with eol set
+    if (eol) {
+        for (int i = 0; i < MAX_SA_SINKS; i++) {
+            if (g_sa_sinks[i].active) sa_bus_start(i);
+        }
+        if (next_fn) next_fn();
+        return;
+    }
+
     if (g_verbose) fprintf(stderr, "sink list callback:\n");
 
     // find next inactive sink, set it
@@ -545,6 +656,7 @@ static void sa_sink_list_cb(pa_context *c, const pa_sink_info *info, int eol, vo
             g_sa_sinks[i].index = info->index;
             g_sa_sinks[i].dev = strdup(info->name);
             if (g_verbose) fprintf(stderr,"popuated index %d with idx %d dev %s\n",i,info->index,info->name);
+            sa_state_changed();
             break;
         }
     }
@@ -552,18 +664,25 @@ static void sa_sink_list_cb(pa_context *c, const pa_sink_info *info, int eol, vo
         fprintf(stderr," WARNING: large number of sinks ( more than MAX_SINKS ), some ignored\n");
     }
 
-    if (next_fn) {
-        next_fn();
-    }
-
     return;
 
 }
 
+// how many voices a soundscape started now would take
+int sa_sinks_active(void) {
+    int n = 0;
+    for (int i=0;i<MAX_SA_SINKS;i++) {
+        if (g_sa_sinks[i].active) n++;
+    }
+    return(n);
+}
+
 void sa_sinks_populate( pa_context *c, callback_fn_t next_fn ) {
 
-    // cleanup array
+    // cleanup array; whatever was playing should have been stopped first
     for (int i=0;i<MAX_SA_SINKS;i++) {
+        sa_bus_stop(i);
+        g_sa_sinks[i].voices = NULL;
         if (g_sa_sinks[i].active && g_sa_sinks[i].dev) {
             free(g_sa_sinks[i].dev);
             g_sa_sinks[i].dev = 0;
@@ -593,7 +712,7 @@ static bool config_load(const char *filename) {
         return(false);
     }
 
-    json_auto_t *js_dir = json_object_get(js_root, "directory");
+    json_t *js_dir = json_object_get(js_root, "directory");
     if (!js_dir) {
         fprintf(stderr, "dirctory not found, using null string");
         g_directory = strdup("");
@@ -606,6 +725,80 @@ static bool config_load(const char *filename) {
             g_directory = strdup(dir_s);
     }
 
+    json_t *js_meter = json_object_get(js_root, "meter_hz");
+    if (js_meter) {
+        int hz = (int) json_integer_value(js_meter);
+        if (hz < 1 || hz > 100) {
+            fprintf(stderr, "meter_hz %d out of range 1..100, using %d\n", hz, SA_METER_HZ_DEFAULT);
+            hz = SA_METER_HZ_DEFAULT;
+        }
+        g_meter_hz = hz;
+    }
+
+    json_t *js_threads = json_object_get(js_root, "http_threads");
+    if (js_threads) {
+        int n = (int) json_integer_value(js_threads);
+        if (n < 1 || n > 64) {
+            fprintf(stderr, "http_threads %d out of range 1..64, using %d\n", n, SA_HTTP_THREADS_DEFAULT);
+            n = SA_HTTP_THREADS_DEFAULT;
+        }
+        g_http_threads = n;
+    }
+
+    json_t *js_keepalive = json_object_get(js_root, "http_keepalive_sec");
+    if (js_keepalive) {
+        int sec = (int) json_integer_value(js_keepalive);
+        if (sec < 1 || sec > 3600) {
+            fprintf(stderr, "http_keepalive_sec %d out of range 1..3600, using %d\n", sec, SA_HTTP_KEEPALIVE_DEFAULT);
+            sec = SA_HTTP_KEEPALIVE_DEFAULT;
+        }
+        g_http_keepalive_sec = sec;
+    }
+
+    // asset analysis, see analyze.c
+    json_t *js_silence = json_object_get(js_root, "silence_db");
+    if (js_silence) g_silence_db = (float) json_number_value(js_silence);
+
+    json_t *js_target = json_object_get(js_root, "loudness_target_db");
+    if (js_target) g_loudness_target_db = (float) json_number_value(js_target);
+
+    json_t *js_normalize = json_object_get(js_root, "normalize");
+    if (js_normalize) g_normalize = json_is_true(js_normalize);
+
+    json_t *js_rate = json_object_get(js_root, "mix_rate");
+    if (js_rate) {
+        int rate = (int) json_integer_value(js_rate);
+        if (rate < 8000 || rate > 192000) {
+            fprintf(stderr, "mix_rate %d out of range 8000..192000, using %d\n", rate, SA_MIX_RATE_DEFAULT);
+            rate = SA_MIX_RATE_DEFAULT;
+        }
+        g_mix_rate = rate;
+    }
+
+    json_t *js_idle = json_object_get(js_root, "idle_cork_ms");
+    if (js_idle) g_idle_cork_ms = (int) json_integer_value(js_idle);
+
+    // only ever turns it on, so --trace isn't undone by the config
+    json_t *js_trace = json_object_get(js_root, "trace");
+    if (json_is_true(js_trace)) atomic_store(&g_trace_enabled, true);
+
+    // only used with --soak, see soak.c
+    json_t *js_soak = json_object_get(js_root, "soak");
+    if (js_soak) {
+        json_t *js;
+        if ((js = json_object_get(js_soak, "triggers_per_sec"))) g_soak.triggers_per_sec = (float) json_number_value(js);
+        if ((js = json_object_get(js_soak, "reload_sec"))) g_soak.reload_sec = (int) json_integer_value(js);
+        if ((js = json_object_get(js_soak, "sample_sec"))) g_soak.sample_sec = (int) json_integer_value(js);
+        if ((js = json_object_get(js_soak, "warmup_sec"))) g_soak.warmup_sec = (int) json_integer_value(js);
+        if ((js = json_object_get(js_soak, "rss_growth_kb"))) g_soak.rss_growth_kb = (long) json_integer_value(js);
+        if ((js = json_object_get(js_soak, "heap_growth_kb"))) g_soak.heap_growth_kb = (long) json_integer_value(js);
+        if ((js = json_object_get(js_soak, "fd_growth"))) g_soak.fd_growth = (int) json_integer_value(js);
+    }
+
+    if (!sa_scene_load(js_root)) {
+        return(false);
+    }
+
     if (g_verbose) fprintf(stderr, "json file loaded successfully\n");
     return(true);
 
@@ -615,6 +808,20 @@ quit:
 }
 
 
+// Only the scene changes; the directory, the mix rate, speaker reverbs, the HTTP
+// server and the rest are as they were at boot. Mainloop.
+static bool config_reload(const char *filename) {
+
+    json_error_t js_err;
+    json_auto_t *js_root = json_load_file(filename, JSON_DECODE_ANY | JSON_DISABLE_EOF_CHECK, &js_err);
+    if (js_root == NULL) {
+        fprintf(stderr, "reload: JSON config parse failed on %s at (%d,%d) %s, nothing changed\n",
+            filename, js_err.line, js_err.column, js_err.text);
+        return(false);
+    }
+    return(sa_scene_reload(js_root));
+}
+
 static void help(const char *argv0) {
 
     printf("%s [options] [FILE]\n\n"
@@ -625,7 +832,9 @@ static void help(const char *argv0) {
            "  -n, --client-name=NAME                How to call this client on the server\n"
            "      --stream-name=NAME                How to call this stream on the server\n"
            "      --volume=VOLUME                   Specify the initial (linear) volume in range 0...65536\n"
-             "      --channel-map=CHANNELMAP          Set the channel map to the use\n",
+             "      --channel-map=CHANNELMAP          Set the channel map to the use\n"
+           "      --soak=HOURS                      Drive the scene hard for HOURS and check for leaks\n"
+           "      --trace                           Record trace events, for GET /trace and SIGUSR1\n",
            argv0);
 }
 
@@ -633,7 +842,9 @@ enum {
     ARG_VERSION = 256,
     ARG_STREAM_NAME,
     ARG_VOLUME,
-    ARG_CHANNELMAP
+    ARG_CHANNELMAP,
+    ARG_SOAK,
+    ARG_TRACE
 };
 
 int main(int argc, char *argv[]) {
@@ -643,8 +854,6 @@ int main(int argc, char *argv[]) {
 	char *server = NULL;
 	char *stream_name = NULL;
 
-    SF_INFO sfinfo;
-
     static const struct option long_options[] = {
 		{"server",			1, NULL, 's'},
         {"client-name", 1, NULL, 'n'},
@@ -654,9 +863,16 @@ int main(int argc, char *argv[]) {
         {"verbose",     0, NULL, 'v'},
         {"volume",      1, NULL, ARG_VOLUME},
         {"channel-map", 1, NULL, ARG_CHANNELMAP},
+        {"soak",        1, NULL, ARG_SOAK},
+        {"trace",       0, NULL, ARG_TRACE},
         {NULL,          0, NULL, 0}
     };
 
+    g_boot_usec = sa_timer_now();
+
+    sa_trace_init();
+    sa_trace_thread_name("mainloop");
+
     if (!(bn = strrchr(argv[0], '/')))
         bn = argv[0];
     else
@@ -704,6 +920,18 @@ int main(int argc, char *argv[]) {
                 g_channel_map_set = true;
                 break;
 
+            case ARG_SOAK:
+                g_soak.hours = (float) atof(optarg);
+                if (g_soak.hours <= 0) {
+                    fprintf(stderr, "Invalid soak hours\n");
+                    goto quit;
+                }
+                break;
+
+            case ARG_TRACE:
+                atomic_store(&g_trace_enabled, true);
+                break;
+
             default:
                 goto quit;
         }
@@ -738,9 +966,37 @@ int main(int argc, char *argv[]) {
 
     g_mainloop_api = pa_mainloop_get_api(m);
 
+    if (!sa_timer_init(g_mainloop_api)) {
+        goto quit;
+    }
+    sa_timer_setup(&g_start_timer, sa_start_timer_fn, NULL);
+    // levels are published only while a /levels client is connected
+    if (!sa_levels_init(g_mainloop_api)) {
+        goto quit;
+    }
+    if (!sa_scene_init(g_mainloop_api)) {
+        goto quit;
+    }
+
+    // the reverbs' workers wait for their impulse responses from the cache
+    if (!sa_reverb_start()) {
+        goto quit;
+    }
+
+    // start decoding now, it overlaps with connecting to the server
+    if (!sa_cache_init(g_mainloop_api, g_boot_usec, sa_scene_sample_ready)) {
+        goto quit;
+    }
+    sa_scene_prefetch();
+
+    sa_timer_setup(&g_status_timer, sa_status_timer_fn, NULL);
+    sa_state_changed(); // so /status has something before the context is up
+
     r = pa_signal_init(g_mainloop_api);
     assert(r == 0);
     pa_signal_new(SIGINT, exit_signal_callback, NULL);
+    pa_signal_new(SIGUSR1, trace_signal_callback, NULL);
+    pa_signal_new(SIGHUP, reload_signal_callback, NULL);
 #ifdef SIGPIPE
     signal(SIGPIPE, SIG_IGN);
 #endif
@@ -769,14 +1025,10 @@ int main(int argc, char *argv[]) {
 		fprintf(stderr, "about to run mainloop\n");	
 	}
 
-	/* set up our timer */
-	struct timeval now;
-	gettimeofday(&now, NULL);
-	pa_timeval_add(&now, TIME_EVENT_USEC);	
-	g_timer = (* g_mainloop_api->time_new) (g_mainloop_api, &now, sa_timer, NULL);
-	if (g_timer == NULL) {
-		fprintf(stderr, "time_new failed!!!\n");
-	}
+    // it goes through the scene pipe and signals, so everything those need is up
+    if (g_soak.hours > 0 && !sa_soak_start(&g_soak)) {
+        goto quit;
+    }
 
 
     /* Run the main loop - hangs here forever? */
@@ -790,20 +1042,35 @@ quit:
 		fprintf(stderr, "quitting and cleaning up\n");	
 	}
 
+    // it submits to the scene, so it goes first; a failed soak is a failed run
+    if (!sa_soak_done()) ret = 1;
+
     sa_http_terminate();
 
+    sa_scene_done();
+
+    for (int i = 0; i < MAX_SA_SINKS; i++) sa_bus_stop(i);
+    sa_reverb_done();
+
+    // after the scene, nothing is playing from the cache any more
+    sa_cache_done();
+
     if (g_context)
         pa_context_unref(g_context);
 
     if (g_directory)
         free(g_directory);
 
+    sa_levels_done();
+    sa_timer_done();
+
+    // every other thread is gone by now
+    sa_trace_done();
+
     if (m) {
         pa_signal_done();
         pa_mainloop_free(m);
     }
-	if (g_scape1) { sa_soundscape_free(g_scape1); g_scape1 = NULL; }
-    if (g_scape2) { sa_soundscape_free(g_scape2); g_scape2 = NULL; }	
 
     pa_xfree(server);
     pa_xfree(g_device);
@@ -25,6 +25,7 @@ SOFTWARE.
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 // external library which understands different formats
 #include <sndfile.h>
@@ -33,24 +34,257 @@ SOFTWARE.
 
 #define MAX_SA_SINKS 6 // having 6 sound inputs seems very reasonable
 
+#define MAX_SA_METER_VOICES 32 // voices beyond this still play, they just aren't metered
+#define SA_LEVEL_NAME_MAX 48
+#define SA_METER_HZ_DEFAULT 10
+
+#define SA_HTTP_THREADS_DEFAULT 4     // one per core on a Pi 3
+#define SA_HTTP_KEEPALIVE_DEFAULT 30  // seconds an idle connection is kept
+#define SA_SILENCE_DB_DEFAULT -60.0f
+#define SA_LOUDNESS_TARGET_DB_DEFAULT -20.0f
+
+#define SA_TRACE_EVENTS 8192      // per thread, a power of two; about 256K each
+#define SA_TRACE_MAX_THREADS 32
+
+// running peak and sum of squares, only touched by the audio thread
+typedef struct sa_meter {
+    float peak;     // 0 .. 1 full scale
+    double sumsq;   // sum of squared samples, full scale 1
+    uint64_t n;     // samples summed
+} sa_meter_t;
+
+typedef struct sa_level {
+    float peak;
+    float rms;
+} sa_level_t;
+
+// what gets published to readers, copied out whole under the seqlock
+typedef struct sa_levels_snapshot {
+    uint64_t publish_count;
+    uint64_t timestamp_usec;
+    sa_level_t sinks[MAX_SA_SINKS];
+    int n_voices;
+    struct {
+        char name[SA_LEVEL_NAME_MAX];
+        int sink;
+        sa_level_t level;
+    } voices[MAX_SA_METER_VOICES];
+} sa_levels_snapshot_t;
+
+// timers, see timer.c. Embed one wherever something needs to happen later.
+struct sa_timer;
+typedef void (*sa_timer_fn_t)(struct sa_timer *t, void *userdata);
+
+typedef struct sa_timer {
+    pa_usec_t when;     // absolute, CLOCK_MONOTONIC, see sa_timer_now
+    int heap_idx;       // -1 when not pending
+    sa_timer_fn_t fn;
+    void *userdata;
+} sa_timer_t;
+
+typedef struct sa_timer_stats {
+    uint64_t wakeups;       // times the mainloop woke for us
+    uint64_t fired;         // callbacks run; more than wakeups when deadlines coalesce
+    double wakeups_per_sec; // over the last window of about a second
+    int pending;
+} sa_timer_stats_t;
+
+// one entry in a trace ring, see trace.c
+typedef struct sa_trace_event {
+    uint64_t ts_ns;     // CLOCK_MONOTONIC
+    const char *name;   // a literal, only the pointer is kept
+    int64_t arg;
+    char ph;            // Chrome trace phase: B, E, i ( instant ), C ( counter )
+} sa_trace_event_t;
+
+// a whole file decoded into memory, see cache.c
+typedef enum {
+    SA_SAMPLE_QUEUED,
+    SA_SAMPLE_LOADING,
+    SA_SAMPLE_READY,
+    SA_SAMPLE_FAILED
+} sa_sample_state_t;
+
+// what analyze.c found in a file. Frame counts are of the whole decoded file.
+typedef struct sa_analysis {
+    sf_count_t frames;
+    sf_count_t start, end;  // the part worth keeping, [start, end)
+    float peak_db;          // dBFS, -INFINITY if silent
+    float loudness_db;      // gated RMS in dBFS, -INFINITY if silent
+} sa_analysis_t;
+
+typedef struct sa_sample {
+    char *path;
+    char *title;            // from the file's metadata, NULL if none
+    _Atomic int state;      // sa_sample_state_t; data is valid once this reads READY
+    int priority;           // lower loads first
+    pa_sample_spec spec;    // S16NE or FLOAT32NE, 1 or 2 channels, at g_mix_rate
+    sf_count_t frames;
+    size_t bytes;
+    void *data;             // frames, plus a copy of frame 0 after them to interpolate across the loop
+    pa_usec_t load_usec;    // how long the decode took
+    sa_analysis_t analysis;
+    bool from_sidecar;      // analysis came from the sidecar, not this boot
+    float norm_gain;        // already applied to data
+    size_t trimmed_bytes;   // silence the analysis cut, as decoded
+    struct sa_sample *next;         // all samples
+    struct sa_sample *queue_next;   // load queue
+} sa_sample_t;
+
+typedef struct sa_cache_stats {
+    int requested;
+    int ready;
+    int failed;
+    uint64_t bytes;
+    uint64_t trimmed_bytes;     // silence not kept
+    int analyzed;               // had no usable sidecar, so were analyzed this boot
+    int64_t fully_loaded_ms;    // since boot, -1 until everything requested is in
+} sa_cache_stats_t;
+
+typedef struct sa_voice_stats {
+    int active;                 // voices counted against the caps, fading ones aren't
+    int max;
+    uint64_t stolen;            // released early to make room
+    uint64_t refused;           // wanted to start but there was no room
+} sa_voice_stats_t;
+
+typedef void (*sa_cache_ready_fn_t)(sa_sample_t *sample);
+
+// the mix, see mix.c. The bus is always stereo at g_mix_rate; what it's made of
+// depends on the build.
+#define SA_IDLE_CORK_MS_DEFAULT 2000
+
+#define SA_MIX_CHANNELS 2
+#define SA_MIX_RATE_DEFAULT 48000
+#define SA_MIX_BLOCK_FRAMES 256   // mixed at a time, small enough to stay in L1
+#define SA_BUS_TLENGTH_MS 50      // a bus stream's buffer, the most one write callback asks for
+#define SA_BUS_MINREQ_MS 10       // and the least
+
+#ifdef SA_FIXED_POINT
+typedef int32_t sa_mix_acc_t;     // Q15 samples, headroom above for the sum
+typedef int32_t sa_mix_gain_t;    // Q30, 1 << 30 is unity
+typedef int64_t sa_mix_sumsq_t;
+typedef int16_t sa_mix_out_t;
+#define SA_MIX_FORMAT PA_SAMPLE_S16NE
+#else
+typedef float sa_mix_acc_t;
+typedef float sa_mix_gain_t;
+typedef float sa_mix_sumsq_t;     // per call, a few hundred frames at most
+typedef float sa_mix_out_t;
+#define SA_MIX_FORMAT PA_SAMPLE_FLOAT32NE
+#endif
+
+#define SA_MIX_RATE_UNITY (1ULL << 32)   // playback rates are 32.32 fixed point
+#define SA_MIX_RATE_MIN 0.5f
+#define SA_MIX_RATE_MAX 2.0f
+
+// what a kernel carries from one call to the next
+typedef struct sa_mix_run {
+    sa_mix_gain_t gain;
+    sa_mix_gain_t step;     // per frame, 0 unless ramping
+    sa_mix_acc_t peak;
+    sa_mix_sumsq_t sumsq;
+    uint64_t phase;         // varispeed only: frames into src, 32.32
+    uint64_t rate;          // varispeed only: phase per output frame
+} sa_mix_run_t;
+
+typedef void (*sa_mix_kernel_t)(sa_mix_acc_t *restrict acc, const void *restrict src, size_t frames, sa_mix_run_t *run);
+
+// per speaker protection after the mix, see dsp.c. Filled in from the
+// speaker's "dsp" in the config.
+#define SA_DSP_MAX_BIQUADS 6
+#define SA_DSP_MAX_LOOKAHEAD_MS 10
+#define SA_DSP_MAX_GAIN_DB 18
+#define SA_DSP_MAX_Q 20
+
+typedef enum {
+    SA_BIQUAD_HIGHPASS,
+    SA_BIQUAD_LOWPASS,
+    SA_BIQUAD_PEAKING,
+    SA_BIQUAD_LOWSHELF,
+    SA_BIQUAD_HIGHSHELF
+} sa_biquad_type_t;
+
+typedef struct sa_biquad_config {
+    sa_biquad_type_t type;
+    float freq;
+    float q;
+    float gain_db;          // peaking and shelves
+} sa_biquad_config_t;
+
+typedef struct sa_dsp_config {
+    int n_biquads;
+    sa_biquad_config_t biquads[SA_DSP_MAX_BIQUADS];
+    bool limiter;
+    float threshold_db;
+    float lookahead_ms;
+    float release_ms;
+} sa_dsp_config_t;
+
+// granular voices, see grain.c
+#define SA_GRAINS_MAX 32      // per voice, the most that can overlap
+
+typedef struct sa_grain_config {
+    float grain_ms_lo, grain_ms_hi;
+    float density;          // grains per second, on average
+    float pos_lo, pos_hi;   // where in the source grains start, 0 to 1
+} sa_grain_config_t;
+
+typedef struct sa_grains sa_grains_t;
+
+// send reverbs shared by a group of speakers, see reverb.c
+#define SA_REVERB_MAX 4
+#define SA_REVERB_PARTITION_DEFAULT 256
+#define SA_REVERB_MAX_IR_SEC 10
+
+typedef struct sa_reverb_config {
+    char *name;
+    uint32_t sinks;         // a bit per sink slot in the group
+    float return_db;        // of the wet, into each of the group's buses
+    int partition;          // frames, a power of 2
+    float latency_ms;       // the worker's budget, at least a partition
+} sa_reverb_config_t;
+
+typedef struct sa_reverb_stats {
+    const char *name;
+    bool ready;             // the IR's loaded and transformed
+    int ir_ms;
+    uint64_t blocks;        // partitions convolved, all sinks
+    uint64_t late_frames;   // the mix went without, the worker was behind
+    uint64_t dropped_frames;    // sends that didn't fit, the worker was hopelessly behind
+    float load;             // of realtime, per sink
+} sa_reverb_stats_t;
+
+typedef struct sa_conv_ir sa_conv_ir_t;
+typedef struct sa_conv sa_conv_t;
+
+// one voice: a cached sample playing on one sink's bus
 typedef struct sa_soundplay {
 
-	pa_stream *stream; // gets reset to NULL when file is over
-
-	char *stream_name;
-	char *filename;
-    char *dev; // device
+	char *name;             // for the meters, free with pa_xfree()
+    sa_sample_t *sample;    // shared, owned by the cache
+    sa_mix_kernel_t kernel; // picked once for the sample's format
+    sf_count_t pos;         // next frame to mix
+    int sink;               // index in g_sa_sinks
+    bool playing;           // on its sink's bus
+    struct sa_soundplay *next;  // on the bus
 
 	int verbose;
 
-	pa_volume_t volume;
+    sa_meter_t meter;
+    int meter_slot; // -1 if not metered
+    float level;    // mean square of what it's mixed lately, smoothed; for stealing the quietest
+
+    sa_mix_gain_t gain;     // software gain applied as it's mixed
+    sa_mix_gain_t gain_target;
+    sa_mix_gain_t gain_step;    // per frame, while ramping
+    uint32_t ramp_frames;   // frames left in the ramp
 
-  SNDFILE* sndfile;
-  pa_sample_spec sample_spec; // is this valid c?  
-  pa_channel_map channel_map;
-  bool channel_map_set;
+    uint64_t rate;          // SA_MIX_RATE_UNITY plays as recorded
+    uint32_t frac;          // how far past pos, in 1/2^32 of a frame
 
-	sf_count_t (*readf_function)(SNDFILE *_sndfile, void *ptr, sf_count_t frames);
+    sa_grains_t *grains;    // a granular voice, NULL if it just plays the sample
+    sa_mix_gain_t send;     // to the sink's reverb, if it has one
 } sa_soundplay_t;
 
 
@@ -59,9 +293,25 @@ typedef struct sa_sink {
     char *dev; // also known as "name" in some interfaces, malloc'd
                 // have to pass this to pa_stream_connect_playback
     int index;
+    pa_stream *stream;          // the bus, everything on this sink is mixed into it
+    sa_soundplay_t *voices;     // playing on it, mainloop only
+
+    // corked when nothing's played for g_idle_cork_ms; the times are read by /metrics
+    sa_timer_t idle_timer;
+    _Atomic bool corked;
+    _Atomic pa_usec_t since;        // the last cork or uncork
+    _Atomic uint64_t active_usec;   // uncorked, up to since
+    _Atomic uint64_t idle_usec;     // corked, up to since
     // oh, I'm sure there are more things to map
 } sa_sink_t;
 
+typedef struct sa_sink_activity {
+    bool present;
+    bool corked;
+    uint64_t active_ms;
+    uint64_t idle_ms;
+} sa_sink_activity_t;
+
 // the scape plays on all speakers attached to this pi
 typedef struct sa_soundscape {
 
@@ -77,21 +327,160 @@ typedef struct sa_sound_ambient {
 
 } sa_sound_ambient_t;
 
+// saplay --soak, see soak.c; the thresholds come from "soak" in the config
+typedef struct sa_soak_config {
+    float hours;
+    float triggers_per_sec;
+    int reload_sec;         // 0 never
+    int sample_sec;
+    int warmup_sec;         // after the cache has everything, before the baseline
+    long rss_growth_kb;     // more than these over the run fails it
+    long heap_growth_kb;
+    int fd_growth;
+} sa_soak_config_t;
+
 // useful type, a void function returning void
 typedef void (*callback_fn_t) (void);
 
 /* Forward References */
 
 extern void sa_soundplay_start(sa_soundplay_t *);
+extern void sa_soundplay_stop(sa_soundplay_t *);
 extern void sa_soundplay_free(sa_soundplay_t *);
+extern void sa_soundplay_set_gain(sa_soundplay_t *, float target, uint32_t ramp_ms);
+extern void sa_soundplay_set_rate(sa_soundplay_t *, float rate);
 
-extern sa_soundscape_t *sa_soundscape_new(char *filename);
+extern sa_soundscape_t *sa_soundscape_new(sa_sample_t **samples, int n_samples);
+extern void sa_soundscape_stop(sa_soundscape_t *scape);
+extern void sa_soundscape_free(sa_soundscape_t *scape);
+extern pa_usec_t sa_soundscape_latency(sa_soundscape_t *scape);
 
 extern void sa_sinks_populate( pa_context *c, callback_fn_t next_fn );
+extern int sa_sinks_active(void);
+extern void sa_sink_activity(int sink, sa_sink_activity_t *a);
 
 extern bool sa_http_start(void); // false if fail
 extern void sa_http_terminate(void);
+extern void sa_http_status_publish(char *json, uint64_t version);
+
+extern void sa_state_changed(void); // anything that shows up in /status
+extern uint64_t sa_state_version(void);
+extern int64_t sa_first_sound_ms(void); // since boot, -1 until something has played
+
+/* scene.c */
+struct json_t;
+extern bool sa_scene_load(struct json_t *js_root);
+extern bool sa_scene_init(pa_mainloop_api *api);
+extern void sa_scene_done(void);
+extern struct json_t *sa_scene_status(void);
+extern char *sa_scene_submit(const char *body, size_t len, int *code);
+extern void sa_scene_prefetch(void);
+extern void sa_scene_startup(void);
+extern void sa_scene_sample_ready(sa_sample_t *sample);
+extern void sa_scene_voice_stats(sa_voice_stats_t *stats);
+extern bool sa_scene_reload(struct json_t *js_root);
+extern int sa_scene_targets(char ***targets);
+
+/* cache.c */
+extern bool sa_cache_init(pa_mainloop_api *api, pa_usec_t boot_usec, sa_cache_ready_fn_t ready_fn);
+extern sa_sample_t *sa_cache_request(const char *path, int priority);
+extern void sa_cache_done(void);
+extern void sa_cache_stats(sa_cache_stats_t *stats);
+
+/* analyze.c */
+extern void sa_analyze(const pa_sample_spec *spec, const void *data, sf_count_t frames, sa_analysis_t *a);
+extern float sa_analysis_gain(const sa_analysis_t *a);
+extern bool sa_analysis_load(const char *path, const SF_INFO *sfinfo, pa_sample_format_t format, sa_analysis_t *a);
+extern void sa_analysis_save(const char *path, const SF_INFO *sfinfo, pa_sample_format_t format, const sa_analysis_t *a);
+
+/* timer.c */
+extern bool sa_timer_init(pa_mainloop_api *api);
+extern void sa_timer_done(void);
+extern void sa_timer_setup(sa_timer_t *t, sa_timer_fn_t fn, void *userdata);
+extern void sa_timer_schedule(sa_timer_t *t, pa_usec_t delay_usec);
+extern void sa_timer_schedule_at(sa_timer_t *t, pa_usec_t when);
+extern void sa_timer_cancel(sa_timer_t *t);
+extern pa_usec_t sa_timer_now(void);
+extern void sa_timer_stats(sa_timer_stats_t *stats);
+
+/* mix.c */
+extern sa_mix_kernel_t sa_mix_kernel(const pa_sample_spec *spec, bool varispeed);
+extern sa_mix_gain_t sa_mix_gain(float g);
+extern int sa_mix_bus(sa_soundplay_t *voices, sa_mix_out_t *out, size_t frames, int sink);
+extern int g_mix_rate;
+
+/* grain.c */
+extern sa_grains_t *sa_grains_new(const sa_grain_config_t *cfg, uint32_t seed);
+extern void sa_grains_free(sa_grains_t *g);
+extern void sa_grains_render(sa_grains_t *g, const sa_sample_t *s, sa_mix_acc_t *out, size_t frames);
+
+/* dsp.c */
+extern const char *g_biquad_names[];
+extern bool sa_dsp_check(int sink, const sa_dsp_config_t *cfg);
+extern bool sa_dsp_setup(int sink, const sa_dsp_config_t *cfg);
+extern void sa_dsp_reset(int sink);
+extern void sa_dsp_process(int sink, sa_mix_acc_t *acc, size_t frames);
+extern bool sa_dsp_active(int sink);
+
+/* reverb.c */
+extern int sa_reverb_add(const sa_reverb_config_t *cfg);
+extern bool sa_reverb_start(void);
+extern void sa_reverb_done(void);
+extern void sa_reverb_set_ir(int r, sa_sample_t *sample);
+extern bool sa_reverb_active(int sink);
+extern pa_usec_t sa_reverb_tail(int sink);
+extern void sa_reverb_send(int sink, const sa_mix_acc_t *send, sa_mix_acc_t *acc, size_t frames);
+extern int sa_reverb_stats(sa_reverb_stats_t *stats, int max);
+extern sa_conv_ir_t *sa_conv_ir_new(const sa_sample_t *ir, int partition);
+extern void sa_conv_ir_free(sa_conv_ir_t *ir);
+extern sa_conv_t *sa_conv_new(const sa_conv_ir_t *ir);
+extern void sa_conv_free(sa_conv_t *c);
+extern void sa_conv_process(sa_conv_t *c, const float *in, float *out);
+
+/* soak.c */
+extern bool sa_soak_start(const sa_soak_config_t *cfg);
+extern bool sa_soak_done(void);
+
+/* trace.c */
+extern _Atomic bool g_trace_enabled;
+extern void sa_trace_init(void);
+extern void sa_trace_done(void);
+extern void sa_trace_event(const char *name, char ph, int64_t arg);
+extern void sa_trace_thread_name(const char *name);
+extern char *sa_trace_dump(size_t *len);
+extern bool sa_trace_dump_file(const char *path);
+extern bool sa_trace_dump_file_async(const char *path);
+
+#define SA_TRACE(name, ph, arg) do { \
+    if (atomic_load_explicit(&g_trace_enabled, memory_order_relaxed)) sa_trace_event(name, ph, arg); \
+} while (0)
+#define SA_TRACE_BEGIN(name, arg) SA_TRACE(name, 'B', arg)
+#define SA_TRACE_END(name, arg) SA_TRACE(name, 'E', arg)
+#define SA_TRACE_INSTANT(name, arg) SA_TRACE(name, 'i', arg)
+#define SA_TRACE_COUNTER(name, value) SA_TRACE(name, 'C', value)
+
+/* levels.c */
+extern void sa_meter_s16(sa_meter_t *m, const int16_t *samples, size_t n);
+extern void sa_meter_float(sa_meter_t *m, const float *samples, size_t n);
+extern void sa_meter_fold(sa_meter_t *dst, const sa_meter_t *src);
+extern void sa_meter_sink_fold(int sink, const sa_meter_t *block);
+extern int sa_levels_voice_add(sa_meter_t *meter, const char *name, int sink);
+extern void sa_levels_voice_remove(int slot);
+extern void sa_levels_publish(void);
+extern bool sa_levels_init(pa_mainloop_api *api);
+extern void sa_levels_done(void);
+extern void sa_levels_listen(bool on);
+extern void sa_levels_read(sa_levels_snapshot_t *out);
+extern size_t sa_levels_format(const sa_levels_snapshot_t *l, char *buf, size_t sz);
 
 extern int g_verbose;
+extern char *g_directory;
+extern int g_meter_hz; // level publish rate, also the SSE rate
+extern int g_http_threads;
+extern int g_http_keepalive_sec;
+extern float g_silence_db;          // below this is silence, for trimming
+extern float g_loudness_target_db;  // where normalization puts everything
+extern bool g_normalize;
+extern int g_idle_cork_ms;          // a sink with nothing playing this long is corked, 0 never
 
 #endif // _SAPLAY_H_
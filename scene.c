@@ -0,0 +1,1237 @@
+/***
+  SerenityAudio
+
+  The scene: the ambients, soundscapes and speakers from config.json, what's
+  playing and how loud. The show controller changes it in batches ( POST /scene )
+  so a "mood" change lands all at once instead of half applied.
+
+  A batch is parsed and validated completely on the HTTP thread against the
+  names loaded from config. Only a fully valid batch is handed to the mainloop,
+  through a pipe, and the mainloop applies every op in the same callback - so
+  every stream picks up the change at its next write. The HTTP thread waits for
+  that and answers once.
+
+  SIGHUP reloads the entries from the config file. Everything playing stops,
+  the new entries load, and what they say plays at boot starts again. The
+  names are only changed with g_entries_lock held for writing, and a batch
+  validated against the old entries is dropped, not applied to the new ones.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <jansson.h>
+
+#include "saplay.h"
+
+#define SA_SCENE_MAX_ENTRIES 64
+#define SA_SCENE_MAX_FILES 8
+#define SA_SCENE_MAX_OPS 64
+#define SA_SCENE_MAX_RAMP_MS 60000
+
+// polyphony. Voices are counted per sink, so a soundscape on four speakers is four.
+#define SA_VOICES_MAX_DEFAULT 32
+#define SA_VOICES_RELEASE_MS_DEFAULT 20
+#define SA_PRIORITY_PROTECTED 100   // never stolen
+#define SA_PRIORITY_DEFAULT 50
+
+// how long the HTTP thread waits for the mainloop to apply a batch
+#define SA_SCENE_APPLY_TIMEOUT_SEC 2
+
+typedef enum {
+    SA_SCENE_AMBIENT,
+    SA_SCENE_SOUNDSCAPE,
+    SA_SCENE_SPEAKER
+} sa_scene_kind_t;
+
+static const char *g_kind_names[] = { "ambients", "soundscapes", "speakers" };
+
+typedef enum {
+    SA_STEAL_LOWEST_PRIORITY,
+    SA_STEAL_OLDEST,
+    SA_STEAL_QUIETEST
+} sa_steal_policy_t;
+
+static const char *g_steal_names[] = { "lowest_priority", "oldest", "quietest" };
+
+// from "polyphony" in the config; a cap of 0 is no cap beyond max_voices
+typedef struct sa_polyphony {
+    int max_voices;
+    int kind_max[SA_SCENE_SPEAKER];
+    sa_steal_policy_t steal;
+    uint32_t release_ms;
+} sa_polyphony_t;
+
+static const sa_polyphony_t g_poly_default = { .max_voices = SA_VOICES_MAX_DEFAULT,
+    .steal = SA_STEAL_LOWEST_PRIORITY, .release_ms = SA_VOICES_RELEASE_MS_DEFAULT };
+static sa_polyphony_t g_poly = g_poly_default;
+
+// for the playback rate of each voice; only needs to not sound repetitive
+static uint32_t g_rand = 2463534242u;
+
+static float scene_rand(void) {
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 17;
+    g_rand ^= g_rand << 5;
+    return((g_rand >> 8) * (1.0f / 16777216.0f));
+}
+
+// for /metrics
+static _Atomic int g_voices_active = 0;
+static _Atomic uint64_t g_voices_stolen = 0;
+static _Atomic uint64_t g_voices_refused = 0;
+
+typedef struct sa_scene_entry {
+    sa_scene_kind_t kind;
+    char *name;
+    char *files[SA_SCENE_MAX_FILES]; // full paths, not used for speakers
+    int n_files;
+    bool startup;           // started at boot
+    int priority;           // 0..100, higher is kept longer; 100 is never stolen
+    float rate_lo, rate_hi; // each voice plays at a random rate in here, 1 is as recorded
+    bool granular;          // voices are grain clouds of the files, not the files
+    sa_grain_config_t grain_cfg;
+    float send;             // 0..1 to the reverb of whichever speaker a voice is on
+
+    // below here only touched by the mainloop
+    sa_sample_t *samples[SA_SCENE_MAX_FILES];
+    float volume;           // 0..1
+    sa_soundscape_t *scape; // NULL unless playing
+    sa_timer_t stop_timer;  // pending while fading out to a stop
+    bool pending_start;     // asked to start, waiting on the cache
+    uint32_t pending_ramp_ms;
+    pa_usec_t started_usec; // for stealing the oldest
+    pa_usec_t released_usec;    // when its fade out began
+    bool quick_release;     // fading over release_ms or less, so no longer counted
+} sa_scene_entry_t;
+
+static sa_scene_entry_t g_entries[SA_SCENE_MAX_ENTRIES];
+static int g_n_entries = 0;
+
+// a scene as read from the config, before it takes over from the one playing
+typedef struct sa_scene_parse {
+    sa_scene_entry_t entries[SA_SCENE_MAX_ENTRIES];
+    int n_entries;
+    sa_polyphony_t poly;
+    sa_dsp_config_t dsp[MAX_SA_SINKS];  // all zero for a speaker without "dsp"
+} sa_scene_parse_t;
+
+static sa_scene_parse_t g_parse;    // mainloop, or boot
+
+// the HTTP threads read names under this; a reload writes them, on the mainloop
+static pthread_rwlock_t g_entries_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t g_generation = 0;   // bumped by each reload, under the lock
+static bool g_started = false;      // sa_scene_startup has run, sinks are known
+
+// impulse responses, by reverb index; the cache loads them like any sample
+static struct {
+    char *file;
+    sa_sample_t *sample;
+} g_reverb_irs[SA_REVERB_MAX];
+static int g_n_reverb_irs = 0;
+
+typedef enum {
+    SA_OP_START,
+    SA_OP_STOP,
+    SA_OP_VOLUME
+} sa_scene_op_type_t;
+
+typedef struct sa_scene_op {
+    sa_scene_op_type_t type;
+    int entry;
+    float value;
+    uint32_t ramp_ms;
+} sa_scene_op_t;
+
+typedef struct sa_scene_batch {
+    _Atomic int refs;       // the HTTP thread and the mainloop
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    uint64_t version;       // state version after applying
+    uint32_t generation;    // of the entries it was checked against
+    int n_ops;
+    sa_scene_op_t ops[SA_SCENE_MAX_OPS];
+} sa_scene_batch_t;
+
+static void scene_stop_timer_fn(sa_timer_t *t, void *userdata);
+
+static int g_scene_pipe[2] = { -1, -1 };
+static pa_io_event *g_scene_io = NULL;
+static pa_mainloop_api *g_scene_api = NULL;
+
+/*
+** config
+*/
+
+static char *scene_path(const char *file) {
+
+    size_t len = strlen(g_directory) + strlen(file) + 2;
+    char *path = malloc(len);
+    if (file[0] == '/' || g_directory[0] == 0)
+        snprintf(path, len, "%s", file);
+    else
+        snprintf(path, len, "%s/%s", g_directory, file);
+    return(path);
+}
+
+// a speaker's "dsp": { "biquads": [ { "type", "freq", "q", "gain_db" } .. ],
+//   "limiter": { "threshold_db", "lookahead_ms", "release_ms" } }
+static bool scene_load_dsp(json_t *js_dsp, int sink, const char *name, sa_dsp_config_t *cfg) {
+
+    memset(cfg, 0, sizeof(sa_dsp_config_t));
+
+    json_t *js_bqs = json_object_get(js_dsp, "biquads");
+    if (js_bqs) {
+        size_t i;
+        json_t *js_bq;
+        if (!json_is_array(js_bqs) || json_array_size(js_bqs) > SA_DSP_MAX_BIQUADS) {
+            fprintf(stderr, "config: speaker %s biquads must be an array of at most %d\n", name, SA_DSP_MAX_BIQUADS);
+            return(false);
+        }
+        json_array_foreach(js_bqs, i, js_bq) {
+            sa_biquad_config_t *bq = &cfg->biquads[cfg->n_biquads++];
+            const char *type = json_string_value(json_object_get(js_bq, "type"));
+            int t;
+            for (t = 0; type && g_biquad_names[t]; t++) {
+                if (strcmp(type, g_biquad_names[t]) == 0) break;
+            }
+            if (!type || !g_biquad_names[t]) {
+                fprintf(stderr, "config: speaker %s biquad %zu: type must be highpass, lowpass, peaking, lowshelf or highshelf\n", name, i);
+                return(false);
+            }
+            bq->type = (sa_biquad_type_t) t;
+            bq->freq = (float) json_number_value(json_object_get(js_bq, "freq"));
+            json_t *js = json_object_get(js_bq, "q");
+            bq->q = js ? (float) json_number_value(js) : 0.7071f;
+            bq->gain_db = (float) json_number_value(json_object_get(js_bq, "gain_db"));
+        }
+    }
+
+    json_t *js_lim = json_object_get(js_dsp, "limiter");
+    if (js_lim) {
+        json_t *js;
+        cfg->limiter = true;
+        cfg->threshold_db = (js = json_object_get(js_lim, "threshold_db")) ? (float) json_number_value(js) : -1.0f;
+        cfg->lookahead_ms = (js = json_object_get(js_lim, "lookahead_ms")) ? (float) json_number_value(js) : 2.0f;
+        cfg->release_ms = (js = json_object_get(js_lim, "release_ms")) ? (float) json_number_value(js) : 50.0f;
+    }
+
+    if (!sa_dsp_check(sink, cfg)) {
+        fprintf(stderr, "config: speaker %s dsp not usable\n", name);
+        return(false);
+    }
+    if (g_verbose) fprintf(stderr, "scene: speaker %s dsp, %d biquads%s\n", name, cfg->n_biquads, cfg->limiter ? " and a limiter" : "");
+    return(true);
+}
+
+static bool scene_load_kind(json_t *js_root, sa_scene_kind_t kind, sa_scene_parse_t *p) {
+
+    json_t *js_arr = json_object_get(js_root, g_kind_names[kind]);
+    if (!js_arr) return(true);
+    if (!json_is_array(js_arr)) {
+        fprintf(stderr, "config: %s is not an array\n", g_kind_names[kind]);
+        return(false);
+    }
+
+    size_t i;
+    json_t *js_e;
+    int n_speakers = 0;
+    json_array_foreach(js_arr, i, js_e) {
+
+        const char *name = json_string_value(json_object_get(js_e, "name"));
+        if (!name) {
+            fprintf(stderr, "config: %s entry %zu has no name\n", g_kind_names[kind], i);
+            return(false);
+        }
+        if (p->n_entries == SA_SCENE_MAX_ENTRIES) {
+            fprintf(stderr, "config: more than %d scene entries, ignoring %s\n", SA_SCENE_MAX_ENTRIES, name);
+            return(true);
+        }
+
+        sa_scene_entry_t *e = &p->entries[p->n_entries];
+        memset(e, 0, sizeof(sa_scene_entry_t));
+        e->kind = kind;
+        e->name = strdup(name);
+        e->volume = 1.0f;
+
+        // the ambient bed stays unless the config says otherwise
+        e->priority = kind == SA_SCENE_AMBIENT ? SA_PRIORITY_PROTECTED : SA_PRIORITY_DEFAULT;
+        json_t *js_prio = json_object_get(js_e, "priority");
+        if (js_prio) {
+            e->priority = (int) json_integer_value(js_prio);
+            if (e->priority < 0 || e->priority > SA_PRIORITY_PROTECTED) {
+                fprintf(stderr, "config: %s %s priority must be 0..%d\n", g_kind_names[kind], name, SA_PRIORITY_PROTECTED);
+                free(e->name);
+                return(false);
+            }
+        }
+
+        // speakers are sink slots in order, see scene_speaker_volume
+        json_t *js_dsp = json_object_get(js_e, "dsp");
+        if (kind == SA_SCENE_SPEAKER && js_dsp && n_speakers < MAX_SA_SINKS) {
+            if (!scene_load_dsp(js_dsp, n_speakers, name, &p->dsp[n_speakers])) {
+                free(e->name);
+                return(false);
+            }
+        }
+        if (kind == SA_SCENE_SPEAKER) n_speakers++;
+
+        // "rate": [ lo, hi ] and / or "pitch_cents": n for +- n cents; they multiply
+        e->rate_lo = e->rate_hi = 1.0f;
+        json_t *js_rate = json_object_get(js_e, "rate");
+        if (js_rate) {
+            e->rate_lo = (float) json_number_value(json_array_get(js_rate, 0));
+            e->rate_hi = (float) json_number_value(json_array_get(js_rate, 1));
+        }
+        json_t *js_cents = json_object_get(js_e, "pitch_cents");
+        if (js_cents) {
+            float c = fabsf((float) json_number_value(js_cents));
+            e->rate_lo *= powf(2.0f, -c / 1200.0f);
+            e->rate_hi *= powf(2.0f, c / 1200.0f);
+        }
+        if (e->rate_lo < SA_MIX_RATE_MIN || e->rate_hi > SA_MIX_RATE_MAX || e->rate_lo > e->rate_hi) {
+            fprintf(stderr, "config: %s %s rate must be within %.1f .. %.1f, low to high\n",
+                g_kind_names[kind], name, SA_MIX_RATE_MIN, SA_MIX_RATE_MAX);
+            free(e->name);
+            return(false);
+        }
+
+        // "granular": { "grain_ms": [ lo, hi ], "density": per second, "position": [ lo, hi ] }
+        json_t *js_gran = json_object_get(js_e, "granular");
+        if (js_gran && kind != SA_SCENE_SPEAKER) {
+            sa_grain_config_t *gc = &e->grain_cfg;
+            json_t *js;
+            gc->grain_ms_lo = 50.0f;
+            gc->grain_ms_hi = 200.0f;
+            gc->density = 20.0f;
+            gc->pos_lo = 0.0f;
+            gc->pos_hi = 1.0f;
+            if ((js = json_object_get(js_gran, "grain_ms"))) {
+                gc->grain_ms_lo = (float) json_number_value(json_array_get(js, 0));
+                gc->grain_ms_hi = (float) json_number_value(json_array_get(js, 1));
+            }
+            if ((js = json_object_get(js_gran, "density"))) gc->density = (float) json_number_value(js);
+            if ((js = json_object_get(js_gran, "position"))) {
+                gc->pos_lo = (float) json_number_value(json_array_get(js, 0));
+                gc->pos_hi = (float) json_number_value(json_array_get(js, 1));
+            }
+            if (gc->grain_ms_lo < 5.0f || gc->grain_ms_hi < gc->grain_ms_lo || gc->density <= 0.0f ||
+                gc->pos_lo < 0.0f || gc->pos_hi > 1.0f || gc->pos_hi < gc->pos_lo) {
+                fprintf(stderr, "config: %s %s granular: grain_ms at least 5, low to high; density over 0; position within 0 .. 1\n",
+                    g_kind_names[kind], name);
+                free(e->name);
+                return(false);
+            }
+            e->granular = true;
+        }
+
+        // "reverb": how much to send, 0..1
+        json_t *js_send = json_object_get(js_e, "reverb");
+        if (js_send && kind != SA_SCENE_SPEAKER) {
+            e->send = (float) json_number_value(js_send);
+            if (e->send < 0.0f || e->send > 1.0f) {
+                fprintf(stderr, "config: %s %s reverb must be 0..1\n", g_kind_names[kind], name);
+                free(e->name);
+                return(false);
+            }
+        }
+
+        if (kind != SA_SCENE_SPEAKER) {
+            // "file", or "file-1" .. "file-N"
+            const char *f = json_string_value(json_object_get(js_e, "file"));
+            if (f) e->files[e->n_files++] = scene_path(f);
+            for (int k = 1; e->n_files < SA_SCENE_MAX_FILES; k++) {
+                char key[16];
+                snprintf(key, sizeof(key), "file-%d", k);
+                f = json_string_value(json_object_get(js_e, key));
+                if (!f) break;
+                e->files[e->n_files++] = scene_path(f);
+            }
+            if (e->n_files == 0) {
+                fprintf(stderr, "config: %s %s has no files\n", g_kind_names[kind], name);
+                free(e->name);
+                continue;
+            }
+        }
+
+        // the same name twice ( the sample config has it ) makes targets ambiguous
+        for (int j = 0; j < p->n_entries; j++) {
+            if (p->entries[j].kind == kind && strcmp(p->entries[j].name, name) == 0) {
+                fprintf(stderr, "config: duplicate %s name %s, only the first can be targeted\n",
+                    g_kind_names[kind], name);
+                break;
+            }
+        }
+
+        p->n_entries++;
+    }
+    return(true);
+}
+
+// "kind/name"
+static int scene_find_in(const sa_scene_entry_t *entries, int n_entries, const char *target) {
+
+    const char *slash = strchr(target, '/');
+    if (!slash) return(-1);
+
+    size_t klen = slash - target;
+    for (int i = 0; i < n_entries; i++) {
+        const char *kn = g_kind_names[entries[i].kind];
+        if (strlen(kn) == klen && strncmp(kn, target, klen) == 0
+         && strcmp(entries[i].name, slash + 1) == 0)
+            return(i);
+    }
+    return(-1);
+}
+
+static int scene_find(const char *target) {
+    return(scene_find_in(g_entries, g_n_entries, target));
+}
+
+static bool scene_load_polyphony(json_t *js_root, sa_polyphony_t *poly) {
+
+    *poly = g_poly_default;
+    json_t *js_poly = json_object_get(js_root, "polyphony");
+    if (!js_poly) return(true);
+
+    json_t *js;
+    if ((js = json_object_get(js_poly, "max_voices"))) poly->max_voices = (int) json_integer_value(js);
+    if ((js = json_object_get(js_poly, "ambients"))) poly->kind_max[SA_SCENE_AMBIENT] = (int) json_integer_value(js);
+    if ((js = json_object_get(js_poly, "soundscapes"))) poly->kind_max[SA_SCENE_SOUNDSCAPE] = (int) json_integer_value(js);
+    if ((js = json_object_get(js_poly, "release_ms"))) poly->release_ms = (uint32_t) json_integer_value(js);
+
+    if (poly->max_voices < 1) {
+        fprintf(stderr, "config: polyphony max_voices must be at least 1\n");
+        return(false);
+    }
+
+    const char *steal = json_string_value(json_object_get(js_poly, "steal"));
+    if (steal) {
+        int i;
+        for (i = 0; i < 3; i++) {
+            if (strcmp(steal, g_steal_names[i]) == 0) break;
+        }
+        if (i == 3) {
+            fprintf(stderr, "config: polyphony steal must be lowest_priority, oldest or quietest\n");
+            return(false);
+        }
+        poly->steal = (sa_steal_policy_t) i;
+    }
+    return(true);
+}
+
+// "reverbs": [ { "name", "ir", "speakers": [ sink slots ], "return_db", "partition", "latency_ms" } .. ]
+static bool scene_load_reverbs(json_t *js_root) {
+
+    json_t *js_arr = json_object_get(js_root, "reverbs");
+    if (!js_arr) return(true);
+    if (!json_is_array(js_arr)) {
+        fprintf(stderr, "config: reverbs is not an array\n");
+        return(false);
+    }
+
+    size_t i;
+    json_t *js_r;
+    json_array_foreach(js_arr, i, js_r) {
+
+        sa_reverb_config_t cfg;
+        json_t *js;
+        const char *name = json_string_value(json_object_get(js_r, "name"));
+        const char *ir = json_string_value(json_object_get(js_r, "ir"));
+        if (!name || !ir) {
+            fprintf(stderr, "config: reverb %zu needs a name and an ir\n", i);
+            return(false);
+        }
+        cfg.name = (char *) name;
+        cfg.return_db = (js = json_object_get(js_r, "return_db")) ? (float) json_number_value(js) : -6.0f;
+        cfg.partition = (js = json_object_get(js_r, "partition")) ? (int) json_integer_value(js) : SA_REVERB_PARTITION_DEFAULT;
+        // two partitions: one to fill, one for the worker to turn it around in
+        cfg.latency_ms = (js = json_object_get(js_r, "latency_ms")) ? (float) json_number_value(js)
+            : 2000.0f * cfg.partition / g_mix_rate;
+
+        // every speaker, unless it says which
+        cfg.sinks = (1u << MAX_SA_SINKS) - 1;
+        json_t *js_spk = json_object_get(js_r, "speakers");
+        if (js_spk) {
+            size_t j;
+            json_t *js_s;
+            cfg.sinks = 0;
+            json_array_foreach(js_spk, j, js_s) {
+                json_int_t slot = json_integer_value(js_s);
+                if (!json_is_integer(js_s) || slot < 0 || slot >= MAX_SA_SINKS) {
+                    fprintf(stderr, "config: reverb %s speakers are speaker numbers, 0..%d\n", name, MAX_SA_SINKS - 1);
+                    return(false);
+                }
+                cfg.sinks |= 1u << slot;
+            }
+        }
+
+        int r = sa_reverb_add(&cfg);
+        if (r < 0) return(false);
+        g_reverb_irs[r].file = scene_path(ir);
+        g_n_reverb_irs = r + 1;
+    }
+    return(true);
+}
+
+static void scene_parse_free(sa_scene_parse_t *p) {
+
+    for (int i = 0; i < p->n_entries; i++) {
+        free(p->entries[i].name);
+        for (int j = 0; j < p->entries[i].n_files; j++) free(p->entries[i].files[j]);
+    }
+    p->n_entries = 0;
+}
+
+// everything into p, nothing live touched; on false p still needs freeing
+static bool scene_parse(json_t *js_root, sa_scene_parse_t *p) {
+
+    memset(p, 0, sizeof(sa_scene_parse_t));
+    if (!scene_load_polyphony(js_root, &p->poly)) return(false);
+    if (!scene_load_kind(js_root, SA_SCENE_AMBIENT, p)) return(false);
+    if (!scene_load_kind(js_root, SA_SCENE_SOUNDSCAPE, p)) return(false);
+    if (!scene_load_kind(js_root, SA_SCENE_SPEAKER, p)) return(false);
+
+    // what plays at boot: "startup": [ targets ], or every ambient and the first soundscape
+    json_t *js_startup = json_object_get(js_root, "startup");
+    if (js_startup) {
+        size_t i;
+        json_t *js_t;
+        json_array_foreach(js_startup, i, js_t) {
+            const char *target = json_string_value(js_t);
+            int idx = target ? scene_find_in(p->entries, p->n_entries, target) : -1;
+            if (idx < 0 || p->entries[idx].kind == SA_SCENE_SPEAKER) {
+                fprintf(stderr, "config: startup entry %zu is not an ambient or soundscape\n", i);
+                return(false);
+            }
+            p->entries[idx].startup = true;
+        }
+    }
+    else {
+        bool first_scape = true;
+        for (int i = 0; i < p->n_entries; i++) {
+            if (p->entries[i].kind == SA_SCENE_AMBIENT) p->entries[i].startup = true;
+            if (p->entries[i].kind == SA_SCENE_SOUNDSCAPE && first_scape) {
+                p->entries[i].startup = true;
+                first_scape = false;
+            }
+        }
+    }
+    return(true);
+}
+
+// the parsed scene becomes the live one, and p gives up its strings. The old entries
+// are already freed, under the write lock on a reload.
+static void scene_commit(sa_scene_parse_t *p) {
+
+    memcpy(g_entries, p->entries, p->n_entries * sizeof(sa_scene_entry_t));
+    g_n_entries = p->n_entries;
+    for (int i = 0; i < g_n_entries; i++) sa_timer_setup(&g_entries[i].stop_timer, scene_stop_timer_fn, &g_entries[i]);
+    p->n_entries = 0;
+
+    g_poly = p->poly;
+    // checked while parsing; a speaker whose "dsp" went away goes back to none, not to what it had
+    for (int s = 0; s < MAX_SA_SINKS; s++) sa_dsp_setup(s, &p->dsp[s]);
+
+    if (g_verbose) fprintf(stderr, "scene: %d entries loaded\n", g_n_entries);
+}
+
+// called from config_load, g_directory is already set. Reverbs have their threads
+// and buffers from boot, and only load then.
+bool sa_scene_load(json_t *js_root) {
+
+    if (!scene_load_reverbs(js_root) || !scene_parse(js_root, &g_parse)) {
+        scene_parse_free(&g_parse);
+        return(false);
+    }
+    scene_commit(&g_parse);
+    return(true);
+}
+
+// queue every file with the cache. What plays at boot goes first, ambients
+// ahead of soundscapes since they're the bed everything else sits on.
+void sa_scene_prefetch(void) {
+
+    for (int i = 0; i < g_n_entries; i++) {
+        sa_scene_entry_t *e = &g_entries[i];
+        int prio = !e->startup ? 2 : e->kind == SA_SCENE_AMBIENT ? 0 : 1;
+        for (int j = 0; j < e->n_files; j++) {
+            e->samples[j] = sa_cache_request(e->files[j], prio);
+        }
+    }
+    // along with what plays at boot, there's no reverb without them
+    for (int i = 0; i < g_n_reverb_irs; i++)
+        g_reverb_irs[i].sample = sa_cache_request(g_reverb_irs[i].file, 1);
+}
+
+/*
+** applying, mainloop only
+*/
+
+// speakers are matched to sinks by position: the first speaker is sink slot 0
+static float scene_speaker_volume(int sink) {
+
+    int n = 0;
+    for (int i = 0; i < g_n_entries; i++) {
+        if (g_entries[i].kind != SA_SCENE_SPEAKER) continue;
+        if (n == sink) return(g_entries[i].volume);
+        n++;
+    }
+    return(1.0f);
+}
+
+static void scene_entry_gains(sa_scene_entry_t *e, float scale, uint32_t ramp_ms) {
+
+    if (!e->scape) return;
+    for (int i = 0; i < e->scape->n_splays; i++) {
+        sa_soundplay_t *splay = e->scape->splays[i];
+        if (!splay) continue;
+        sa_soundplay_set_gain(splay, scale * e->volume * scene_speaker_volume(splay->sink), ramp_ms);
+    }
+}
+
+static inline bool scene_entry_sounding(const sa_scene_entry_t *e) {
+    return(e->scape && e->stop_timer.heap_idx < 0);
+}
+
+// Still being mixed, so it counts against the caps: sounding, or on a fade out
+// longer than release_ms. A fade that short ( a steal, a quick stop ) is let go
+// of early, which is as far over the cap the mix ever gets, and not for long.
+static inline bool scene_entry_counted(const sa_scene_entry_t *e) {
+    return(e->scape && (e->stop_timer.heap_idx < 0 || !e->quick_release));
+}
+
+// voices held by counted entries, of one kind or ( kind < 0 ) all
+static int scene_voices(int kind) {
+
+    int n = 0;
+    for (int i = 0; i < g_n_entries; i++) {
+        const sa_scene_entry_t *e = &g_entries[i];
+        if (scene_entry_counted(e) && (kind < 0 || (int) e->kind == kind)) n += e->scape->n_splays;
+    }
+    return(n);
+}
+
+// anything the scene did that shows up in /status or /metrics
+static void scene_state_changed(void) {
+    atomic_store(&g_voices_active, scene_voices(-1));
+    sa_state_changed();
+}
+
+static void scene_entry_stop_now(sa_scene_entry_t *e) {
+
+    sa_timer_cancel(&e->stop_timer);
+    if (e->scape) {
+        if (g_verbose) fprintf(stderr, "scene: stopping %s\n", e->name);
+        sa_soundscape_stop(e->scape);
+        sa_soundscape_free(e->scape);
+        e->scape = NULL;
+    }
+}
+
+static void scene_stop_timer_fn(sa_timer_t *t, void *userdata) {
+    scene_entry_stop_now((sa_scene_entry_t *) userdata);
+    scene_state_changed();
+}
+
+// fade out and drop. It's mixed, and so counted, until it's dropped, unless the
+// fade is release_ms or less; see scene_entry_counted
+static void scene_entry_release(sa_scene_entry_t *e, uint32_t ramp_ms) {
+
+    if (ramp_ms == 0) {
+        scene_entry_stop_now(e);
+        return;
+    }
+    if (e->stop_timer.heap_idx < 0) e->released_usec = sa_timer_now();
+    e->quick_release = ramp_ms <= g_poly.release_ms;
+    scene_entry_gains(e, 0.0f, ramp_ms);
+    // the ramp is applied as the voices are mixed; what's already buffered
+    // in the server has to play out before we can drop them
+    sa_timer_schedule(&e->stop_timer,
+        ramp_ms * PA_USEC_PER_MSEC + sa_soundscape_latency(e->scape));
+}
+
+// how loud it actually is, from what's been mixed: the mean over its speakers
+static float scene_entry_level(const sa_scene_entry_t *e) {
+
+    float sum = 0.0f;
+    for (int i = 0; i < e->scape->n_splays; i++) sum += e->scape->splays[i]->level;
+    return(e->scape->n_splays ? sum / e->scape->n_splays : 0.0f);
+}
+
+// is a better candidate to steal than b, by the policy
+static bool scene_steal_before(const sa_scene_entry_t *a, const sa_scene_entry_t *b) {
+
+    switch (g_poly.steal) {
+        case SA_STEAL_QUIETEST: {
+            float la = scene_entry_level(a), lb = scene_entry_level(b);
+            if (la != lb) return(la < lb);
+            break;
+        }
+        case SA_STEAL_LOWEST_PRIORITY:
+            if (a->priority != b->priority) return(a->priority < b->priority);
+            break;
+        case SA_STEAL_OLDEST:
+            break;
+    }
+    return(a->started_usec < b->started_usec);
+}
+
+// Something to make room for e: sounding, not protected, no more important than
+// e, not already picked, and of e's kind if it's the kind's cap that's full.
+// NULL if nothing will do.
+static sa_scene_entry_t *scene_steal_victim(const sa_scene_entry_t *e, bool same_kind,
+        sa_scene_entry_t **picked, int n_picked) {
+
+    sa_scene_entry_t *victim = NULL;
+
+    for (int i = 0; i < g_n_entries; i++) {
+        sa_scene_entry_t *c = &g_entries[i];
+        if (c == e || !scene_entry_sounding(c)) continue;
+        if (c->priority >= SA_PRIORITY_PROTECTED || c->priority > e->priority) continue;
+        if (same_kind && c->kind != e->kind) continue;
+        int j;
+        for (j = 0; j < n_picked && picked[j] != c; j++) ;
+        if (j < n_picked) continue;
+        if (!victim || scene_steal_before(c, victim)) victim = c;
+    }
+    return(victim);
+}
+
+// A long fade out to cut short to release_ms, the oldest first: it's going
+// anyway, so this goes before stealing anything. Of e's kind if it's the
+// kind's cap that's full, not already picked; NULL if there's none.
+static sa_scene_entry_t *scene_fade_victim(const sa_scene_entry_t *e, bool same_kind,
+        sa_scene_entry_t **picked, int n_picked) {
+
+    sa_scene_entry_t *victim = NULL;
+
+    for (int i = 0; i < g_n_entries; i++) {
+        sa_scene_entry_t *c = &g_entries[i];
+        if (c == e || !c->scape || scene_entry_sounding(c) || !scene_entry_counted(c)) continue;
+        if (same_kind && c->kind != e->kind) continue;
+        int j;
+        for (j = 0; j < n_picked && picked[j] != c; j++) ;
+        if (j < n_picked) continue;
+        if (!victim || c->released_usec < victim->released_usec) victim = c;
+    }
+    return(victim);
+}
+
+// Room for e's voices under the caps, cutting fades short and then stealing if
+// needed. False if there isn't and can't be, in which case nothing was touched.
+static bool scene_admit(sa_scene_entry_t *e, int needed) {
+
+    int kind_max = g_poly.kind_max[e->kind];
+    sa_scene_entry_t *victims[SA_SCENE_MAX_ENTRIES];
+    int n_victims = 0;
+    int total = scene_voices(-1);
+    int of_kind = scene_voices(e->kind);
+
+    // pick them all first, so a start that can't happen doesn't cost anyone
+    while (total + needed > g_poly.max_voices || (kind_max && of_kind + needed > kind_max)) {
+
+        bool kind_full = kind_max && of_kind + needed > kind_max;
+        sa_scene_entry_t *v = scene_fade_victim(e, kind_full, victims, n_victims);
+        if (!v) v = scene_steal_victim(e, kind_full, victims, n_victims);
+        if (!v) {
+            atomic_fetch_add(&g_voices_refused, needed);
+            fprintf(stderr, "scene: no voices for %s, %d of %d in use\n", e->name, scene_voices(-1), g_poly.max_voices);
+            return(false);
+        }
+        total -= v->scape->n_splays;
+        if (v->kind == e->kind) of_kind -= v->scape->n_splays;
+        victims[n_victims++] = v;
+    }
+
+    for (int i = 0; i < n_victims; i++) {
+        sa_scene_entry_t *v = victims[i];
+        if (!scene_entry_sounding(v)) {
+            if (g_verbose) fprintf(stderr, "scene: cutting short the fade of %s for %s\n", v->name, e->name);
+            scene_entry_release(v, g_poly.release_ms);
+            continue;
+        }
+        if (g_verbose) fprintf(stderr, "scene: stealing %s for %s\n", v->name, e->name);
+        SA_TRACE_INSTANT("voice steal", v->scape->n_splays);
+        atomic_fetch_add(&g_voices_stolen, v->scape->n_splays);
+        scene_entry_release(v, g_poly.release_ms);
+    }
+    return(true);
+}
+
+// Starts with whatever samples loaded. If some are still on their way it waits
+// for all of them, so a soundscape doesn't come up with only some of its files.
+static void scene_entry_start(sa_scene_entry_t *e, uint32_t ramp_ms) {
+
+    sa_sample_t *ready[SA_SCENE_MAX_FILES];
+    int n_ready = 0, n_loading = 0;
+
+    for (int j = 0; j < e->n_files; j++) {
+        int state = e->samples[j] ? atomic_load(&e->samples[j]->state) : SA_SAMPLE_FAILED;
+        if (state == SA_SAMPLE_READY) ready[n_ready++] = e->samples[j];
+        else if (state != SA_SAMPLE_FAILED) n_loading++;
+    }
+
+    if (n_loading) {
+        SA_TRACE_INSTANT("cache miss", n_loading);
+        if (g_verbose && !e->pending_start) fprintf(stderr, "scene: %s waiting on %d samples\n", e->name, n_loading);
+        e->pending_start = true;
+        e->pending_ramp_ms = ramp_ms;
+        return;
+    }
+    e->pending_start = false;
+
+    if (n_ready == 0) {
+        fprintf(stderr, "scene: could not start %s, none of its files loaded\n", e->name);
+        return;
+    }
+
+    if (!scene_admit(e, sa_sinks_active())) return;
+
+    if (g_verbose) fprintf(stderr, "scene: starting %s\n", e->name);
+    e->scape = sa_soundscape_new(ready, n_ready);
+    e->started_usec = sa_timer_now();
+
+    // each its own grains, so the speakers don't play the same texture
+    if (e->granular) {
+        for (int i = 0; i < e->scape->n_splays; i++) {
+            sa_soundplay_t *splay = e->scape->splays[i];
+            if (splay) splay->grains = sa_grains_new(&e->grain_cfg, (uint32_t) (scene_rand() * 4294967295.0f));
+        }
+    }
+    // each voice its own rate, so the same file on every speaker isn't in unison
+    else if (e->rate_lo != 1.0f || e->rate_hi != 1.0f) {
+        for (int i = 0; i < e->scape->n_splays; i++) {
+            if (e->scape->splays[i])
+                sa_soundplay_set_rate(e->scape->splays[i], e->rate_lo + (e->rate_hi - e->rate_lo) * scene_rand());
+        }
+    }
+    if (e->send > 0.0f) {
+        for (int i = 0; i < e->scape->n_splays; i++) {
+            if (e->scape->splays[i]) e->scape->splays[i]->send = sa_mix_gain(e->send);
+        }
+    }
+
+    // no write callback has happened yet, so this is where the first frame starts
+    if (ramp_ms) scene_entry_gains(e, 0.0f, 0);
+    scene_entry_gains(e, 1.0f, ramp_ms);
+}
+
+// sinks are known, start what the config says plays at boot
+void sa_scene_startup(void) {
+
+    g_started = true;
+    for (int i = 0; i < g_n_entries; i++) {
+        if (g_entries[i].startup && !g_entries[i].scape)
+            scene_entry_start(&g_entries[i], 0);
+    }
+    scene_state_changed();
+}
+
+// the cache finished a sample ( or gave up on it )
+void sa_scene_sample_ready(sa_sample_t *sample) {
+
+    bool changed = false;
+
+    for (int i = 0; i < g_n_reverb_irs; i++) {
+        if (g_reverb_irs[i].sample == sample) sa_reverb_set_ir(i, sample);
+    }
+
+    for (int i = 0; i < g_n_entries; i++) {
+        sa_scene_entry_t *e = &g_entries[i];
+        if (!e->pending_start) continue;
+        for (int j = 0; j < e->n_files; j++) {
+            if (e->samples[j] == sample) {
+                scene_entry_start(e, e->pending_ramp_ms);
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (changed) scene_state_changed();
+}
+
+static void scene_op_apply(const sa_scene_op_t *op) {
+
+    sa_scene_entry_t *e = &g_entries[op->entry];
+
+    switch (op->type) {
+
+        case SA_OP_START:
+            if (e->scape) {
+                // fading out? turn it around, if there's room for it again; a
+                // long fade is still counted, so it needs nothing more
+                if (e->stop_timer.heap_idx >= 0 && scene_admit(e, scene_entry_counted(e) ? 0 : e->scape->n_splays)) {
+                    sa_timer_cancel(&e->stop_timer);
+                    scene_entry_gains(e, 1.0f, op->ramp_ms);
+                }
+                break;
+            }
+            scene_entry_start(e, op->ramp_ms);
+            break;
+
+        case SA_OP_STOP:
+            e->pending_start = false;
+            if (!e->scape) break;
+            scene_entry_release(e, op->ramp_ms);
+            break;
+
+        case SA_OP_VOLUME:
+            e->volume = op->value;
+            if (e->kind == SA_SCENE_SPEAKER) {
+                for (int i = 0; i < g_n_entries; i++) {
+                    if (g_entries[i].stop_timer.heap_idx < 0)
+                        scene_entry_gains(&g_entries[i], 1.0f, op->ramp_ms);
+                }
+            }
+            else if (e->stop_timer.heap_idx < 0) {
+                scene_entry_gains(e, 1.0f, op->ramp_ms);
+            }
+            break;
+    }
+}
+
+static void scene_batch_release(sa_scene_batch_t *b) {
+    if (atomic_fetch_sub(&b->refs, 1) == 1) {
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->cond);
+        free(b);
+    }
+}
+
+/* pa_io_event_cb_t */
+static void scene_io_cb(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+
+    sa_scene_batch_t *b;
+
+    while (read(fd, &b, sizeof(b)) == sizeof(b)) {
+
+        SA_TRACE_BEGIN("scene apply", b->n_ops);
+        // checked against entries a reload has since replaced
+        if (b->generation != g_generation) b->n_ops = 0;
+        for (int i = 0; i < b->n_ops; i++) {
+            scene_op_apply(&b->ops[i]);
+        }
+        scene_state_changed();
+        SA_TRACE_END("scene apply", b->n_ops);
+
+        pthread_mutex_lock(&b->lock);
+        b->done = true;
+        b->version = sa_state_version();
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+
+        scene_batch_release(b);
+    }
+}
+
+bool sa_scene_init(pa_mainloop_api *api) {
+
+    if (pipe(g_scene_pipe) != 0) {
+        fprintf(stderr, "scene: pipe failed: %s\n", strerror(errno));
+        return(false);
+    }
+    fcntl(g_scene_pipe[0], F_SETFL, O_NONBLOCK);
+
+    g_rand ^= (uint32_t) time(NULL);
+    if (g_rand == 0) g_rand = 1;
+    g_scene_api = api;
+    g_scene_io = api->io_new(api, g_scene_pipe[0], PA_IO_EVENT_INPUT, scene_io_cb, NULL);
+    if (!g_scene_io) {
+        fprintf(stderr, "scene: io_new failed\n");
+        return(false);
+    }
+    return(true);
+}
+
+static void scene_entries_free(void) {
+
+    for (int i = 0; i < g_n_entries; i++) {
+        scene_entry_stop_now(&g_entries[i]);
+        free(g_entries[i].name);
+        for (int j = 0; j < g_entries[i].n_files; j++) free(g_entries[i].files[j]);
+    }
+    g_n_entries = 0;
+}
+
+// SIGHUP, mainloop. The new scene is read aside first, so a config with a mistake
+// in it leaves what's playing alone; false then.
+bool sa_scene_reload(json_t *js_root) {
+
+    if (!scene_parse(js_root, &g_parse)) {
+        scene_parse_free(&g_parse);
+        fprintf(stderr, "scene: reload failed, keeping the current scene\n");
+        return(false);
+    }
+
+    pthread_rwlock_wrlock(&g_entries_lock);
+    scene_entries_free();
+    g_generation++;
+    scene_commit(&g_parse);
+    pthread_rwlock_unlock(&g_entries_lock);
+
+    fprintf(stderr, "scene: reloaded, %d entries\n", g_n_entries);
+    // the cache keeps what it had, so only new files are loaded
+    sa_scene_prefetch();
+    if (g_started) sa_scene_startup();
+    else scene_state_changed();
+    return(true);
+}
+
+// "kind/name" of every ambient and soundscape, for the soak driver. Any thread;
+// free each and the array.
+int sa_scene_targets(char ***targets) {
+
+    pthread_rwlock_rdlock(&g_entries_lock);
+    char **t = malloc((g_n_entries + 1) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < g_n_entries; i++) {
+        if (g_entries[i].kind == SA_SCENE_SPEAKER) continue;
+        size_t len = strlen(g_kind_names[g_entries[i].kind]) + strlen(g_entries[i].name) + 2;
+        t[n] = malloc(len);
+        snprintf(t[n++], len, "%s/%s", g_kind_names[g_entries[i].kind], g_entries[i].name);
+    }
+    pthread_rwlock_unlock(&g_entries_lock);
+    *targets = t;
+    return(n);
+}
+
+void sa_scene_done(void) {
+
+    scene_entries_free();
+    for (int i = 0; i < g_n_reverb_irs; i++) free(g_reverb_irs[i].file);
+    g_n_reverb_irs = 0;
+
+    if (g_scene_io) {
+        g_scene_api->io_free(g_scene_io);
+        g_scene_io = NULL;
+    }
+    if (g_scene_pipe[0] >= 0) close(g_scene_pipe[0]);
+    if (g_scene_pipe[1] >= 0) close(g_scene_pipe[1]);
+    g_scene_pipe[0] = g_scene_pipe[1] = -1;
+}
+
+// for /status, mainloop
+json_t *sa_scene_status(void) {
+
+    json_t *js_arr = json_array();
+    for (int i = 0; i < g_n_entries; i++) {
+        sa_scene_entry_t *e = &g_entries[i];
+        json_t *js = json_object();
+        char target[256];
+        snprintf(target, sizeof(target), "%s/%s", g_kind_names[e->kind], e->name);
+        json_object_set_new(js, "target", json_string(target));
+        json_object_set_new(js, "volume", json_real(e->volume));
+        if (e->kind != SA_SCENE_SPEAKER) {
+            json_object_set_new(js, "priority", json_integer(e->priority));
+            json_object_set_new(js, "playing", json_boolean(e->scape != NULL));
+            json_object_set_new(js, "waiting", json_boolean(e->pending_start));
+            json_object_set_new(js, "stopping", json_boolean(e->stop_timer.heap_idx >= 0));
+        }
+        json_array_append_new(js_arr, js);
+    }
+    return(js_arr);
+}
+
+// any thread
+void sa_scene_voice_stats(sa_voice_stats_t *stats) {
+    stats->active = atomic_load(&g_voices_active);
+    stats->max = g_poly.max_voices;
+    stats->stolen = atomic_load(&g_voices_stolen);
+    stats->refused = atomic_load(&g_voices_refused);
+}
+
+/*
+** submitting, HTTP threads
+*/
+
+static char *scene_error(int *code, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static char *scene_error(int *code, const char *fmt, ...) {
+
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+
+    json_t *js = json_object();
+    json_object_set_new(js, "ok", json_false());
+    json_object_set_new(js, "error", json_string(msg));
+    char *s = json_dumps(js, JSON_COMPACT);
+    json_decref(js);
+
+    *code = 400;
+    return(s);
+}
+
+static bool scene_ramp(json_t *js, uint32_t *ramp_ms) {
+
+    json_t *js_ramp = json_object_get(js, "ramp_ms");
+    if (!js_ramp) return(true);
+    if (!json_is_number(js_ramp)) return(false);
+    double r = json_number_value(js_ramp);
+    if (r < 0 || r > SA_SCENE_MAX_RAMP_MS) return(false);
+    *ramp_ms = (uint32_t) r;
+    return(true);
+}
+
+// body is either [ ops ] or { "ramp_ms": N, "ops": [ ops ] }, where each op is
+// { "op": "start" | "stop" | "volume", "target": "soundscapes/peepers", "value": 0.5, "ramp_ms": N }
+// Returns a json result to send back ( free() it ) and the HTTP code in *code.
+char *sa_scene_submit(const char *body, size_t len, int *code) {
+
+    json_error_t js_err;
+    json_auto_t *js_root = json_loadb(body, len, 0, &js_err);
+    if (!js_root) {
+        return(scene_error(code, "bad json at %d:%d: %s", js_err.line, js_err.column, js_err.text));
+    }
+
+    uint32_t shared_ramp = 0;
+    json_t *js_ops = js_root;
+    if (json_is_object(js_root)) {
+        if (!scene_ramp(js_root, &shared_ramp))
+            return(scene_error(code, "ramp_ms must be 0..%d", SA_SCENE_MAX_RAMP_MS));
+        js_ops = json_object_get(js_root, "ops");
+    }
+    if (!json_is_array(js_ops))
+        return(scene_error(code, "expected an array of ops"));
+    if (json_array_size(js_ops) > SA_SCENE_MAX_OPS)
+        return(scene_error(code, "too many ops, max %d", SA_SCENE_MAX_OPS));
+
+    sa_scene_batch_t *b = malloc(sizeof(sa_scene_batch_t));
+    memset(b, 0, sizeof(sa_scene_batch_t));
+
+    // the names hold still until the batch is checked
+    pthread_rwlock_rdlock(&g_entries_lock);
+    b->generation = g_generation;
+
+    size_t i;
+    json_t *js_op;
+    json_array_foreach(js_ops, i, js_op) {
+
+        sa_scene_op_t *op = &b->ops[i];
+        char *err = NULL;
+
+        const char *type = json_string_value(json_object_get(js_op, "op"));
+        const char *target = json_string_value(json_object_get(js_op, "target"));
+
+        if (!type || !target) {
+            err = scene_error(code, "op %zu: needs op and target", i);
+            goto BAD;
+        }
+        if ((op->entry = scene_find(target)) < 0) {
+            err = scene_error(code, "op %zu: unknown target %s", i, target);
+            goto BAD;
+        }
+        op->ramp_ms = shared_ramp;
+        if (!scene_ramp(js_op, &op->ramp_ms)) {
+            err = scene_error(code, "op %zu: ramp_ms must be 0..%d", i, SA_SCENE_MAX_RAMP_MS);
+            goto BAD;
+        }
+
+        if (strcmp(type, "start") == 0 || strcmp(type, "stop") == 0) {
+            op->type = strcmp(type, "start") == 0 ? SA_OP_START : SA_OP_STOP;
+            if (g_entries[op->entry].kind == SA_SCENE_SPEAKER) {
+                err = scene_error(code, "op %zu: can't %s a speaker", i, type);
+                goto BAD;
+            }
+        }
+        else if (strcmp(type, "volume") == 0) {
+            op->type = SA_OP_VOLUME;
+            json_t *js_v = json_object_get(js_op, "value");
+            double v = json_is_number(js_v) ? json_number_value(js_v) : -1.0;
+            if (v < 0.0 || v > 1.0) {
+                err = scene_error(code, "op %zu: volume value must be 0..1", i);
+                goto BAD;
+            }
+            op->value = (float) v;
+        }
+        else {
+            err = scene_error(code, "op %zu: unknown op %s", i, type);
+            goto BAD;
+        }
+        b->n_ops++;
+        continue;
+
+BAD:
+        pthread_rwlock_unlock(&g_entries_lock);
+        free(b);
+        return(err);
+    }
+    pthread_rwlock_unlock(&g_entries_lock);
+
+    // all good, hand it over
+    atomic_init(&b->refs, 2);
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+
+    if (write(g_scene_pipe[1], &b, sizeof(b)) != sizeof(b)) {
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->cond);
+        free(b);
+        *code = 503;
+        return(strdup("{\"ok\":false,\"error\":\"engine not accepting changes\"}"));
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SA_SCENE_APPLY_TIMEOUT_SEC;
+
+    pthread_mutex_lock(&b->lock);
+    while (!b->done) {
+        if (pthread_cond_timedwait(&b->cond, &b->lock, &deadline) == ETIMEDOUT) break;
+    }
+    bool done = b->done;
+    uint64_t version = b->version;
+    int n_ops = b->n_ops;
+    pthread_mutex_unlock(&b->lock);
+    scene_batch_release(b);
+
+    if (!done) {
+        // it's queued and will still be applied, we just can't say when
+        *code = 202;
+        return(strdup("{\"ok\":true,\"applied\":false}"));
+    }
+
+    json_t *js = json_object();
+    json_object_set_new(js, "ok", json_true());
+    json_object_set_new(js, "applied", json_integer(n_ops));
+    json_object_set_new(js, "version", json_integer(version));
+    char *s = json_dumps(js, JSON_COMPACT);
+    json_decref(js);
+
+    *code = 200;
+    return(s);
+}
@@ -0,0 +1,332 @@
+/***
+  SerenityAudio
+
+  Soak mode ( saplay --soak=HOURS ). This runs for weeks at a stretch, so
+  leaks, fragmentation and lost file descriptors matter even when they're
+  slow. Soak mode finds them on a bench before a show: it drives the scene far
+  harder than any show does, and watches the process while it does.
+
+  A thread of its own submits batches the way the HTTP threads do -
+  starts and stops of random ambients and soundscapes with random ramps, and
+  the odd volume change - at triggers_per_sec. Every reload_sec it sends us
+  SIGHUP, so the scene is torn down and loaded again from the config. Every
+  sample_sec it reads the resident size, the heap's in use and free bytes
+  ( mallinfo2, all arenas ) and the count of open file descriptors, and logs
+  them.
+
+  At the end it compares. The baseline is the first sample after warmup_sec,
+  once the cache has everything loaded; the end is the lowest of each over the
+  last quarter of the run, so a leak shows but a busy moment doesn't. Growth
+  past the "soak" thresholds in the config fails the run, and saplay exits 1.
+
+  Run it against a PulseAudio with a null sink or two in place of the
+  speakers ( pactl load-module module-null-sink ), so the whole mix runs in
+  real time without anything to hear.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include <jansson.h>
+
+#include "saplay.h"
+
+typedef struct soak_sample {
+    uint32_t t_sec;
+    long rss_kb;
+    long heap_kb;           // in use, from the heap and mmapped
+    long free_kb;           // held by malloc but free, which is fragmentation if it grows
+    int fds;
+} soak_sample_t;
+
+static sa_soak_config_t g_soak;
+static pthread_t g_soak_thread;
+static bool g_soak_started = false;
+
+static pthread_mutex_t g_soak_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_soak_cond = PTHREAD_COND_INITIALIZER;
+static bool g_soak_stop = false;
+static bool g_soak_failed = false;
+
+static soak_sample_t *g_samples = NULL;
+static int g_n_samples = 0;
+static int g_samples_size = 0;
+
+static uint64_t g_triggers = 0, g_rejected = 0, g_reloads = 0;
+static uint32_t g_soak_rand = 88172645u;
+
+static float soak_rand(void) {
+    g_soak_rand ^= g_soak_rand << 13;
+    g_soak_rand ^= g_soak_rand >> 17;
+    g_soak_rand ^= g_soak_rand << 5;
+    return((g_soak_rand >> 8) * (1.0f / 16777216.0f));
+}
+
+static uint64_t soak_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+// sleeps, unless we're told to stop; false then
+static bool soak_sleep(uint64_t ms) {
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&g_soak_lock);
+    while (!g_soak_stop) {
+        if (pthread_cond_timedwait(&g_soak_cond, &g_soak_lock, &deadline) == ETIMEDOUT) break;
+    }
+    bool go = !g_soak_stop;
+    pthread_mutex_unlock(&g_soak_lock);
+    return(go);
+}
+
+static void soak_measure(soak_sample_t *s) {
+
+    long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*ld %ld", &pages) != 1) pages = 0;
+        fclose(f);
+    }
+    s->rss_kb = pages * (sysconf(_SC_PAGESIZE) / 1024);
+
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();    // ints, fine below 2G
+#endif
+    s->heap_kb = (long) ((mi.uordblks + mi.hblkhd) / 1024);
+    s->free_kb = (long) (mi.fordblks / 1024);
+
+    // less the one opendir has open
+    s->fds = -1;
+    DIR *d = opendir("/proc/self/fd");
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            if (de->d_name[0] != '.') s->fds++;
+        }
+        closedir(d);
+    }
+}
+
+// one batch through the same path as POST /scene
+static void soak_trigger(char **targets, int n_targets) {
+
+    const char *target = targets[(int) (soak_rand() * n_targets)];
+    float r = soak_rand();
+    json_t *js_op;
+
+    if (r < 0.1f)
+        js_op = json_pack("{s:s,s:s,s:f,s:i}", "op", "volume", "target", target,
+            "value", (double) soak_rand(), "ramp_ms", (int) (soak_rand() * 500));
+    else
+        js_op = json_pack("{s:s,s:s,s:i}", "op", r < 0.6f ? "start" : "stop", "target", target,
+            "ramp_ms", soak_rand() < 0.3f ? 0 : (int) (soak_rand() * 1000));
+
+    json_t *js_ops = json_array();
+    json_array_append_new(js_ops, js_op);
+    char *body = json_dumps(js_ops, JSON_COMPACT);
+    json_decref(js_ops);
+
+    int code = 0;
+    char *res = sa_scene_submit(body, strlen(body), &code);
+    g_triggers++;
+    if (code >= 400) {
+        g_rejected++;
+        if (g_verbose) fprintf(stderr, "soak: %s rejected: %s\n", body, res);
+    }
+    free(res);
+    free(body);
+}
+
+static void soak_targets_free(char **targets, int n) {
+    for (int i = 0; i < n; i++) free(targets[i]);
+    free(targets);
+}
+
+// true if nothing grew past its threshold
+static bool soak_judge(void) {
+
+    int base = -1;
+    for (int i = 0; i < g_n_samples; i++) {
+        if (g_samples[i].t_sec >= (uint32_t) g_soak.warmup_sec) {
+            base = i;
+            break;
+        }
+    }
+    if (base < 0 || g_n_samples - base < 8) {
+        fprintf(stderr, "soak: too short to judge, run longer than warmup_sec ( %d ) plus a few samples\n", g_soak.warmup_sec);
+        return(true);
+    }
+
+    // the lowest of each in the last quarter
+    soak_sample_t *b = &g_samples[base];
+    soak_sample_t end = g_samples[g_n_samples - 1];
+    for (int i = g_n_samples - (g_n_samples - base) / 4; i < g_n_samples; i++) {
+        soak_sample_t *s = &g_samples[i];
+        if (s->rss_kb < end.rss_kb) end.rss_kb = s->rss_kb;
+        if (s->heap_kb < end.heap_kb) end.heap_kb = s->heap_kb;
+        if (s->free_kb < end.free_kb) end.free_kb = s->free_kb;
+        if (s->fds < end.fds) end.fds = s->fds;
+    }
+
+    long rss = end.rss_kb - b->rss_kb, heap = end.heap_kb - b->heap_kb;
+    int fds = end.fds - b->fds;
+    bool ok = rss <= g_soak.rss_growth_kb && heap <= g_soak.heap_growth_kb && fds <= g_soak.fd_growth;
+
+    fprintf(stderr, "soak: %s after %u s, %llu triggers ( %llu rejected ), %llu reloads\n",
+        ok ? "PASSED" : "FAILED", g_samples[g_n_samples - 1].t_sec,
+        (unsigned long long) g_triggers, (unsigned long long) g_rejected, (unsigned long long) g_reloads);
+    fprintf(stderr, "soak:   rss %+ld kB ( limit %ld ), heap in use %+ld kB ( limit %ld ), fds %+d ( limit %d )\n",
+        rss, g_soak.rss_growth_kb, heap, g_soak.heap_growth_kb, fds, g_soak.fd_growth);
+    fprintf(stderr, "soak:   heap free %ld kB to %ld kB, %.0f%% to %.0f%% of the heap\n",
+        b->free_kb, end.free_kb,
+        100.0 * b->free_kb / (b->free_kb + b->heap_kb + 1), 100.0 * end.free_kb / (end.free_kb + end.heap_kb + 1));
+    return(ok);
+}
+
+static void *soak_thread(void *arg) {
+
+    sa_trace_thread_name("soak");
+
+    uint64_t start = soak_now_ms();
+    uint64_t end = start + (uint64_t) (g_soak.hours * 3600.0f * 1000.0f);
+    uint64_t next_sample = start, next_reload = start + (uint64_t) g_soak.reload_sec * 1000;
+    uint64_t next_targets = start;
+    uint64_t gap_ms = g_soak.triggers_per_sec > 0 ? (uint64_t) (1000.0f / g_soak.triggers_per_sec) : 1000;
+    if (gap_ms < 1) gap_ms = 1;     // a trigger a millisecond is as fast as it goes, not a spin
+    bool loaded = false;
+
+    char **targets = NULL;
+    int n_targets = 0;
+
+    fprintf(stderr, "soak: %.2f hours, %.1f triggers a second, reload every %d s\n",
+        g_soak.hours, g_soak.triggers_per_sec, g_soak.reload_sec);
+
+    for (;;) {
+        uint64_t now = soak_now_ms();
+        if (now >= end) break;
+
+        // the names change with a reload; a few stale ones just get rejected
+        if (now >= next_targets) {
+            soak_targets_free(targets, n_targets);
+            n_targets = sa_scene_targets(&targets);
+            next_targets = now + 1000;
+        }
+
+        if (g_soak.triggers_per_sec > 0 && n_targets > 0) soak_trigger(targets, n_targets);
+
+        if (g_soak.reload_sec > 0 && now >= next_reload) {
+            kill(getpid(), SIGHUP);
+            g_reloads++;
+            next_reload = now + (uint64_t) g_soak.reload_sec * 1000;
+        }
+
+        if (now >= next_sample) {
+            // nothing counts until the cache has stopped growing
+            if (!loaded) {
+                sa_cache_stats_t cs;
+                sa_cache_stats(&cs);
+                loaded = cs.fully_loaded_ms >= 0;
+                if (!loaded) start = now;
+            }
+            if (g_n_samples == g_samples_size) {
+                g_samples_size = g_samples_size ? g_samples_size * 2 : 256;
+                g_samples = realloc(g_samples, g_samples_size * sizeof(soak_sample_t));
+            }
+            soak_sample_t *s = &g_samples[g_n_samples++];
+            soak_measure(s);
+            s->t_sec = (uint32_t) ((now - start) / 1000);
+            if (!loaded) g_n_samples--;     // logged, not kept
+            fprintf(stderr, "soak: %u s rss %ld kB heap %ld kB free %ld kB fds %d triggers %llu reloads %llu\n",
+                s->t_sec, s->rss_kb, s->heap_kb, s->free_kb, s->fds,
+                (unsigned long long) g_triggers, (unsigned long long) g_reloads);
+            next_sample = now + (uint64_t) g_soak.sample_sec * 1000;
+        }
+
+        if (!soak_sleep(gap_ms)) break;
+    }
+    soak_targets_free(targets, n_targets);
+
+    g_soak_failed = !soak_judge();
+
+    // done on our own; have the mainloop wind everything up
+    pthread_mutex_lock(&g_soak_lock);
+    bool stopping = g_soak_stop;
+    pthread_mutex_unlock(&g_soak_lock);
+    if (!stopping) kill(getpid(), SIGINT);
+    return(NULL);
+}
+
+bool sa_soak_start(const sa_soak_config_t *cfg) {
+
+    g_soak = *cfg;
+    if (g_soak.sample_sec < 1) g_soak.sample_sec = 1;
+    g_soak_rand ^= (uint32_t) time(NULL);
+    if (g_soak_rand == 0) g_soak_rand = 1;
+
+    int r = pthread_create(&g_soak_thread, NULL, soak_thread, NULL);
+    if (r != 0) {
+        fprintf(stderr, "soak: could not start: %s\n", strerror(r));
+        return(false);
+    }
+    g_soak_started = true;
+    return(true);
+}
+
+// before the scene goes; false if the run failed
+bool sa_soak_done(void) {
+
+    if (!g_soak_started) return(true);
+
+    pthread_mutex_lock(&g_soak_lock);
+    g_soak_stop = true;
+    pthread_cond_signal(&g_soak_cond);
+    pthread_mutex_unlock(&g_soak_lock);
+    pthread_join(g_soak_thread, NULL);
+    g_soak_started = false;
+
+    free(g_samples);
+    g_samples = NULL;
+    g_n_samples = g_samples_size = 0;
+    return(!g_soak_failed);
+}
@@ -0,0 +1,282 @@
+/***
+  SerenityAudio
+
+  Timers. Everything that wants to happen "later" on the mainloop goes through here:
+  a binary min-heap of deadlines, with a single timerfd armed for whatever is due
+  first and watched by the mainloop like any other fd. Nothing wakes up unless
+  something is due, there's no fixed tick, and cancel is O(log n) because each
+  timer remembers where it sits in the heap.
+
+  Deadlines are on CLOCK_MONOTONIC. A Pi has no RTC, so the wall clock jumps when
+  NTP gets its answer after boot, and a pa_time_event ( which is wall clock ) would
+  then stall or fire everything at once.
+
+  Timers are owned by the caller ( usually embedded in some struct ) so there is
+  no allocation per schedule and cancel is always safe, pending or not.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "saplay.h"
+
+// anything due within this much of the earliest deadline runs on the same wakeup
+#define TIMER_SLACK_USEC 1000
+
+#define TIMER_HEAP_INITIAL 64
+
+static pa_mainloop_api *g_timer_api = NULL;
+static pa_io_event *g_timer_io = NULL;
+static int g_timer_fd = -1;
+
+static sa_timer_t **g_heap = NULL;
+static int g_heap_n = 0;
+static int g_heap_alloc = 0;
+
+static bool g_dispatching = false;
+
+// stats; written by the mainloop, read by the http threads
+static _Atomic uint64_t g_wakeups = 0;
+static _Atomic uint64_t g_fired = 0;
+static _Atomic uint32_t g_wakeup_rate_milli = 0; // wakeups/sec * 1000, last full window
+static _Atomic int g_pending = 0;
+static pa_usec_t g_window_start = 0;
+static uint64_t g_window_wakeups = 0;
+
+static pa_usec_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((pa_usec_t) ts.tv_sec * PA_USEC_PER_SEC + (pa_usec_t) ts.tv_nsec / 1000);
+}
+
+/*
+** heap plumbing
+*/
+
+static inline void heap_set(int i, sa_timer_t *t) {
+    g_heap[i] = t;
+    t->heap_idx = i;
+}
+
+static void heap_up(int i) {
+    sa_timer_t *t = g_heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (g_heap[parent]->when <= t->when) break;
+        heap_set(i, g_heap[parent]);
+        i = parent;
+    }
+    heap_set(i, t);
+}
+
+static void heap_down(int i) {
+    sa_timer_t *t = g_heap[i];
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= g_heap_n) break;
+        if (child + 1 < g_heap_n && g_heap[child + 1]->when < g_heap[child]->when) child++;
+        if (t->when <= g_heap[child]->when) break;
+        heap_set(i, g_heap[child]);
+        i = child;
+    }
+    heap_set(i, t);
+}
+
+static void heap_remove(sa_timer_t *t) {
+    int i = t->heap_idx;
+    assert(i >= 0 && i < g_heap_n && g_heap[i] == t);
+
+    t->heap_idx = -1;
+    g_heap_n--;
+    if (i == g_heap_n) return;
+
+    heap_set(i, g_heap[g_heap_n]);
+    if (i > 0 && g_heap[i]->when < g_heap[(i - 1) / 2]->when)
+        heap_up(i);
+    else
+        heap_down(i);
+}
+
+// point the timerfd at the earliest deadline, or disarm it
+static void timer_rearm(void) {
+
+    atomic_store_explicit(&g_pending, g_heap_n, memory_order_relaxed);
+
+    if (g_dispatching || g_timer_fd < 0) return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (g_heap_n > 0) {
+        // all zeroes would disarm it, and a deadline of 0 is long past anyway
+        pa_usec_t when = g_heap[0]->when ? g_heap[0]->when : 1;
+        its.it_value.tv_sec = (time_t) (when / PA_USEC_PER_SEC);
+        its.it_value.tv_nsec = (long) (when % PA_USEC_PER_SEC) * 1000;
+    }
+    if (timerfd_settime(g_timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        fprintf(stderr, "timer: timerfd_settime failed: %s\n", strerror(errno));
+    }
+}
+
+/* pa_io_event_cb_t */
+static void timer_dispatch(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t events, void *userdata) {
+
+    // clear the expiry count, or the mainloop sees it readable again straight away
+    uint64_t expired;
+    if (read(fd, &expired, sizeof(expired)) != sizeof(expired)) return;
+
+    pa_usec_t now = now_usec();
+
+    atomic_fetch_add_explicit(&g_wakeups, 1, memory_order_relaxed);
+    g_window_wakeups++;
+    if (now - g_window_start >= PA_USEC_PER_SEC) {
+        uint64_t rate = g_window_wakeups * PA_USEC_PER_SEC * 1000 / (now - g_window_start);
+        atomic_store_explicit(&g_wakeup_rate_milli, (uint32_t) rate, memory_order_relaxed);
+        g_window_start = now;
+        g_window_wakeups = 0;
+    }
+
+    // callbacks are free to schedule and cancel, including themselves; hold off
+    // re-arming until they're all done
+    g_dispatching = true;
+    SA_TRACE_BEGIN("timers", g_heap_n);
+    int fired = 0;
+
+    while (g_heap_n > 0 && g_heap[0]->when <= now + TIMER_SLACK_USEC) {
+        sa_timer_t *t = g_heap[0];
+        heap_remove(t);
+        atomic_fetch_add_explicit(&g_fired, 1, memory_order_relaxed);
+        fired++;
+        t->fn(t, t->userdata);
+    }
+
+    SA_TRACE_END("timers", fired);
+    g_dispatching = false;
+    timer_rearm();
+}
+
+/*
+** public
+*/
+
+bool sa_timer_init(pa_mainloop_api *api) {
+
+    g_timer_api = api;
+    g_heap_alloc = TIMER_HEAP_INITIAL;
+    g_heap = malloc(g_heap_alloc * sizeof(sa_timer_t *));
+    g_heap_n = 0;
+    g_window_start = now_usec();
+
+    // created disarmed, armed on first schedule
+    g_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (g_timer_fd < 0) {
+        fprintf(stderr, "timer: timerfd_create failed: %s\n", strerror(errno));
+        return(false);
+    }
+    g_timer_io = api->io_new(api, g_timer_fd, PA_IO_EVENT_INPUT, timer_dispatch, NULL);
+    if (g_timer_io == NULL) {
+        fprintf(stderr, "timer: io_new failed\n");
+        return(false);
+    }
+    return(true);
+}
+
+void sa_timer_done(void) {
+
+    if (g_timer_io) {
+        g_timer_api->io_free(g_timer_io);
+        g_timer_io = NULL;
+    }
+    if (g_timer_fd >= 0) {
+        close(g_timer_fd);
+        g_timer_fd = -1;
+    }
+    for (int i = 0; i < g_heap_n; i++) g_heap[i]->heap_idx = -1;
+    free(g_heap);
+    g_heap = NULL;
+    g_heap_n = g_heap_alloc = 0;
+}
+
+void sa_timer_setup(sa_timer_t *t, sa_timer_fn_t fn, void *userdata) {
+    t->fn = fn;
+    t->userdata = userdata;
+    t->when = 0;
+    t->heap_idx = -1;
+}
+
+// (re)schedule to fire delay_usec from now. Rescheduling a pending timer moves it.
+void sa_timer_schedule(sa_timer_t *t, pa_usec_t delay_usec) {
+    sa_timer_schedule_at(t, now_usec() + delay_usec);
+}
+
+void sa_timer_schedule_at(sa_timer_t *t, pa_usec_t when) {
+
+    assert(t->fn);
+
+    if (t->heap_idx >= 0) {
+        t->when = when;
+        heap_up(t->heap_idx);
+        heap_down(t->heap_idx);
+        timer_rearm();
+        return;
+    }
+
+    if (g_heap_n == g_heap_alloc) {
+        g_heap_alloc *= 2;
+        g_heap = realloc(g_heap, g_heap_alloc * sizeof(sa_timer_t *));
+        assert(g_heap);
+    }
+
+    t->when = when;
+    heap_set(g_heap_n, t);
+    g_heap_n++;
+    heap_up(g_heap_n - 1);
+    timer_rearm();
+}
+
+// fine to call on a timer that isn't pending
+void sa_timer_cancel(sa_timer_t *t) {
+
+    if (t->heap_idx < 0) return;
+    heap_remove(t);
+    timer_rearm();
+}
+
+pa_usec_t sa_timer_now(void) {
+    return(now_usec());
+}
+
+// any thread
+void sa_timer_stats(sa_timer_stats_t *stats) {
+    stats->wakeups = atomic_load_explicit(&g_wakeups, memory_order_relaxed);
+    stats->fired = atomic_load_explicit(&g_fired, memory_order_relaxed);
+    stats->wakeups_per_sec = atomic_load_explicit(&g_wakeup_rate_milli, memory_order_relaxed) / 1000.0;
+    stats->pending = atomic_load_explicit(&g_pending, memory_order_relaxed);
+}
@@ -0,0 +1,273 @@
+/***
+  SerenityAudio
+
+  Tracing. Each thread that records anything gets its own ring of fixed size
+  binary events - a timestamp, a static name, a phase and one number - so
+  recording is a clock read and four stores, no locks, no formatting, no
+  syscalls. When the ring is full the oldest events go.
+
+  Nothing is looked at until someone asks: GET /trace, or SIGUSR1 which writes
+  a file. Either way the rings are copied out and turned into Chrome's
+  trace_event JSON, which chrome://tracing or ui.perfetto.dev will open.
+
+  Names must be string literals ( or otherwise live forever ), since only the
+  pointer is kept.
+
+Copyright (c) 2019 Brian Bulkowski
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "saplay.h"
+
+#define TRACE_MASK (SA_TRACE_EVENTS - 1)
+#define TRACE_NAME_MAX 24
+
+_Static_assert((SA_TRACE_EVENTS & TRACE_MASK) == 0, "SA_TRACE_EVENTS must be a power of two");
+
+typedef struct trace_ring {
+    _Atomic uint64_t head;  // events ever written; only the owning thread moves it
+    int tid;
+    char name[TRACE_NAME_MAX];
+    sa_trace_event_t ev[SA_TRACE_EVENTS];
+} trace_ring_t;
+
+_Atomic bool g_trace_enabled = false;   // --trace or "trace": true in the config
+
+// rings are never freed while threads might still be writing; an exited
+// thread's ring stays so its history can still be dumped
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *g_rings[SA_TRACE_MAX_THREADS];
+static _Atomic int g_n_rings = 0;
+
+static __thread trace_ring_t *t_ring = NULL;
+static __thread bool t_ring_full = false;   // out of ring slots, stop trying
+
+static uint64_t g_epoch_ns = 0;
+
+static inline uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static trace_ring_t *trace_ring_get(void) {
+
+    if (t_ring) return(t_ring);
+    if (t_ring_full) return(NULL);
+
+    pthread_mutex_lock(&g_rings_lock);
+    int n = atomic_load(&g_n_rings);
+    if (n < SA_TRACE_MAX_THREADS) {
+        t_ring = calloc(1, sizeof(trace_ring_t));
+        if (t_ring) {
+            t_ring->tid = n + 1;
+            snprintf(t_ring->name, TRACE_NAME_MAX, "thread %d", n + 1);
+            g_rings[n] = t_ring;
+            atomic_store(&g_n_rings, n + 1);
+        }
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+
+    if (!t_ring) t_ring_full = true;
+    return(t_ring);
+}
+
+// use the SA_TRACE_ macros, they skip the call when tracing is off
+void sa_trace_event(const char *name, char ph, int64_t arg) {
+
+    trace_ring_t *r = trace_ring_get();
+    if (!r) return;
+
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    sa_trace_event_t *e = &r->ev[h & TRACE_MASK];
+    e->ts_ns = trace_now_ns();
+    e->name = name;
+    e->arg = arg;
+    e->ph = ph;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+// names the calling thread in the trace. Only the first call sticks, so it's
+// fine to call on every request from a pool thread.
+void sa_trace_thread_name(const char *name) {
+
+    if (t_ring) return;
+    trace_ring_t *r = trace_ring_get();
+    if (r) snprintf(r->name, TRACE_NAME_MAX, "%s %d", name, r->tid);
+}
+
+void sa_trace_init(void) {
+    g_epoch_ns = trace_now_ns();
+}
+
+void sa_trace_done(void) {
+
+    // only once every other thread has been joined
+    pthread_mutex_lock(&g_rings_lock);
+    int n = atomic_load(&g_n_rings);
+    for (int i = 0; i < n; i++) {
+        free(g_rings[i]);
+        g_rings[i] = NULL;
+    }
+    atomic_store(&g_n_rings, 0);
+    pthread_mutex_unlock(&g_rings_lock);
+    t_ring = NULL;
+}
+
+/*
+** export
+*/
+
+typedef struct {
+    char *buf;
+    size_t len, alloc;
+} trace_buf_t;
+
+static void tb_printf(trace_buf_t *tb, const char *fmt, ...) {
+
+    va_list ap;
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(tb->buf + tb->len, tb->alloc - tb->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if (tb->len + n < tb->alloc) {
+            tb->len += n;
+            return;
+        }
+        tb->alloc = (tb->alloc + n) * 2;
+        tb->buf = realloc(tb->buf, tb->alloc);
+    }
+}
+
+// copy out what's in a ring without stopping its writer. Anything the writer
+// may have lapped while we copied is dropped.
+static size_t trace_ring_copy(trace_ring_t *r, sa_trace_event_t *out) {
+
+    uint64_t h1 = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t lo = h1 > SA_TRACE_EVENTS ? h1 - SA_TRACE_EVENTS : 0;
+
+    for (uint64_t i = lo; i < h1; i++) out[i - lo] = r->ev[i & TRACE_MASK];
+
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t h2 = atomic_load_explicit(&r->head, memory_order_relaxed);
+    // the writer is either done with h2 - 1 or part way through h2, which is
+    // the slot that held h2 - SA_TRACE_EVENTS
+    uint64_t safe = h2 + 1 > SA_TRACE_EVENTS ? h2 + 1 - SA_TRACE_EVENTS : 0;
+    if (safe <= lo) return(h1 - lo);
+    if (safe >= h1) return(0);
+    memmove(out, out + (safe - lo), (h1 - safe) * sizeof(sa_trace_event_t));
+    return(h1 - safe);
+}
+
+// Chrome trace_event JSON of everything in the rings, malloc'd
+char *sa_trace_dump(size_t *len) {
+
+    trace_buf_t tb = { .buf = malloc(65536), .len = 0, .alloc = 65536 };
+    sa_trace_event_t *ev = malloc(SA_TRACE_EVENTS * sizeof(sa_trace_event_t));
+    bool first = true;
+
+    tb_printf(&tb, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    int n = atomic_load(&g_n_rings);
+    for (int i = 0; i < n; i++) {
+        trace_ring_t *r = g_rings[i];
+
+        tb_printf(&tb, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", r->tid, r->name);
+        first = false;
+
+        size_t n_ev = trace_ring_copy(r, ev);
+        for (size_t j = 0; j < n_ev; j++) {
+            sa_trace_event_t *e = &ev[j];
+            // events from before init ( there shouldn't be any ) land at 0
+            uint64_t ns = e->ts_ns > g_epoch_ns ? e->ts_ns - g_epoch_ns : 0;
+            tb_printf(&tb, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":1,\"tid\":%d%s,\"args\":{\"%s\":%lld}}",
+                e->name, e->ph, (unsigned long long) (ns / 1000), (unsigned) (ns % 1000), r->tid,
+                e->ph == 'i' ? ",\"s\":\"t\"" : "",
+                e->ph == 'C' ? "value" : "n", (long long) e->arg);
+        }
+    }
+
+    tb_printf(&tb, "\n]}\n");
+    free(ev);
+
+    *len = tb.len;
+    return(tb.buf);
+}
+
+bool sa_trace_dump_file(const char *path) {
+
+    size_t len;
+    char *json = sa_trace_dump(&len);
+
+    FILE *f = fopen(path, "w");
+    bool ok = f && fwrite(json, 1, len, f) == len;
+    if (f && fclose(f) != 0) ok = false;
+    free(json);
+
+    if (!ok) fprintf(stderr, "trace: could not write %s\n", path);
+    return(ok);
+}
+
+static _Atomic bool g_dumping = false;
+
+static void *trace_dump_thread(void *arg) {
+
+    char *path = arg;
+    if (sa_trace_dump_file(path)) fprintf(stderr, "trace written to %s\n", path);
+    free(path);
+    atomic_store(&g_dumping, false);
+    return(NULL);
+}
+
+// sa_trace_dump_file on a thread of its own, so the mainloop ( SIGUSR1 ) isn't
+// held up formatting megabytes of JSON while the buses wait. One at a time.
+bool sa_trace_dump_file_async(const char *path) {
+
+    if (atomic_exchange(&g_dumping, true)) {
+        fprintf(stderr, "trace: already writing one\n");
+        return(false);
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    char *copy = strdup(path);
+    int r = pthread_create(&thread, &attr, trace_dump_thread, copy);
+    pthread_attr_destroy(&attr);
+    if (r != 0) {
+        fprintf(stderr, "trace: could not start writer: %s\n", strerror(r));
+        free(copy);
+        atomic_store(&g_dumping, false);
+        return(false);
+    }
+    return(true);
+}